@@ -0,0 +1,3221 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_conv.c: iCalendar conversions
+ *
+ * Conversion of iCalendar components into RFC5545 iCal, RFC6321 xCal and
+ * RFC7265 jCal, along with timezone conversion and filtering. Shared by
+ * mod_ical and the icalconv command line tool.
+ */
+
+#include "apr_strings.h"
+#include "apr_lib.h"
+#include "apr_hash.h"
+#include "apr_time.h"
+
+#include "config.h"
+
+#include <libical/ical.h>
+#include <libical/icalclassify.h>
+#include <libical/icalrecur.h>
+
+#include <libxml/encoding.h>
+#include <libxml/xmlwriter.h>
+
+#ifdef HAVE_JSON_C_JSON_H
+#include <json-c/json.h>
+#endif
+#ifdef HAVE_JSON_H
+#include <json.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ical_conv.h"
+#include "ical_recur.h"
+#include "ical_tz.h"
+
+#define XCAL_HEADER "<?xml version=\"1.0\" encoding=\"utf-8\"?>" \
+  "<icalendar xmlns=\"urn:ietf:params:xml:ns:icalendar-2.0\">"
+#define XCAL_FOOTER "</icalendar>"
+
+static apr_status_t xmlbuffer_cleanup(void *data)
+{
+    xmlBufferPtr buf = data;
+    xmlBufferFree(buf);
+    return APR_SUCCESS;
+}
+
+static apr_status_t xmlfree_cleanup(void *data)
+{
+    xmlFree(data);
+    return APR_SUCCESS;
+}
+
+static void icalbuffer_free(void *data)
+{
+    icalmemory_free_buffer(data);
+}
+
+static apr_status_t icalbuffer_cleanup(void *data)
+{
+    icalbuffer_free(data);
+    return APR_SUCCESS;
+}
+
+static apr_status_t xmlwriter_cleanup(void *data)
+{
+    xmlTextWriterPtr writer = data;
+    xmlFreeTextWriter(writer);
+    return APR_SUCCESS;
+}
+
+static char *strlwr(char *str)
+{
+    apr_size_t i;
+    apr_size_t len;
+
+    if (str) {
+        len = strlen(str);
+
+        for (i = 0; i < len; i++)
+            str[i] = apr_tolower((unsigned char) str[i]);
+
+    }
+
+    return str;
+}
+
+/*
+ * Lowercase names of each kind of component, property, parameter and
+ * value, worked out once per process. Names that are not in the tables,
+ * such as X- and IANA names, are interned once per conversion.
+ */
+
+#define ICAL_NAMES_COMPONENTS 64
+
+static const char *component_names[ICAL_NAMES_COMPONENTS];
+static const char *property_names[ICAL_NO_PROPERTY + 1];
+static const char *parameter_names[ICAL_NO_PARAMETER + 1];
+static const char *value_names[ICAL_NO_VALUE - ICAL_ANY_VALUE + 1];
+
+static const char *name_lower(apr_pool_t *pool, const char *name)
+{
+    return name ? strlwr(apr_pstrdup(pool, name)) : NULL;
+}
+
+void ical_names_init(apr_pool_t *pool)
+{
+    int i;
+
+    if (property_names[ICAL_DTSTART_PROPERTY]) {
+        return;
+    }
+
+    for (i = 0; i < ICAL_NAMES_COMPONENTS; i++) {
+        component_names[i] = name_lower(pool,
+                icalcomponent_kind_to_string((icalcomponent_kind) i));
+    }
+    for (i = ICAL_ANY_PROPERTY; i < ICAL_NO_PROPERTY; i++) {
+        property_names[i] = name_lower(pool,
+                icalproperty_kind_to_string((icalproperty_kind) i));
+    }
+    for (i = ICAL_ANY_PARAMETER; i < ICAL_NO_PARAMETER; i++) {
+        parameter_names[i] = name_lower(pool,
+                icalparameter_kind_to_string((icalparameter_kind) i));
+    }
+    for (i = ICAL_ANY_VALUE; i < ICAL_NO_VALUE; i++) {
+        value_names[i - ICAL_ANY_VALUE] = name_lower(pool,
+                icalvalue_kind_to_string((icalvalue_kind) i));
+    }
+}
+
+static const char *name_intern(ical_conv *conv, const char *name)
+{
+    const char *lower;
+
+    if (!name) {
+        return NULL;
+    }
+
+    if (!conv->names) {
+        conv->names = apr_hash_make(conv->pool);
+    }
+
+    lower = apr_hash_get(conv->names, name, APR_HASH_KEY_STRING);
+    if (!lower) {
+        lower = name_lower(conv->pool, name);
+        apr_hash_set(conv->names, apr_pstrdup(conv->pool, name),
+                APR_HASH_KEY_STRING, lower);
+    }
+
+    return lower;
+}
+
+static const char *component_name(ical_conv *conv, icalcomponent_kind kind)
+{
+    if (kind >= 0 && kind < ICAL_NAMES_COMPONENTS && component_names[kind]) {
+        return component_names[kind];
+    }
+
+    return name_intern(conv, icalcomponent_kind_to_string(kind));
+}
+
+static const char *property_name(ical_conv *conv, icalproperty_kind kind)
+{
+    if (kind >= 0 && kind < ICAL_NO_PROPERTY && property_names[kind]) {
+        return property_names[kind];
+    }
+
+    return name_intern(conv, icalproperty_kind_to_string(kind));
+}
+
+static const char *parameter_name(ical_conv *conv, icalparameter_kind kind)
+{
+    if (kind >= 0 && kind < ICAL_NO_PARAMETER && parameter_names[kind]) {
+        return parameter_names[kind];
+    }
+
+    return name_intern(conv, icalparameter_kind_to_string(kind));
+}
+
+static const char *value_name(ical_conv *conv, icalvalue_kind kind)
+{
+    if (kind >= ICAL_ANY_VALUE && kind < ICAL_NO_VALUE
+            && value_names[kind - ICAL_ANY_VALUE]) {
+        return value_names[kind - ICAL_ANY_VALUE];
+    }
+
+    return name_intern(conv, icalvalue_kind_to_string(kind));
+}
+
+#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP
+static const char *icalrecur_weekday_to_string(icalrecurrencetype_weekday kind)
+{
+    switch (kind) {
+    case ICAL_SUNDAY_WEEKDAY: {
+        return "SU";
+    }
+    case ICAL_MONDAY_WEEKDAY: {
+        return "MO";
+    }
+    case ICAL_TUESDAY_WEEKDAY: {
+        return "TU";
+    }
+    case ICAL_WEDNESDAY_WEEKDAY: {
+        return "WE";
+    }
+    case ICAL_THURSDAY_WEEKDAY: {
+        return "TH";
+    }
+    case ICAL_FRIDAY_WEEKDAY: {
+        return "FR";
+    }
+    case ICAL_SATURDAY_WEEKDAY: {
+        return "SA";
+    }
+    default: {
+        return "UNKNOWN";
+    }
+    }
+}
+#endif
+
+#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP || !HAVE_ICALRECURRENCETYPE_MONTH_MONTH
+#define ICAL_LEAP_MONTH 0x1000
+#endif
+
+#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP
+static int icalrecurrencetype_month_is_leap(short month)
+{
+    return (month & ICAL_LEAP_MONTH);
+}
+#endif
+
+#if !HAVE_ICALRECURRENCETYPE_MONTH_MONTH
+static int icalrecurrencetype_month_month(short month)
+{
+    return (month & ~ICAL_LEAP_MONTH);
+}
+#endif
+
+/*
+ * The component tree is walked once by the visitor below, which describes
+ * what it finds as a series of events. Each output is a backend that turns
+ * the events into iCal, xCal or jCal, and any number of backends can be
+ * driven by the same walk.
+ */
+
+typedef enum {
+    ICAL_EVENT_COMPONENT_START,
+    ICAL_EVENT_COMPONENT_END,
+    ICAL_EVENT_PROPERTIES_START,
+    ICAL_EVENT_PROPERTIES_END,
+    ICAL_EVENT_COMPONENTS_START,
+    ICAL_EVENT_COMPONENTS_END,
+    ICAL_EVENT_PROPERTY_START,
+    ICAL_EVENT_PROPERTY_END,
+    ICAL_EVENT_PARAMETERS_START,
+    ICAL_EVENT_PARAMETERS_END,
+    ICAL_EVENT_PARAMETER,
+    ICAL_EVENT_VALUE_START,
+    ICAL_EVENT_VALUE_END,
+    ICAL_EVENT_TEXT,
+    ICAL_EVENT_LIST_START,
+    ICAL_EVENT_LIST_END,
+    ICAL_EVENT_OBJECT_START,
+    ICAL_EVENT_OBJECT_END,
+    ICAL_EVENT_MEMBERS_START,
+    ICAL_EVENT_MEMBERS_END,
+    ICAL_EVENT_MEMBER,
+    ICAL_EVENT_MEMBER_INT,
+    ICAL_EVENT_MEMBER_DOUBLE
+} ical_event_e;
+
+typedef struct ical_event {
+    ical_event_e type;
+    const char *name; /* element, member or type name */
+    const char *str; /* string value */
+    int num; /* integer value, value kind, or non zero when empty */
+    double dbl; /* floating point value */
+    icalcomponent *comp; /* component being started */
+} ical_event;
+
+typedef struct ical_backend ical_backend;
+
+struct ical_backend {
+    apr_status_t (*event)(ical_backend *backend, const ical_event *event);
+    apr_status_t (*finish)(ical_backend *backend, ical_fragment *frag);
+    ical_conv *conv;
+    ap_ical_output_e output; /* output written by this backend */
+    int document; /* write a complete document, not a fragment */
+    int stream; /* write the document to the brigade as we go */
+};
+
+typedef struct ical_emitter {
+    ical_backend *backends[ICAL_OUTPUT_COUNT];
+    int count;
+    int depth; /* depth of the component being visited */
+    apr_pool_t *scratch; /* cleared after each top level subcomponent */
+    apr_size_t used; /* bytes allocated from scratch since cleared */
+} ical_emitter;
+
+static apr_status_t emit(ical_emitter *emitter, const ical_event *event)
+{
+    apr_status_t rv;
+    int i;
+
+    for (i = 0; i < emitter->count; i++) {
+        rv = emitter->backends[i]->event(emitter->backends[i], event);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t emit_str(ical_emitter *emitter, ical_event_e type,
+        const char *name, const char *str)
+{
+    ical_event event = { 0 };
+
+    event.type = type;
+    event.name = name;
+    event.str = str;
+
+    return emit(emitter, &event);
+}
+
+static apr_status_t emit_num(ical_emitter *emitter, ical_event_e type,
+        const char *name, int num)
+{
+    ical_event event = { 0 };
+
+    event.type = type;
+    event.name = name;
+    event.num = num;
+
+    return emit(emitter, &event);
+}
+
+/*
+ * Temporary values last until the top level subcomponent containing them
+ * has been written, rather than until the end of the request.
+ */
+static void *scratch_alloc(ical_conv *conv, ical_emitter *emitter,
+        apr_size_t size)
+{
+    if (!emitter->scratch) {
+        apr_pool_create(&emitter->scratch,
+                conv->scratch ? conv->scratch : conv->pool);
+    }
+
+    emitter->used += size;
+    if (emitter->used > conv->stats.scratch_peak) {
+        conv->stats.scratch_peak = emitter->used;
+    }
+
+    return apr_palloc(emitter->scratch, size);
+}
+
+static const char *scratch_strdup(ical_conv *conv, ical_emitter *emitter,
+        const char *str)
+{
+    apr_size_t len = strlen(str) + 1;
+
+    return memcpy(scratch_alloc(conv, emitter, len), str, len);
+}
+
+static void scratch_clear(ical_emitter *emitter)
+{
+    if (emitter->scratch) {
+        apr_pool_clear(emitter->scratch);
+        emitter->used = 0;
+    }
+}
+
+/* write to the brigade in the context, and pass it on every flush_size
+ * bytes if we can.
+ */
+static apr_status_t ical_output_pass(ical_conv *conv, apr_size_t len)
+{
+    conv->buffered += len;
+    if (conv->flush && conv->buffered >= conv->flush_size) {
+        conv->buffered = 0;
+        return conv->flush(conv->bb, conv->flush_ctx);
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t ical_output(ical_conv *conv, const char *data,
+        apr_size_t len)
+{
+    apr_bucket *last = APR_BRIGADE_EMPTY(conv->bb) ? NULL :
+            APR_BRIGADE_LAST(conv->bb);
+    apr_status_t rv;
+
+    rv = apr_brigade_write(conv->bb, NULL, NULL, data, len);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* did the brigade need a new buffer? */
+    if (APR_BRIGADE_LAST(conv->bb) != last) {
+        conv->stats.allocs++;
+        conv->stats.alloc_bytes +=
+                len > APR_BUCKET_BUFF_SIZE ? len : APR_BUCKET_BUFF_SIZE;
+    }
+
+    return ical_output_pass(conv, len);
+}
+
+/* hand a buffer from libical to the brigade in the context, without a
+ * copy, to be freed by libical when the bucket is done with.
+ */
+static apr_status_t ical_output_handoff(ical_conv *conv, char *data,
+        apr_size_t len)
+{
+    APR_BRIGADE_INSERT_TAIL(conv->bb, apr_bucket_heap_create(data, len,
+            icalbuffer_free, conv->bb->bucket_alloc));
+
+    return ical_output_pass(conv, len);
+}
+
+/*
+ * Dates and times are written with fixed width digits into a buffer on the
+ * stack, two digits at a time.
+ */
+
+#define ICAL_PERIOD_SIZE (ICAL_TIME_SIZE * 2)
+
+static const char digit_pairs[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+
+static char *digits2(char *buf, int num)
+{
+    memcpy(buf, digit_pairs + num * 2, 2);
+    return buf + 2;
+}
+
+static char *digits4(char *buf, int num)
+{
+    return digits2(digits2(buf, num / 100), num % 100);
+}
+
+static const char *icaldate_to_string(char *buf, struct icaltimetype tt)
+{
+    char *pos = buf;
+
+    if (tt.year < 0 || tt.year > 9999 || tt.month < 0 || tt.month > 99
+            || tt.day < 0 || tt.day > 99) {
+        apr_snprintf(buf, ICAL_TIME_SIZE, "%04d-%02d-%02d", tt.year,
+                tt.month, tt.day);
+        return buf;
+    }
+
+    pos = digits4(pos, tt.year);
+    *pos++ = '-';
+    pos = digits2(pos, tt.month);
+    *pos++ = '-';
+    pos = digits2(pos, tt.day);
+    *pos = 0;
+
+    return buf;
+}
+
+static const char *icaldatetime_to_string(char *buf, struct icaltimetype tt)
+{
+    char *pos = buf;
+
+    if (tt.year < 0 || tt.year > 9999 || tt.month < 0 || tt.month > 99
+            || tt.day < 0 || tt.day > 99 || tt.hour < 0 || tt.hour > 99
+            || tt.minute < 0 || tt.minute > 99 || tt.second < 0
+            || tt.second > 99) {
+        apr_snprintf(buf, ICAL_TIME_SIZE, "%04d-%02d-%02dT%02d:%02d:%02d%s",
+                tt.year, tt.month, tt.day, tt.hour, tt.minute, tt.second,
+                icaltime_is_utc(tt) ? "Z" : "");
+        return buf;
+    }
+
+    pos = digits4(pos, tt.year);
+    *pos++ = '-';
+    pos = digits2(pos, tt.month);
+    *pos++ = '-';
+    pos = digits2(pos, tt.day);
+    *pos++ = 'T';
+    pos = digits2(pos, tt.hour);
+    *pos++ = ':';
+    pos = digits2(pos, tt.minute);
+    *pos++ = ':';
+    pos = digits2(pos, tt.second);
+    if (icaltime_is_utc(tt)) {
+        *pos++ = 'Z';
+    }
+    *pos = 0;
+
+    return buf;
+}
+
+static const char *icaltime_to_string(char *buf, struct icaltimetype tt)
+{
+    return tt.is_date ? icaldate_to_string(buf, tt) :
+            icaldatetime_to_string(buf, tt);
+}
+
+const char *ical_format_time(char *buf, struct icaltimetype tt)
+{
+    return icaltime_to_string(buf, tt);
+}
+
+/* as written by libical: hours, minutes, and seconds if not zero */
+static const char *icalutcoffset_to_string(char *buf, int offset)
+{
+    char *pos = buf;
+    int h, m, sec;
+
+    *pos++ = offset < 0 ? '-' : '+';
+
+    h = offset / 3600;
+    m = (offset - h * 3600) / 60;
+    sec = offset - h * 3600 - m * 60;
+
+    h = abs(h) > 23 ? 23 : abs(h);
+    m = abs(m) > 59 ? 59 : abs(m);
+    sec = abs(sec) > 59 ? 59 : abs(sec);
+
+    pos = digits2(pos, h);
+    pos = digits2(pos, m);
+    if (sec) {
+        pos = digits2(pos, sec);
+    }
+    *pos = 0;
+
+    return buf;
+}
+
+static const char *icalduration_to_string(ical_conv *conv,
+        ical_emitter *emitter, struct icaldurationtype duration)
+{
+    char *str = icaldurationtype_as_ical_string_r(duration);
+    const char *result = scratch_strdup(conv, emitter, str);
+    icalmemory_free_buffer(str);
+    return result;
+}
+
+static apr_status_t icalrecurrence_by_visit(ical_emitter *emitter,
+        const char *element, short *array, short limit)
+{
+    apr_status_t rv;
+    int i;
+
+    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_START, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+
+            rv = emit_num(emitter, ICAL_EVENT_MEMBER_INT, element, array[i]);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_END, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t icalrecurrence_byday_visit(ical_conv *conv,
+        ical_emitter *emitter, const char *element, short *array, short limit)
+{
+    apr_status_t rv;
+    int i;
+
+    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_START, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+
+            int pos = icalrecurrencetype_day_position(array[i]);
+            int dow = icalrecurrencetype_day_day_of_week(array[i]);
+            const char *daystr = icalrecur_weekday_to_string(dow);
+
+            if (pos == 0) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element, daystr);
+            }
+            else {
+                char buf[16];
+
+                apr_snprintf(buf, sizeof(buf), "%d%s", pos, daystr);
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element, buf);
+            }
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_END, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t icalrecurrence_bymonth_visit(ical_conv *conv,
+        ical_emitter *emitter, const char *element, short *array, short limit)
+{
+    apr_status_t rv;
+    int i;
+
+    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_START, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+
+            /* rfc7529 introduces the leap month */
+            if (icalrecurrencetype_month_is_leap(array[i])) {
+                char buf[16];
+
+                apr_snprintf(buf, sizeof(buf), "%dL",
+                        icalrecurrencetype_month_month(array[i]));
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element, buf);
+            }
+            else {
+                rv = emit_num(emitter, ICAL_EVENT_MEMBER_INT, element,
+                        icalrecurrencetype_month_month(array[i]));
+            }
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        rv = emit_str(emitter, ICAL_EVENT_MEMBERS_END, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t icalrecurrencetype_visit(ical_conv *conv,
+        ical_emitter *emitter, struct icalrecurrencetype *recur)
+{
+    char buf[ICAL_TIME_SIZE];
+    apr_status_t rv;
+
+    rv = emit_str(emitter, ICAL_EVENT_OBJECT_START, NULL, NULL);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (recur->freq != ICAL_NO_RECURRENCE) {
+
+        if (recur->until.year != 0) {
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, "until",
+                    icaltime_to_string(buf, recur->until));
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        if (recur->count != 0) {
+
+            rv = emit_num(emitter, ICAL_EVENT_MEMBER_INT, "count",
+                    recur->count);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        if (recur->interval != 1) {
+
+            rv = emit_num(emitter, ICAL_EVENT_MEMBER_INT, "interval",
+                    recur->interval);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "bysecond", recur->by_second,
+                ICAL_BY_SECOND_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "byminute", recur->by_minute,
+                ICAL_BY_MINUTE_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "byhour", recur->by_hour,
+                ICAL_BY_HOUR_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_byday_visit(conv, emitter, "byday", recur->by_day,
+                ICAL_BY_DAY_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "bymonthday",
+                recur->by_month_day, ICAL_BY_MONTHDAY_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "byyearday", recur->by_year_day,
+                ICAL_BY_YEARDAY_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "byweekno", recur->by_week_no,
+                ICAL_BY_WEEKNO_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_bymonth_visit(conv, emitter, "bymonth",
+                recur->by_month, ICAL_BY_MONTH_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        rv = icalrecurrence_by_visit(emitter, "bysetpos", recur->by_set_pos,
+                ICAL_BY_SETPOS_SIZE);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* Monday is the default, so no need to write that out */
+        if (recur->week_start != ICAL_MONDAY_WEEKDAY
+                && recur->week_start != ICAL_NO_WEEKDAY) {
+
+            int dow = icalrecurrencetype_day_day_of_week(recur->week_start);
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, "wkst",
+                    icalrecur_weekday_to_string(dow));
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+        }
+
+    }
+
+    return emit_str(emitter, ICAL_EVENT_OBJECT_END, NULL, NULL);
+}
+
+static const char *icalvalue_element(ical_conv *conv, icalvalue_kind kind)
+{
+    const char *element = NULL;
+
+    /* work out the value type */
+    if (kind != ICAL_X_VALUE) {
+        element = value_name(conv, kind);
+    }
+    if (!element) {
+        element = "unknown";
+    }
+
+    return element;
+}
+
+/* a period within a list is written as start and end or duration */
+static const char *icalperiod_to_string(char *buf,
+        struct icalperiodtype period)
+{
+    apr_size_t len;
+
+    icaltime_to_string(buf, period.start);
+    len = strlen(buf);
+    buf[len++] = '/';
+
+    if (!icaltime_is_null_time(period.end)) {
+        icaltime_to_string(buf + len, period.end);
+    }
+    else {
+        char *str = icaldurationtype_as_ical_string_r(period.duration);
+        apr_cpystrn(buf + len, str, ICAL_PERIOD_SIZE - len);
+        icalmemory_free_buffer(str);
+    }
+
+    return buf;
+}
+
+/*
+ * The string form of a value is a list separated by commas, a comma
+ * escaped with a backslash is part of the text. Each item is unescaped in
+ * place within a single copy of the text.
+ */
+static apr_status_t icalvalue_string_multi_visit(ical_conv *conv,
+        ical_emitter *emitter, const char *element, const char *text)
+{
+    char buf[256];
+    char *copy = buf, *token, *dst;
+    const char *src;
+    apr_size_t len;
+    apr_status_t rv;
+
+    if (!text) {
+        return APR_SUCCESS;
+    }
+
+    len = strlen(text);
+    if (len >= sizeof(buf)) {
+        copy = scratch_alloc(conv, emitter, len + 1);
+    }
+
+    token = dst = copy;
+    for (src = text; *src; src++) {
+
+        if (*src == '\\' && src[1] == ',') {
+            *dst++ = *++src;
+        }
+        else if (*src == ',') {
+            *dst++ = 0;
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, element, token);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            token = dst;
+        }
+        else {
+            *dst++ = *src;
+        }
+
+    }
+    *dst = 0;
+
+    return emit_str(emitter, ICAL_EVENT_MEMBER, element, token);
+}
+
+static apr_status_t icalvalue_multi_visit(ical_conv *conv,
+        ical_emitter *emitter, icalvalue *val)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (val) {
+        icalvalue_kind kind = icalvalue_isa(val);
+        const char *element = icalvalue_element(conv, kind);
+        char buf[ICAL_PERIOD_SIZE];
+
+        /* write out each value */
+        switch (kind) {
+        case ICAL_TEXT_VALUE: {
+            const char *text = icalvalue_get_text(val);
+
+            /* already unescaped, and already split into a property for
+             * each item by the parser, so any comma is part of the text.
+             */
+            if (text) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element, text);
+            }
+            break;
+        }
+        case ICAL_DATE_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, element,
+                    icaldate_to_string(buf, icalvalue_get_date(val)));
+            break;
+        }
+        case ICAL_DATETIME_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, element,
+                    icaldatetime_to_string(buf,
+                            icalvalue_get_datetime(val)));
+            break;
+        }
+        case ICAL_PERIOD_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, element,
+                    icalperiod_to_string(buf, icalvalue_get_period(val)));
+            break;
+        }
+        case ICAL_DATETIMEPERIOD_VALUE: {
+            struct icaldatetimeperiodtype datetimeperiod =
+                    icalvalue_get_datetimeperiod(val);
+
+            if (!icaltime_is_null_time(datetimeperiod.time)) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element,
+                        icaltime_to_string(buf, datetimeperiod.time));
+            }
+            else {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, element,
+                        icalperiod_to_string(buf, datetimeperiod.period));
+            }
+            break;
+        }
+        default: {
+            /* if we don't recognise it, split the string form */
+            char *str = icalvalue_as_ical_string_r(val);
+            if (str) {
+                rv = icalvalue_string_multi_visit(conv, emitter, element,
+                        str);
+                icalmemory_free_buffer(str);
+            }
+            break;
+        }
+        }
+
+    }
+
+    return rv;
+}
+
+static apr_status_t icalvalue_visit(ical_conv *conv, ical_emitter *emitter,
+        icalvalue *val)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (val) {
+        icalvalue_kind kind = icalvalue_isa(val);
+        const char *element = icalvalue_element(conv, kind);
+        char buf[ICAL_TIME_SIZE];
+
+        /* open value */
+        rv = emit_num(emitter, ICAL_EVENT_VALUE_START, element, kind);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* handle each type */
+        switch (kind) {
+        case ICAL_ACTION_VALUE:
+        case ICAL_ATTACH_VALUE:
+        case ICAL_BINARY_VALUE:
+        case ICAL_BOOLEAN_VALUE:
+        case ICAL_CALADDRESS_VALUE:
+        case ICAL_CARLEVEL_VALUE:
+        case ICAL_CLASS_VALUE:
+        case ICAL_CMD_VALUE:
+        case ICAL_FLOAT_VALUE:
+        case ICAL_INTEGER_VALUE:
+        case ICAL_METHOD_VALUE:
+        case ICAL_QUERY_VALUE:
+        case ICAL_QUERYLEVEL_VALUE:
+        case ICAL_STATUS_VALUE:
+        case ICAL_STRING_VALUE:
+        case ICAL_TRANSP_VALUE:
+        case ICAL_URI_VALUE:
+        {
+            char *str = icalvalue_as_ical_string_r(val);
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL, str);
+            icalmemory_free_buffer(str);
+
+            break;
+        }
+        case ICAL_UTCOFFSET_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL,
+                    icalutcoffset_to_string(buf, icalvalue_get_utcoffset(val)));
+
+            break;
+        }
+        case ICAL_GEO_VALUE: {
+            struct icalgeotype geo = icalvalue_get_geo(val);
+            ical_event event = { 0 };
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_START, NULL, NULL);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            event.type = ICAL_EVENT_MEMBER_DOUBLE;
+            event.name = "latitude";
+            event.dbl = geo.lat;
+            rv = emit(emitter, &event);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            event.name = "longitude";
+            event.dbl = geo.lon;
+            rv = emit(emitter, &event);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_END, NULL, NULL);
+
+            break;
+        }
+        case ICAL_TEXT_VALUE: {
+            /* we explicitly don't escape text here */
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL,
+                    icalvalue_get_text(val));
+
+            break;
+        }
+        case ICAL_REQUESTSTATUS_VALUE: {
+            struct icalreqstattype requeststatus = icalvalue_get_requeststatus(val);
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_START, NULL, NULL);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, "code",
+                    icalenum_reqstat_code(requeststatus.code));
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, "description",
+                    requeststatus.desc);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            if (requeststatus.debug) {
+
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "data",
+                        requeststatus.debug);
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_END, NULL, NULL);
+
+            break;
+        }
+        case ICAL_PERIOD_VALUE: {
+            struct icalperiodtype period = icalvalue_get_period(val);
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_START, NULL, NULL);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_MEMBER, "start",
+                    icaltime_to_string(buf, period.start));
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            if (!icaltime_is_null_time(period.end)) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "end",
+                        icaltime_to_string(buf, period.start));
+            }
+            else {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "duration",
+                        icalduration_to_string(conv, emitter,
+                                period.duration));
+            }
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_END, NULL, NULL);
+
+            break;
+        }
+        case ICAL_DATETIMEPERIOD_VALUE: {
+            struct icaldatetimeperiodtype datetimeperiod =
+                    icalvalue_get_datetimeperiod(val);
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_START, NULL, NULL);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            if (!icaltime_is_null_time(datetimeperiod.time)) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "time",
+                        icaltime_to_string(buf, datetimeperiod.time));
+            }
+            else {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "start",
+                        icaltime_to_string(buf,
+                                datetimeperiod.period.start));
+                if (rv != APR_SUCCESS) {
+                    return rv;
+                }
+
+                if (!icaltime_is_null_time(datetimeperiod.period.end)) {
+                    rv = emit_str(emitter, ICAL_EVENT_MEMBER, "end",
+                            icaltime_to_string(buf,
+                                    datetimeperiod.period.start));
+                }
+                else {
+                    rv = emit_str(emitter, ICAL_EVENT_MEMBER, "duration",
+                            icalduration_to_string(conv, emitter,
+                                    datetimeperiod.period.duration));
+                }
+            }
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            rv = emit_str(emitter, ICAL_EVENT_LIST_END, NULL, NULL);
+
+            break;
+        }
+        case ICAL_DURATION_VALUE: {
+            struct icaldurationtype duration = icalvalue_get_duration(val);
+
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL,
+                    icalduration_to_string(conv, emitter, duration));
+
+            break;
+        }
+        case ICAL_X_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL, icalvalue_get_x(val));
+
+            break;
+        }
+        case ICAL_RECUR_VALUE: {
+            struct icalrecurrencetype recur = icalvalue_get_recur(val);
+
+            rv = icalrecurrencetype_visit(conv, emitter, &recur);
+
+            break;
+        }
+        case ICAL_TRIGGER_VALUE: {
+            struct icaltriggertype trigger = icalvalue_get_trigger(val);
+
+            if (!icaltime_is_null_time(trigger.time)) {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "time",
+                        icaltime_to_string(buf, trigger.time));
+            }
+            else {
+                rv = emit_str(emitter, ICAL_EVENT_MEMBER, "duration",
+                        icalduration_to_string(conv, emitter,
+                                trigger.duration));
+            }
+
+            break;
+        }
+        case ICAL_DATE_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL,
+                    icaldate_to_string(buf, icalvalue_get_date(val)));
+
+            break;
+        }
+        case ICAL_DATETIME_VALUE: {
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL,
+                    icaldatetime_to_string(buf,
+                            icalvalue_get_datetime(val)));
+
+            break;
+        }
+        default: {
+            /* if we don't recognise it, write it as a string */
+            char *str = icalvalue_as_ical_string_r(val);
+            rv = emit_str(emitter, ICAL_EVENT_TEXT, NULL, str);
+            icalmemory_free_buffer(str);
+
+            break;
+        }
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* close value */
+        rv = emit_num(emitter, ICAL_EVENT_VALUE_END, element, kind);
+
+    }
+
+    return rv;
+}
+
+static apr_status_t icalparameter_visit(ical_conv *conv, ical_emitter *emitter,
+        icalparameter *param)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (param) {
+        const char *element;
+        const char *str;
+        icalparameter_kind kind = icalparameter_isa(param);
+
+        /* work out the parameter name */
+        if (kind == ICAL_X_PARAMETER) {
+            element = name_intern(conv, icalparameter_get_xname(param));
+        }
+#ifdef ICAL_IANA_PARAMETER
+        else if (kind == ICAL_IANA_PARAMETER) {
+            element = name_intern(conv, icalparameter_get_iana_name(param));
+        }
+#endif
+        else {
+            element = parameter_name(conv, kind);
+        }
+
+        /* write parameter */
+        str = icalparameter_get_xvalue(param);
+        if (element && str) {
+            rv = emit_str(emitter, ICAL_EVENT_PARAMETER, element, str);
+        }
+
+    }
+
+    return rv;
+}
+
+static apr_status_t icalproperty_visit(ical_conv *conv, ical_emitter *emitter,
+        icalproperty *prop)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (prop) {
+        const char *element;
+        const char *x_name;
+        icalparameter *sparam;
+        icalproperty_kind kind = icalproperty_isa(prop);
+        int empty;
+
+        /* work out the property name */
+        x_name = icalproperty_get_x_name(prop);
+        if (kind == ICAL_X_PROPERTY && x_name != 0) {
+            element = name_intern(conv, x_name);
+        }
+        else {
+            element = property_name(conv, kind);
+        }
+
+        /* open property */
+        rv = emit_str(emitter, ICAL_EVENT_PROPERTY_START, element, NULL);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* handle parameters */
+        sparam = icalproperty_get_first_parameter(prop, ICAL_ANY_PARAMETER);
+        empty = (sparam == NULL);
+
+        rv = emit_num(emitter, ICAL_EVENT_PARAMETERS_START, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        while (sparam) {
+
+            rv = icalparameter_visit(conv, emitter, sparam);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            sparam = icalproperty_get_next_parameter(prop, ICAL_ANY_PARAMETER);
+        }
+
+        rv = emit_num(emitter, ICAL_EVENT_PARAMETERS_END, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* handle value */
+        switch (kind) {
+        case ICAL_CATEGORIES_PROPERTY:
+        case ICAL_RESOURCES_PROPERTY:
+        case ICAL_FREEBUSY_PROPERTY:
+        case ICAL_EXDATE_PROPERTY:
+        case ICAL_RDATE_PROPERTY: {
+            rv = icalvalue_multi_visit(conv, emitter,
+                    icalproperty_get_value(prop));
+            break;
+        }
+        default: {
+            rv = icalvalue_visit(conv, emitter, icalproperty_get_value(prop));
+            break;
+        }
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* close property */
+        rv = emit_str(emitter, ICAL_EVENT_PROPERTY_END, element, NULL);
+
+    }
+
+    return rv;
+}
+
+static apr_status_t icalcomponent_visit(ical_conv *conv, ical_emitter *emitter,
+        icalcomponent *comp)
+{
+    apr_status_t rv = APR_SUCCESS;
+
+    if (comp) {
+        icalcomponent *scomp;
+        icalproperty *sprop;
+        ical_event event = { 0 };
+        int empty;
+
+        emitter->depth++;
+
+        /* open component */
+        event.type = ICAL_EVENT_COMPONENT_START;
+        event.name = component_name(conv, icalcomponent_isa(comp));
+        event.comp = comp;
+        rv = emit(emitter, &event);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* handle properties */
+        sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+        empty = (sprop == NULL);
+
+        rv = emit_num(emitter, ICAL_EVENT_PROPERTIES_START, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        while (sprop) {
+
+            rv = icalproperty_visit(conv, emitter, sprop);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            sprop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY);
+        }
+
+        rv = emit_num(emitter, ICAL_EVENT_PROPERTIES_END, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* handle components */
+        scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+        empty = (scomp == NULL);
+
+        rv = emit_num(emitter, ICAL_EVENT_COMPONENTS_START, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        while (scomp) {
+
+            rv = icalcomponent_visit(conv, emitter, scomp);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
+
+            /* the subcomponent has been written, its temporaries are done */
+            if (emitter->depth == 1) {
+                scratch_clear(emitter);
+            }
+
+            scomp = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT);
+        }
+
+        rv = emit_num(emitter, ICAL_EVENT_COMPONENTS_END, NULL, empty);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        /* close component */
+        event.type = ICAL_EVENT_COMPONENT_END;
+        rv = emit(emitter, &event);
+
+        emitter->depth--;
+
+    }
+
+    return rv;
+}
+
+/*
+ * iCal backend: libical writes iCal itself, so the outermost component is
+ * written in one go when we are done.
+ */
+
+typedef struct ical_ical_backend {
+    ical_backend backend;
+    int depth;
+    icalcomponent *comp; /* outermost component */
+} ical_ical_backend;
+
+static apr_status_t ical_ical_event(ical_backend *backend,
+        const ical_event *event)
+{
+    ical_ical_backend *ical = (ical_ical_backend *) backend;
+
+    switch (event->type) {
+    case ICAL_EVENT_COMPONENT_START: {
+        if (!ical->depth++) {
+            ical->comp = event->comp;
+        }
+        break;
+    }
+    case ICAL_EVENT_COMPONENT_END: {
+        ical->depth--;
+        break;
+    }
+    default: {
+        break;
+    }
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t ical_ical_finish(ical_backend *backend,
+        ical_fragment *frag)
+{
+    ical_ical_backend *ical = (ical_ical_backend *) backend;
+    ical_conv *conv = backend->conv;
+    char *temp;
+    apr_size_t len;
+
+    if (!ical->comp) {
+        frag->data = "";
+        frag->len = 0;
+        return APR_SUCCESS;
+    }
+
+    temp = icalcomponent_as_ical_string_r(ical->comp);
+    if (!temp) {
+        return APR_ENOMEM;
+    }
+    len = strlen(temp);
+
+    conv->stats.allocs++;
+    conv->stats.alloc_bytes += len + 1;
+
+    /* the buffer from libical is passed on as is, and freed by libical */
+    if (backend->stream) {
+        frag->data = NULL;
+        frag->len = 0;
+        return ical_output_handoff(conv, temp, len);
+    }
+
+    apr_pool_cleanup_register(conv->pool, temp, icalbuffer_cleanup,
+            apr_pool_cleanup_null);
+
+    frag->data = temp;
+    frag->len = len;
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t ical_ical_create(ical_conv *conv, int document,
+        int stream, ical_backend **backend)
+{
+    ical_ical_backend *ical = apr_pcalloc(conv->pool,
+            sizeof(ical_ical_backend));
+
+    ical->backend.event = ical_ical_event;
+    ical->backend.finish = ical_ical_finish;
+    ical->backend.conv = conv;
+    ical->backend.output = AP_ICAL_OUTPUT_ICAL;
+    ical->backend.document = document;
+    ical->backend.stream = stream;
+
+    *backend = &ical->backend;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Escaping: text is scanned eight bytes at a time for the bytes that need
+ * escaping, runs of text that need no escaping are written as they are.
+ */
+
+#define SWAR_ONES (~(apr_uint64_t) 0 / 255)
+#define SWAR_HIGHS (SWAR_ONES * 0x80)
+#define SWAR_HAS_LESS(word, n) \
+        (((word) - SWAR_ONES * (n)) & ~(word) & SWAR_HIGHS)
+#define SWAR_HAS_BYTE(word, c) SWAR_HAS_LESS((word) ^ (SWAR_ONES * (c)), 1)
+
+/* length of the text before the first control character or given byte */
+static apr_size_t escape_span(const char *str, apr_size_t len,
+        unsigned char a, unsigned char b, unsigned char c, unsigned char d)
+{
+    apr_size_t i = 0;
+
+    while (i + sizeof(apr_uint64_t) <= len) {
+        apr_uint64_t word;
+
+        memcpy(&word, str + i, sizeof(word));
+        if (SWAR_HAS_LESS(word, 0x20) || SWAR_HAS_BYTE(word, a)
+                || SWAR_HAS_BYTE(word, b) || SWAR_HAS_BYTE(word, c)
+                || SWAR_HAS_BYTE(word, d)) {
+            break;
+        }
+
+        i += sizeof(word);
+    }
+
+    for (; i < len; i++) {
+        unsigned char ch = str[i];
+
+        if (ch < 0x20 || ch == a || ch == b || ch == c || ch == d) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+apr_size_t ical_json_span(const char *str, apr_size_t len)
+{
+    return escape_span(str, len, '"', '\\', '/', '"');
+}
+
+/* length of the UTF-8 sequence that starts the text, or zero if invalid */
+static apr_size_t utf8_sequence(const unsigned char *str, apr_size_t len)
+{
+    unsigned char c = str[0], lo = 0x80, hi = 0xBF;
+
+    if (c < 0x80) {
+        return 1;
+    }
+    else if (c >= 0xC2 && c <= 0xDF) {
+        return (len >= 2 && (str[1] & 0xC0) == 0x80) ? 2 : 0;
+    }
+    else if (c >= 0xE0 && c <= 0xEF) {
+        /* no overlong forms, no surrogates */
+        if (c == 0xE0) {
+            lo = 0xA0;
+        }
+        else if (c == 0xED) {
+            hi = 0x9F;
+        }
+        return (len >= 3 && str[1] >= lo && str[1] <= hi
+                && (str[2] & 0xC0) == 0x80) ? 3 : 0;
+    }
+    else if (c >= 0xF0 && c <= 0xF4) {
+        /* no overlong forms, nothing above U+10FFFF */
+        if (c == 0xF0) {
+            lo = 0x90;
+        }
+        else if (c == 0xF4) {
+            hi = 0x8F;
+        }
+        return (len >= 4 && str[1] >= lo && str[1] <= hi
+                && (str[2] & 0xC0) == 0x80 && (str[3] & 0xC0) == 0x80) ? 4 : 0;
+    }
+
+    return 0;
+}
+
+/*
+ * Escape text the way xmlTextWriterWriteString() does, writing directly to
+ * the writer. Control characters that cannot appear in XML are replaced.
+ */
+static int ical_xml_text(xmlTextWriterPtr writer, const char *str)
+{
+    apr_size_t len = strlen(str), start = 0, i = 0;
+    int rc = 0;
+
+    while (rc >= 0) {
+        const char *entity;
+
+        i += escape_span(str + i, len - i, '&', '<', '>', '"');
+        if (i == len) {
+            break;
+        }
+
+        switch (str[i]) {
+        case '&':
+            entity = "&amp;";
+            break;
+        case '<':
+            entity = "&lt;";
+            break;
+        case '>':
+            entity = "&gt;";
+            break;
+        case '"':
+            entity = "&quot;";
+            break;
+        case '\r':
+            entity = "&#13;";
+            break;
+        case '\t':
+        case '\n':
+            i++;
+            continue;
+        default:
+            entity = "\xEF\xBF\xBD";
+            break;
+        }
+
+        if (i > start) {
+            rc = xmlTextWriterWriteRawLen(writer, BAD_CAST str + start,
+                    i - start);
+            if (rc < 0) {
+                break;
+            }
+        }
+        rc = xmlTextWriterWriteRaw(writer, BAD_CAST entity);
+
+        start = ++i;
+    }
+
+    /* always write, so that an empty element is not collapsed */
+    if (rc >= 0 && (i > start || !len)) {
+        rc = xmlTextWriterWriteRawLen(writer, BAD_CAST str + start, i - start);
+    }
+
+    return rc;
+}
+
+static int ical_xml_element(xmlTextWriterPtr writer, const char *name,
+        const char *str)
+{
+    int rc;
+
+    rc = xmlTextWriterStartElement(writer, BAD_CAST name);
+    if (rc >= 0 && str) {
+        rc = ical_xml_text(writer, str);
+    }
+    if (rc >= 0) {
+        rc = xmlTextWriterEndElement(writer);
+    }
+
+    return rc;
+}
+
+/*
+ * xCal backend: written with libxml2.
+ */
+
+typedef struct ical_xcal_backend {
+    ical_backend backend;
+    xmlBufferPtr buf; /* fragments are written here */
+    xmlTextWriterPtr writer;
+    apr_status_t rv; /* first error writing to the brigade */
+} ical_xcal_backend;
+
+/* streamed documents are written to the brigade as libxml2 fills its buffer */
+static int ical_xcal_write(void *ctx, const char *buffer, int len)
+{
+    ical_xcal_backend *xcal = ctx;
+    ical_conv *conv = xcal->backend.conv;
+
+    if (xcal->rv == APR_SUCCESS) {
+        conv->stats.copies++;
+        conv->stats.copy_bytes += len;
+        xcal->rv = ical_output(conv, buffer, len);
+    }
+
+    return xcal->rv == APR_SUCCESS ? len : -1;
+}
+
+static int ical_xcal_close(void *ctx)
+{
+    return 0;
+}
+
+static apr_status_t ical_xcal_status(ical_xcal_backend *xcal, int rc)
+{
+    if (rc >= 0) {
+        return APR_SUCCESS;
+    }
+
+    return xcal->rv != APR_SUCCESS ? xcal->rv : APR_EGENERAL;
+}
+
+static apr_status_t ical_xcal_event(ical_backend *backend,
+        const ical_event *event)
+{
+    ical_xcal_backend *xcal = (ical_xcal_backend *) backend;
+    xmlTextWriterPtr writer = xcal->writer;
+    int rc = 0;
+
+    switch (event->type) {
+    case ICAL_EVENT_COMPONENT_START:
+    case ICAL_EVENT_PROPERTY_START:
+    case ICAL_EVENT_VALUE_START: {
+        rc = xmlTextWriterStartElement(writer, BAD_CAST event->name);
+        break;
+    }
+    case ICAL_EVENT_COMPONENT_END:
+    case ICAL_EVENT_PROPERTY_END:
+    case ICAL_EVENT_VALUE_END: {
+        rc = xmlTextWriterEndElement(writer);
+        break;
+    }
+    case ICAL_EVENT_PROPERTIES_START: {
+        if (!event->num) {
+            rc = xmlTextWriterStartElement(writer, BAD_CAST "properties");
+        }
+        break;
+    }
+    case ICAL_EVENT_COMPONENTS_START: {
+        if (!event->num) {
+            rc = xmlTextWriterStartElement(writer, BAD_CAST "components");
+        }
+        break;
+    }
+    case ICAL_EVENT_PARAMETERS_START: {
+        if (!event->num) {
+            rc = xmlTextWriterStartElement(writer, BAD_CAST "parameters");
+        }
+        break;
+    }
+    case ICAL_EVENT_PROPERTIES_END:
+    case ICAL_EVENT_COMPONENTS_END:
+    case ICAL_EVENT_PARAMETERS_END: {
+        if (!event->num) {
+            rc = xmlTextWriterEndElement(writer);
+        }
+        break;
+    }
+    case ICAL_EVENT_PARAMETER:
+    case ICAL_EVENT_MEMBER: {
+        rc = ical_xml_element(writer, event->name, event->str);
+        break;
+    }
+    case ICAL_EVENT_MEMBER_INT: {
+        rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST event->name,
+                "%d", event->num);
+        break;
+    }
+    case ICAL_EVENT_MEMBER_DOUBLE: {
+        rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST event->name,
+                "%f", event->dbl);
+        break;
+    }
+    case ICAL_EVENT_TEXT: {
+        if (event->str) {
+            rc = ical_xml_text(writer, event->str);
+        }
+        break;
+    }
+    default: {
+        /* lists, objects and members are implied by the elements */
+        break;
+    }
+    }
+
+    return ical_xcal_status(xcal, rc);
+}
+
+static apr_status_t ical_xcal_finish(ical_backend *backend,
+        ical_fragment *frag)
+{
+    ical_xcal_backend *xcal = (ical_xcal_backend *) backend;
+    apr_pool_t *pool = backend->conv->pool;
+    int rc;
+
+    if (backend->document) {
+
+        rc = xmlTextWriterEndElement(xcal->writer);
+        if (rc < 0) {
+            return ical_xcal_status(xcal, rc);
+        }
+
+        rc = xmlTextWriterEndDocument(xcal->writer);
+        if (rc < 0) {
+            return ical_xcal_status(xcal, rc);
+        }
+
+    }
+    else {
+
+        rc = xmlTextWriterFlush(xcal->writer);
+        if (rc < 0) {
+            return ical_xcal_status(xcal, rc);
+        }
+
+    }
+
+    apr_pool_cleanup_run(pool, xcal->writer, xmlwriter_cleanup);
+
+    /* streamed documents have already been written */
+    if (backend->stream) {
+        frag->data = NULL;
+        frag->len = 0;
+        return xcal->rv;
+    }
+
+    /* take over the memory of the buffer rather than copying it */
+    frag->len = xmlBufferLength(xcal->buf);
+    frag->data = (const char *) xmlBufferDetach(xcal->buf);
+    if (!frag->data) {
+        return APR_ENOMEM;
+    }
+    apr_pool_cleanup_register(pool, frag->data, xmlfree_cleanup,
+            apr_pool_cleanup_null);
+
+    backend->conv->stats.allocs++;
+    backend->conv->stats.alloc_bytes += frag->len + 1;
+
+    apr_pool_cleanup_run(pool, xcal->buf, xmlbuffer_cleanup);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t ical_xcal_create(ical_conv *conv, int document,
+        int stream, ical_backend **backend)
+{
+    ical_xcal_backend *xcal = apr_pcalloc(conv->pool,
+            sizeof(ical_xcal_backend));
+    int rc;
+
+    xcal->backend.event = ical_xcal_event;
+    xcal->backend.finish = ical_xcal_finish;
+    xcal->backend.conv = conv;
+    xcal->backend.output = AP_ICAL_OUTPUT_XCAL;
+    xcal->backend.document = document;
+    xcal->backend.stream = stream;
+
+    if (stream) {
+        xmlOutputBufferPtr out;
+
+        out = xmlOutputBufferCreateIO(ical_xcal_write, ical_xcal_close, xcal,
+                NULL);
+        if (out == NULL) {
+            return APR_ENOMEM;
+        }
+
+        /* the writer owns the output buffer from here on */
+        xcal->writer = xmlNewTextWriter(out);
+        if (xcal->writer == NULL) {
+            xmlOutputBufferClose(out);
+            return APR_ENOMEM;
+        }
+    }
+    else {
+        xcal->buf = xmlBufferCreate();
+        if (xcal->buf == NULL) {
+            return APR_ENOMEM;
+        }
+        apr_pool_cleanup_register(conv->pool, xcal->buf, xmlbuffer_cleanup,
+                apr_pool_cleanup_null);
+
+        xcal->writer = xmlNewTextWriterMemory(xcal->buf, 0);
+        if (xcal->writer == NULL) {
+            return APR_ENOMEM;
+        }
+    }
+    apr_pool_cleanup_register(conv->pool, xcal->writer, xmlwriter_cleanup,
+            apr_pool_cleanup_null);
+
+    if (conv->format == AP_ICAL_FORMAT_PRETTY
+            || conv->format == AP_ICAL_FORMAT_SPACED) {
+        xmlTextWriterSetIndent(xcal->writer, 1);
+        xmlTextWriterSetIndentString(xcal->writer, BAD_CAST "  ");
+    }
+
+    if (document) {
+
+        rc = xmlTextWriterStartDocument(xcal->writer, NULL, "UTF-8", NULL);
+        if (rc < 0) {
+            return ical_xcal_status(xcal, rc);
+        }
+
+        rc = xmlTextWriterStartElementNS(xcal->writer, NULL,
+                BAD_CAST "icalendar",
+                BAD_CAST "urn:ietf:params:xml:ns:icalendar-2.0");
+        if (rc < 0) {
+            return ical_xcal_status(xcal, rc);
+        }
+
+    }
+
+    *backend = &xcal->backend;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * jCal backend: written directly to a brigade as the tree is walked,
+ * laid out exactly as json-c would lay out the equivalent objects.
+ */
+
+typedef struct ical_jcal_level {
+    int object; /* level is an object, otherwise an array */
+    int count; /* number of members written so far */
+} ical_jcal_level;
+
+typedef struct ical_jcal_backend {
+    ical_backend backend;
+    apr_bucket_brigade *bb; /* fragments are written here */
+    apr_array_header_t *stack; /* arrays and objects currently open */
+    int spaced;
+    int pretty;
+} ical_jcal_backend;
+
+static apr_status_t ical_jcal_write(ical_jcal_backend *jcal, const char *data,
+        apr_size_t len)
+{
+    if (jcal->backend.stream) {
+        return ical_output(jcal->backend.conv, data, len);
+    }
+
+    return apr_brigade_write(jcal->bb, NULL, NULL, data, len);
+}
+
+static apr_status_t ical_jcal_indent(ical_jcal_backend *jcal, int level)
+{
+    static const char spaces[] = "                                ";
+    apr_size_t len = level * 2;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (jcal->pretty) {
+        while (len && rv == APR_SUCCESS) {
+            apr_size_t chunk = len < sizeof(spaces) - 1 ? len :
+                    sizeof(spaces) - 1;
+            rv = ical_jcal_write(jcal, spaces, chunk);
+            len -= chunk;
+        }
+    }
+
+    return rv;
+}
+
+/*
+ * Escape a string the way json-c does, including the escaping of '/'
+ * that json-c performs by default, writing clean runs as they are.
+ */
+static apr_status_t ical_jcal_string(ical_jcal_backend *jcal, const char *str)
+{
+    static const char hex[] = "0123456789abcdef";
+    apr_size_t len, i = 0;
+    apr_status_t rv;
+
+    if (!str) {
+        return ical_jcal_write(jcal, "null", 4);
+    }
+
+    len = strlen(str);
+
+    rv = ical_jcal_write(jcal, "\"", 1);
+
+    while (rv == APR_SUCCESS) {
+        apr_size_t span = ical_json_span(str + i, len - i);
+        unsigned char c;
+        char buf[6];
+        const char *escape = buf;
+        apr_size_t elen = 2;
+
+        if (span) {
+            rv = ical_jcal_write(jcal, str + i, span);
+            if (rv != APR_SUCCESS) {
+                break;
+            }
+            i += span;
+        }
+        if (i == len) {
+            break;
+        }
+
+        c = str[i++];
+        switch (c) {
+        case '\b': {
+            escape = "\\b";
+            break;
+        }
+        case '\n': {
+            escape = "\\n";
+            break;
+        }
+        case '\r': {
+            escape = "\\r";
+            break;
+        }
+        case '\t': {
+            escape = "\\t";
+            break;
+        }
+        case '\f': {
+            escape = "\\f";
+            break;
+        }
+        case '"': {
+            escape = "\\\"";
+            break;
+        }
+        case '\\': {
+            escape = "\\\\";
+            break;
+        }
+        case '/': {
+            escape = "\\/";
+            break;
+        }
+        default: {
+            memcpy(buf, "\\u00", 4);
+            buf[4] = hex[c >> 4];
+            buf[5] = hex[c & 0xf];
+            elen = 6;
+            break;
+        }
+        }
+
+        rv = ical_jcal_write(jcal, escape, elen);
+    }
+
+    if (rv == APR_SUCCESS) {
+        rv = ical_jcal_write(jcal, "\"", 1);
+    }
+
+    return rv;
+}
+
+/* separate this value from the one before, and name it within an object */
+static apr_status_t ical_jcal_member(ical_jcal_backend *jcal, const char *name)
+{
+    ical_jcal_level *level;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!jcal->stack->nelts) {
+        return APR_SUCCESS;
+    }
+
+    level = &APR_ARRAY_IDX(jcal->stack, jcal->stack->nelts - 1,
+            ical_jcal_level);
+
+    if (level->count++) {
+        rv = ical_jcal_write(jcal, jcal->pretty ? ",\n" : ",",
+                jcal->pretty ? 2 : 1);
+    }
+    if (rv == APR_SUCCESS && jcal->spaced) {
+        rv = ical_jcal_write(jcal, " ", 1);
+    }
+    if (rv == APR_SUCCESS) {
+        rv = ical_jcal_indent(jcal, jcal->stack->nelts);
+    }
+    if (rv == APR_SUCCESS && level->object) {
+        rv = ical_jcal_string(jcal, name);
+        if (rv == APR_SUCCESS) {
+            rv = ical_jcal_write(jcal, jcal->spaced ? ": " : ":",
+                    jcal->spaced ? 2 : 1);
+        }
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_open(ical_jcal_backend *jcal, const char *name,
+        int object)
+{
+    ical_jcal_level *level;
+    apr_status_t rv;
+
+    rv = ical_jcal_member(jcal, name);
+    if (rv == APR_SUCCESS) {
+        rv = ical_jcal_write(jcal, object ? "{" : "[", 1);
+    }
+    if (rv == APR_SUCCESS && jcal->pretty) {
+        rv = ical_jcal_write(jcal, "\n", 1);
+    }
+
+    level = apr_array_push(jcal->stack);
+    level->object = object;
+    level->count = 0;
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_close(ical_jcal_backend *jcal)
+{
+    ical_jcal_level *level = apr_array_pop(jcal->stack);
+    apr_status_t rv = APR_SUCCESS;
+
+    if (!level) {
+        return APR_EGENERAL;
+    }
+
+    if (jcal->pretty) {
+        if (level->count) {
+            rv = ical_jcal_write(jcal, "\n", 1);
+        }
+        if (rv == APR_SUCCESS) {
+            rv = ical_jcal_indent(jcal, jcal->stack->nelts);
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        if (jcal->spaced) {
+            rv = ical_jcal_write(jcal, level->object ? " }" : " ]", 2);
+        }
+        else {
+            rv = ical_jcal_write(jcal, level->object ? "}" : "]", 1);
+        }
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_scalar(ical_jcal_backend *jcal,
+        const char *name, const char *str)
+{
+    apr_status_t rv;
+
+    rv = ical_jcal_member(jcal, name);
+    if (rv == APR_SUCCESS) {
+        rv = ical_jcal_string(jcal, str);
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_int(ical_jcal_backend *jcal, const char *name,
+        int num)
+{
+    char buf[16];
+    apr_status_t rv;
+
+    rv = ical_jcal_member(jcal, name);
+    if (rv == APR_SUCCESS) {
+        rv = ical_jcal_write(jcal, buf,
+                apr_snprintf(buf, sizeof(buf), "%d", num));
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_double(ical_jcal_backend *jcal,
+        const char *name, double dbl)
+{
+    json_object *jdouble;
+    const char *str;
+    apr_status_t rv;
+
+    rv = ical_jcal_member(jcal, name);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    /* the formatting of doubles varies between json-c versions, leave it
+     * to json-c to stay consistent.
+     */
+    jdouble = json_object_new_double(dbl);
+    if (!jdouble) {
+        return APR_ENOMEM;
+    }
+    str = json_object_to_json_string_ext(jdouble, JSON_C_TO_STRING_PLAIN);
+    rv = ical_jcal_write(jcal, str, strlen(str));
+    json_object_put(jdouble);
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_event(ical_backend *backend,
+        const ical_event *event)
+{
+    ical_jcal_backend *jcal = (ical_jcal_backend *) backend;
+    apr_status_t rv = APR_SUCCESS;
+
+    switch (event->type) {
+    case ICAL_EVENT_COMPONENT_START: {
+        rv = ical_jcal_scalar(jcal, NULL, event->name);
+        break;
+    }
+    case ICAL_EVENT_PROPERTY_START: {
+        rv = ical_jcal_open(jcal, NULL, 0);
+        if (rv == APR_SUCCESS) {
+            rv = ical_jcal_scalar(jcal, NULL, event->name);
+        }
+        break;
+    }
+    case ICAL_EVENT_PROPERTIES_START:
+    case ICAL_EVENT_COMPONENTS_START:
+    case ICAL_EVENT_LIST_START: {
+        rv = ical_jcal_open(jcal, NULL, 0);
+        break;
+    }
+    case ICAL_EVENT_MEMBERS_START: {
+        rv = ical_jcal_open(jcal, event->name, 0);
+        break;
+    }
+    case ICAL_EVENT_PARAMETERS_START:
+    case ICAL_EVENT_OBJECT_START: {
+        rv = ical_jcal_open(jcal, NULL, 1);
+        break;
+    }
+    case ICAL_EVENT_PROPERTY_END:
+    case ICAL_EVENT_PROPERTIES_END:
+    case ICAL_EVENT_COMPONENTS_END:
+    case ICAL_EVENT_PARAMETERS_END:
+    case ICAL_EVENT_LIST_END:
+    case ICAL_EVENT_OBJECT_END:
+    case ICAL_EVENT_MEMBERS_END: {
+        rv = ical_jcal_close(jcal);
+        break;
+    }
+    case ICAL_EVENT_VALUE_START: {
+        const char *type;
+
+        /* rfc7265 represents some types differently */
+        switch (event->num) {
+        case ICAL_GEO_VALUE: {
+            type = "float";
+            break;
+        }
+        case ICAL_REQUESTSTATUS_VALUE: {
+            type = "text";
+            break;
+        }
+        default: {
+            type = event->name;
+            break;
+        }
+        }
+
+        rv = ical_jcal_scalar(jcal, NULL, type);
+        break;
+    }
+    case ICAL_EVENT_PARAMETER:
+    case ICAL_EVENT_MEMBER:
+    case ICAL_EVENT_TEXT: {
+        rv = ical_jcal_scalar(jcal, event->name, event->str);
+        break;
+    }
+    case ICAL_EVENT_MEMBER_INT: {
+        rv = ical_jcal_int(jcal, event->name, event->num);
+        break;
+    }
+    case ICAL_EVENT_MEMBER_DOUBLE: {
+        rv = ical_jcal_double(jcal, event->name, event->dbl);
+        break;
+    }
+    default: {
+        break;
+    }
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_finish(ical_backend *backend,
+        ical_fragment *frag)
+{
+    ical_jcal_backend *jcal = (ical_jcal_backend *) backend;
+    apr_status_t rv = APR_SUCCESS;
+    char *str;
+
+    /* subcomponents are written inline within the components array of
+     * their parent, the array around a fragment was never written.
+     */
+    if (backend->document) {
+        rv = ical_jcal_close(jcal);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    if (backend->stream) {
+        frag->data = NULL;
+        frag->len = 0;
+    }
+    else {
+        rv = apr_brigade_pflatten(jcal->bb, &str, &frag->len,
+                backend->conv->pool);
+        frag->data = str;
+        apr_brigade_destroy(jcal->bb);
+
+        backend->conv->stats.allocs++;
+        backend->conv->stats.alloc_bytes += frag->len;
+        backend->conv->stats.copies++;
+        backend->conv->stats.copy_bytes += frag->len;
+    }
+
+    return rv;
+}
+
+static apr_status_t ical_jcal_create(ical_conv *conv, int document,
+        int stream, ical_backend **backend)
+{
+    ical_jcal_backend *jcal = apr_pcalloc(conv->pool,
+            sizeof(ical_jcal_backend));
+    ical_jcal_level *level;
+
+    jcal->backend.event = ical_jcal_event;
+    jcal->backend.finish = ical_jcal_finish;
+    jcal->backend.conv = conv;
+    jcal->backend.output = AP_ICAL_OUTPUT_JCAL;
+    jcal->backend.document = document;
+    jcal->backend.stream = stream;
+
+    jcal->spaced = (conv->format == AP_ICAL_FORMAT_SPACED);
+    jcal->pretty = (conv->format == AP_ICAL_FORMAT_PRETTY);
+
+    if (!stream) {
+        jcal->bb = apr_brigade_create(conv->pool, conv->bb->bucket_alloc);
+    }
+
+    jcal->stack = apr_array_make(conv->pool, 8, sizeof(ical_jcal_level));
+
+    if (document) {
+        apr_status_t rv = ical_jcal_open(jcal, NULL, 0);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+    else {
+        /* a fragment continues an array that is already open */
+        level = apr_array_push(jcal->stack);
+        level->object = 0;
+        level->count = 0;
+    }
+
+    *backend = &jcal->backend;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * Render the component to each of the outputs in a single pass, as a
+ * complete document, or as a fragment to be included within a document.
+ * Streamed documents are written to the brigade in the context instead
+ * of to the fragments.
+ */
+static apr_status_t ical_render(ical_conv *conv, icalcomponent *comp,
+        int outputs, int document, int stream, ical_fragment *frags)
+{
+    ical_emitter emitter;
+    apr_status_t rv;
+    int output, i;
+
+    memset(&emitter, 0, sizeof(emitter));
+
+    for (output = AP_ICAL_OUTPUT_ICAL; output <= AP_ICAL_OUTPUT_JCAL;
+            output++) {
+        ical_backend *backend;
+
+        if (!(outputs & ICAL_OUTPUT_BIT(output))) {
+            continue;
+        }
+
+        switch (output) {
+        case AP_ICAL_OUTPUT_ICAL: {
+            rv = ical_ical_create(conv, document, stream, &backend);
+            break;
+        }
+        case AP_ICAL_OUTPUT_XCAL: {
+            rv = ical_xcal_create(conv, document, stream, &backend);
+            break;
+        }
+        default: {
+            rv = ical_jcal_create(conv, document, stream, &backend);
+            break;
+        }
+        }
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+
+        emitter.backends[emitter.count++] = backend;
+    }
+
+    if (!emitter.count) {
+        return APR_ENOTIMPL;
+    }
+
+    rv = icalcomponent_visit(conv, &emitter, comp);
+    if (emitter.scratch) {
+        apr_pool_destroy(emitter.scratch);
+    }
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    for (i = 0; i < emitter.count; i++) {
+        ical_backend *backend = emitter.backends[i];
+
+        rv = backend->finish(backend, &frags[backend->output]);
+        if (rv != APR_SUCCESS) {
+            return rv;
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+ap_ical_filter_e ical_parse_filter(const char *arg, apr_off_t len)
+{
+    if (!strncmp(arg, "none", len)) {
+        return AP_ICAL_FILTER_NONE;
+    }
+    else if (!strncmp(arg, "next", len)) {
+        return AP_ICAL_FILTER_NEXT;
+    }
+    else if (!strncmp(arg, "last", len)) {
+        return AP_ICAL_FILTER_LAST;
+    }
+    else if (!strncmp(arg, "future", len)) {
+        return AP_ICAL_FILTER_FUTURE;
+    }
+    else if (!strncmp(arg, "past", len)) {
+        return AP_ICAL_FILTER_PAST;
+    }
+    else {
+        return AP_ICAL_FILTER_UNKNOWN;
+    }
+}
+
+ap_ical_format_e ical_parse_format(const char *arg, apr_off_t len)
+{
+    if (!strncmp(arg, "none", len)) {
+        return AP_ICAL_FORMAT_NONE;
+    }
+    else if (!strncmp(arg, "pretty", len)) {
+        return AP_ICAL_FORMAT_PRETTY;
+    }
+    else if (!strncmp(arg, "spaced", len)) {
+        return AP_ICAL_FORMAT_SPACED;
+    }
+    else {
+        return AP_ICAL_FORMAT_UNKNOWN;
+    }
+}
+
+ap_ical_utf8_e ical_parse_utf8(const char *arg, apr_off_t len)
+{
+    if (!strncmp(arg, "pass", len)) {
+        return AP_ICAL_UTF8_PASS;
+    }
+    else if (!strncmp(arg, "replace", len)) {
+        return AP_ICAL_UTF8_REPLACE;
+    }
+    else if (!strncmp(arg, "reject", len)) {
+        return AP_ICAL_UTF8_REJECT;
+    }
+    else {
+        return AP_ICAL_UTF8_UNKNOWN;
+    }
+}
+
+apr_size_t ical_utf8_valid(const char *str, apr_size_t len)
+{
+    const unsigned char *s = (const unsigned char *) str;
+    apr_size_t i = 0, n;
+
+    while (i < len) {
+
+        /* skip ASCII a word at a time */
+        while (i + sizeof(apr_uint64_t) <= len) {
+            apr_uint64_t word;
+
+            memcpy(&word, s + i, sizeof(word));
+            if (word & SWAR_HIGHS) {
+                break;
+            }
+
+            i += sizeof(word);
+        }
+
+        if (i == len) {
+            break;
+        }
+
+        n = utf8_sequence(s + i, len - i);
+        if (!n) {
+            break;
+        }
+
+        i += n;
+    }
+
+    return i;
+}
+
+char *ical_utf8_replace(apr_pool_t *pool, const char *str, apr_size_t *len)
+{
+    char *buf = apr_palloc(pool, *len * 3 + 1), *pos = buf;
+    apr_size_t i = 0;
+
+    while (i < *len) {
+        apr_size_t valid = ical_utf8_valid(str + i, *len - i);
+
+        memcpy(pos, str + i, valid);
+        pos += valid;
+        i += valid;
+
+        if (i < *len) {
+            memcpy(pos, "\xEF\xBF\xBD", 3);
+            pos += 3;
+            i++;
+        }
+    }
+    *pos = 0;
+
+    *len = pos - buf;
+
+    return buf;
+}
+
+icalcomponent *ical_timezone_component(ical_conv *conv,
+        icalcomponent *comp, icaltimezone *oldtz)
+{
+
+    if (comp && conv->tz) {
+        icalcomponent *scomp, *oldtcomp = NULL;
+        icalproperty *sprop;
+        icaltimezone *madetz = NULL;
+
+        /* times in UTC need no TZID, and so no timezone */
+        int utc = (conv->tz == icaltimezone_get_utc_timezone());
+
+        /* handle properties */
+        sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+        if (sprop) {
+
+            while (sprop) {
+                icalparameter *sparam;
+                icaltimezone *overridetz = oldtz;
+
+                /* handle parameters */
+                sparam = icalproperty_get_first_parameter(sprop,
+                        ICAL_ANY_PARAMETER);
+                if (sparam) {
+
+                    while (sparam) {
+                        icalparameter_kind pkind = icalparameter_isa(sparam);
+
+                        switch (pkind) {
+                        case ICAL_TZID_PARAMETER: {
+
+                            /* identify original timezone */
+                            const char *str = icalparameter_get_xvalue(sparam);
+                            if (str) {
+                                /* the TZID, or failing that the location */
+                                icaltimezone *tz = ical_tz_find(str);
+                                if (tz) {
+                                    if (!utc) {
+                                        icalparameter_set_xvalue(sparam,
+                                                icaltimezone_get_tzid(
+                                                        conv->tz));
+                                    }
+                                    overridetz = tz;
+                                }
+                            }
+
+                            break;
+                        }
+                        default: {
+                            break;
+                        }
+                        }
+
+                        sparam = icalproperty_get_next_parameter(sprop,
+                                ICAL_ANY_PARAMETER);
+                    }
+
+                }
+
+                if (overridetz) {
+                    icalvalue *svalue;
+
+                    if (utc) {
+                        icalproperty_remove_parameter_by_kind(sprop,
+                                ICAL_TZID_PARAMETER);
+                    }
+
+                    /* handle value */
+                    svalue = icalproperty_get_value(sprop);
+                    if (svalue) {
+                        icalvalue_kind vkind = icalvalue_isa(svalue);
+
+                        switch (vkind) {
+                        case ICAL_DATETIMEPERIOD_VALUE: {
+
+                            struct icaldatetimeperiodtype dtp =
+                                    icalvalue_get_datetimeperiod(svalue);
+                            if (!icaltime_is_null_time(dtp.time)) {
+                                icaltime_set_timezone(&dtp.time, overridetz);
+                                icalvalue_set_datetime(svalue,
+                                        ical_tz_convert(dtp.time, conv->tz));
+                            }
+
+                            break;
+                        }
+                        case ICAL_DATETIME_VALUE: {
+
+                            struct icaltimetype datetime = icalvalue_get_datetime(
+                                    svalue);
+                            icaltime_set_timezone(&datetime, overridetz);
+                            icalvalue_set_datetime(svalue,
+                                    ical_tz_convert(datetime, conv->tz));
+
+                            break;
+                        }
+                        default: {
+                            break;
+                        }
+                        }
+                    }
+
+                }
+
+                sprop = icalcomponent_get_next_property(comp,
+                        ICAL_ANY_PROPERTY);
+            }
+
+        }
+
+        /* handle components */
+        scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+        if (scomp) {
+
+            while (scomp) {
+
+                icalcomponent_kind ckind = icalcomponent_isa(scomp);
+
+                if (ckind == ICAL_VTIMEZONE_COMPONENT) {
+                    /* identify existing timezone */
+                    oldtcomp = scomp;
+                    if (!oldtz) {
+                        /* the timezone owns a copy, freed when done */
+                        oldtz = madetz = icaltimezone_new();
+                        icaltimezone_set_component(madetz,
+                                icalcomponent_new_clone(scomp));
+                    }
+                }
+                else {
+                    /* handle nested components */
+                    ical_timezone_component(conv, scomp, oldtz);
+                }
+                scomp = icalcomponent_get_next_component(comp,
+                        ICAL_ANY_COMPONENT);
+
+            }
+        }
+
+        /* remove old timezone, the new timezone is added once the
+         * components to be sent are known.
+         */
+        if (oldtcomp) {
+
+            icalcomponent_remove_component(comp, oldtcomp);
+            icalcomponent_free(oldtcomp);
+
+        }
+
+        /* converted times refer to the new timezone, not the old */
+        if (madetz) {
+            icaltimezone_free(madetz, 1);
+        }
+
+    }
+
+    return comp;
+
+}
+
+static apr_status_t component_cleanup(void *data)
+{
+    icalcomponent_free(data);
+    return APR_SUCCESS;
+}
+
+/* remove the subcomponent, and free it along with the pool of the context
+ * rather than now, so that its address is not reused by a component added
+ * while the remaining components may still be looked up by address.
+ */
+static void component_remove(ical_conv *conv, icalcomponent *comp,
+        icalcomponent *scomp)
+{
+    icalcomponent_remove_component(comp, scomp);
+    apr_pool_cleanup_register(conv->pool, scomp, component_cleanup,
+            apr_pool_cleanup_null);
+}
+
+/* start times of the occurrences replaced by other components, by UID */
+static apr_hash_t *filter_overrides(ical_conv *conv, icalcomponent *comp)
+{
+    apr_hash_t *overrides = apr_hash_make(conv->pool);
+    icalcomponent *scomp;
+
+    for (scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+            scomp;
+            scomp = icalcomponent_get_next_component(comp,
+                    ICAL_ANY_COMPONENT)) {
+        icalproperty *sprop = icalcomponent_get_first_property(scomp,
+                ICAL_RECURRENCEID_PROPERTY);
+        apr_array_header_t *starts;
+        const char *uid;
+
+        if (!sprop || !(uid = icalcomponent_get_uid(scomp))) {
+            continue;
+        }
+
+        starts = apr_hash_get(overrides, uid, APR_HASH_KEY_STRING);
+        if (!starts) {
+            starts = apr_array_make(conv->pool, 4, sizeof(apr_int64_t));
+            apr_hash_set(overrides, uid, APR_HASH_KEY_STRING, starts);
+        }
+        APR_ARRAY_PUSH(starts, apr_int64_t) = ical_recur_seconds(scomp, sprop,
+                icalproperty_get_recurrenceid(sprop));
+    }
+
+    return overrides;
+}
+
+/* the end of the occurrence of the component that ends first at or after
+ * now (next), or last at or before now (!next), returning zero if there is
+ * none. Components that do not recur, or that recur too often to expand
+ * within the budget, have only the end of the component itself. The keys
+ * of the timezones of the calendar are kept in zones.
+ */
+static int filter_end(ical_conv *conv, icalcomponent *scomp,
+        apr_hash_t *overrides, apr_hash_t *zones, apr_int64_t now, int next,
+        apr_int64_t *end)
+{
+    const char *uid = icalcomponent_get_uid(scomp);
+    struct icaltimetype dtend;
+    ical_recur_ends ends;
+
+    if (ical_recur_find(conv->pool, scomp,
+            uid ? apr_hash_get(overrides, uid, APR_HASH_KEY_STRING) : NULL,
+            now, &conv->budget, zones, &ends) == APR_SUCCESS) {
+        *end = next ? ends.next : ends.last;
+        return next ? ends.has_next : ends.has_last;
+    }
+
+    dtend = icalcomponent_get_dtend(scomp);
+    *end = icaltime_as_timet_with_zone(dtend, dtend.zone);
+
+    return next ? *end >= now : *end <= now;
+}
+
+icalcomponent *ical_filter_component(ical_conv *conv, icalcomponent *comp,
+        icalcomponent *original)
+{
+
+    if (comp) {
+        icalcomponent *scomp, *judged, *candidate = NULL;
+        apr_hash_t *overrides = NULL, *zones = NULL;
+        apr_int64_t now = apr_time_sec(apr_time_now()), candidate_end = 0;
+        icalcompiter iter, oiter;
+
+        /* times are judged as parsed, before any conversion */
+        if (!original) {
+            original = comp;
+        }
+
+        iter = icalcomponent_begin_component(comp, ICAL_ANY_COMPONENT);
+        oiter = icalcomponent_begin_component(original, ICAL_ANY_COMPONENT);
+
+        if (!(conv->uid && conv->uid[0])
+                && conv->filter != AP_ICAL_FILTER_NONE) {
+            overrides = filter_overrides(conv, original);
+            zones = apr_hash_make(conv->pool);
+        }
+
+        while ((scomp = icalcompiter_deref(&iter))) {
+
+            icalcompiter_next(&iter);
+
+            /* timezones are kept while they are referenced */
+            if (icalcomponent_isa(scomp) == ICAL_VTIMEZONE_COMPONENT) {
+                continue;
+            }
+
+            /* the same subcomponent as parsed, timezones aside */
+            while ((judged = icalcompiter_deref(&oiter))
+                    && icalcomponent_isa(judged)
+                            == ICAL_VTIMEZONE_COMPONENT) {
+                icalcompiter_next(&oiter);
+            }
+            icalcompiter_next(&oiter);
+            if (!judged) {
+                judged = scomp;
+            }
+
+            /* uid match? short circuit everything */
+            if (conv->uid && conv->uid[0]) {
+
+                const char *uid = icalcomponent_get_uid(scomp);
+
+                if (!uid || strcasecmp(uid, conv->uid)) {
+                    component_remove(conv, comp, scomp);
+                }
+
+                continue;
+            }
+
+            switch (conv->filter) {
+            case AP_ICAL_FILTER_NEXT: {
+                apr_int64_t end;
+
+                /* in the past? */
+                if (!filter_end(conv, judged, overrides, zones, now,
+                        1, &end)) {
+                    component_remove(conv, comp, scomp);
+                    break;
+                }
+
+                /* better than candidate? */
+                if (candidate) {
+                    if (end < candidate_end) {
+                        /* yes - blow away the old candidate */
+                        component_remove(conv, comp, candidate);
+                        candidate = scomp;
+                        candidate_end = end;
+                    }
+                    else {
+                        /* no - blow away the contender */
+                        component_remove(conv, comp, scomp);
+                    }
+                }
+                else {
+                    /* we are now the best candidate */
+                    candidate = scomp;
+                    candidate_end = end;
+                }
+
+                break;
+            }
+            case AP_ICAL_FILTER_LAST: {
+                apr_int64_t end;
+
+                /* in the future? */
+                if (!filter_end(conv, judged, overrides, zones, now,
+                        0, &end)) {
+                    component_remove(conv, comp, scomp);
+                    break;
+                }
+
+                /* better than candidate? */
+                if (candidate) {
+                    if (end > candidate_end) {
+                        /* yes - blow away the old candidate */
+                        component_remove(conv, comp, candidate);
+                        candidate = scomp;
+                        candidate_end = end;
+                    }
+                    else {
+                        /* no - blow away the contender */
+                        component_remove(conv, comp, scomp);
+                    }
+                }
+                else {
+                    /* we are now the best candidate */
+                    candidate = scomp;
+                    candidate_end = end;
+                }
+
+                break;
+            }
+            case AP_ICAL_FILTER_FUTURE: {
+                apr_int64_t end;
+
+                /* in the past? */
+                if (!filter_end(conv, judged, overrides, zones, now,
+                        1, &end)) {
+                    component_remove(conv, comp, scomp);
+                    break;
+                }
+
+                break;
+            }
+            case AP_ICAL_FILTER_PAST: {
+                apr_int64_t end;
+
+                /* in the future? */
+                if (!filter_end(conv, judged, overrides, zones, now,
+                        0, &end)) {
+                    component_remove(conv, comp, scomp);
+                    break;
+                }
+
+                break;
+            }
+            default: {
+                /* none, passthrough */
+                break;
+            }
+            }
+
+        }
+
+    }
+
+    return comp;
+}
+
+typedef struct ical_tz_usage {
+    apr_hash_t *tzids; /* TZIDs referenced */
+    const char *tzid; /* TZID of the timezone of the context, or NULL */
+    int first; /* first year given in the timezone of the context */
+    int last; /* last year given in the timezone of the context */
+    int open; /* recurs with no end */
+} ical_tz_usage;
+
+static void timezone_year(ical_tz_usage *usage, struct icaltimetype tt)
+{
+    if (icaltime_is_null_time(tt)) {
+        return;
+    }
+    if (!usage->first || tt.year < usage->first) {
+        usage->first = tt.year;
+    }
+    if (tt.year > usage->last) {
+        usage->last = tt.year;
+    }
+}
+
+static void timezone_usage(icalcomponent *comp, ical_tz_usage *usage)
+{
+    icalcomponent *scomp;
+    icalproperty *sprop;
+
+    for (sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+            sprop;
+            sprop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        icalparameter *sparam = icalproperty_get_first_parameter(sprop,
+                ICAL_TZID_PARAMETER);
+        const char *tzid = sparam ? icalparameter_get_tzid(sparam) : NULL;
+
+        if (icalproperty_isa(sprop) == ICAL_RRULE_PROPERTY) {
+            struct icalrecurrencetype recur = icalproperty_get_rrule(sprop);
+
+            if (icaltime_is_null_time(recur.until)) {
+                usage->open = 1;
+            }
+            else {
+                timezone_year(usage, recur.until);
+            }
+            continue;
+        }
+
+        if (!tzid) {
+            continue;
+        }
+
+        apr_hash_set(usage->tzids, tzid, APR_HASH_KEY_STRING, tzid);
+
+        if (usage->tzid && !strcmp(tzid, usage->tzid)) {
+            icalvalue *svalue = icalproperty_get_value(sprop);
+
+            switch (svalue ? icalvalue_isa(svalue) : ICAL_NO_VALUE) {
+            case ICAL_DATETIME_VALUE: {
+                timezone_year(usage, icalvalue_get_datetime(svalue));
+                break;
+            }
+            case ICAL_DATETIMEPERIOD_VALUE: {
+                struct icaldatetimeperiodtype dtp =
+                        icalvalue_get_datetimeperiod(svalue);
+
+                timezone_year(usage, dtp.time);
+                timezone_year(usage, dtp.period.start);
+                timezone_year(usage, dtp.period.end);
+                break;
+            }
+            default: {
+                break;
+            }
+            }
+        }
+    }
+
+    for (scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+            scomp;
+            scomp = icalcomponent_get_next_component(comp,
+                    ICAL_ANY_COMPONENT)) {
+        if (icalcomponent_isa(scomp) != ICAL_VTIMEZONE_COMPONENT) {
+            timezone_usage(scomp, usage);
+        }
+    }
+
+}
+
+icalcomponent *ical_timezone_used(ical_conv *conv, icalcomponent *comp)
+{
+
+    if (comp) {
+        icalcomponent *scomp;
+        icalcompiter iter;
+        ical_tz_usage usage;
+
+        memset(&usage, 0, sizeof(usage));
+        usage.tzids = apr_hash_make(conv->pool);
+        usage.tzid = conv->tz ? icaltimezone_get_tzid(conv->tz) : NULL;
+
+        timezone_usage(comp, &usage);
+
+        /* remove the timezones no longer referenced */
+        iter = icalcomponent_begin_component(comp, ICAL_VTIMEZONE_COMPONENT);
+        while ((scomp = icalcompiter_deref(&iter))) {
+            icalproperty *sprop = icalcomponent_get_first_property(scomp,
+                    ICAL_TZID_PROPERTY);
+            const char *tzid = sprop ? icalproperty_get_tzid(sprop) : NULL;
+
+            icalcompiter_next(&iter);
+
+            if (!tzid || !apr_hash_get(usage.tzids, tzid, APR_HASH_KEY_STRING)
+                    || (usage.tzid && !strcmp(tzid, usage.tzid))) {
+                component_remove(conv, comp, scomp);
+            }
+        }
+
+        /* add the timezone converted to, covering the years given in it */
+        if (usage.tzid
+                && apr_hash_get(usage.tzids, usage.tzid, APR_HASH_KEY_STRING)) {
+            icalcomponent_add_component(comp,
+                    ical_tz_vtimezone(conv->tz, usage.first,
+                            usage.open ? 0 : usage.last));
+        }
+
+    }
+
+    return comp;
+}
+
+apr_status_t ical_write(ical_conv *conv, icalcomponent *comp)
+{
+    ical_fragment frags[ICAL_OUTPUT_COUNT];
+    apr_status_t rv;
+
+    switch (conv->output) {
+    case AP_ICAL_OUTPUT_ICAL:
+    case AP_ICAL_OUTPUT_XCAL:
+    case AP_ICAL_OUTPUT_JCAL: {
+        rv = ical_render(conv, comp, ICAL_OUTPUT_BIT(conv->output), 1, 1,
+                frags);
+        break;
+    }
+    default: {
+        rv = APR_ENOTIMPL;
+        break;
+    }
+    }
+
+    return rv;
+}
+
+static const char *last_match(const char *str, apr_size_t len,
+        const char *match)
+{
+    apr_size_t mlen = strlen(match);
+
+    while (len >= mlen) {
+        len--;
+        if (!memcmp(str + len - mlen + 1, match, mlen)) {
+            return str + len - mlen + 1;
+        }
+    }
+
+    return NULL;
+}
+
+apr_status_t ical_render_component(ical_conv *conv, icalcomponent *comp,
+        int outputs, ical_fragment *frags)
+{
+    /* indentation depends on where the fragment ends up, only unformatted
+     * output can be rendered in isolation.
+     */
+    if ((outputs & ~ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_ICAL))
+            && conv->format != AP_ICAL_FORMAT_NONE) {
+        return APR_ENOTIMPL;
+    }
+
+    return ical_render(conv, comp, outputs, 0, 0, frags);
+}
+
+apr_status_t ical_render_frame(ical_conv *conv, icalcomponent *comp,
+        int outputs, ical_fragment *heads, ical_fragment *tails)
+{
+    apr_status_t rv;
+    apr_array_header_t *children;
+    icalcomponent *scomp;
+    ical_fragment frames[ICAL_OUTPUT_COUNT];
+    char *element;
+    int i, output;
+
+    if ((outputs & ~ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_ICAL))
+            && conv->format != AP_ICAL_FORMAT_NONE) {
+        return APR_ENOTIMPL;
+    }
+
+    /* detach the subcomponents while the frame is rendered */
+    children = apr_array_make(conv->pool, 8, sizeof(icalcomponent *));
+    while ((scomp = icalcomponent_get_first_component(comp,
+            ICAL_ANY_COMPONENT))) {
+        icalcomponent_remove_component(comp, scomp);
+        APR_ARRAY_PUSH(children, icalcomponent *) = scomp;
+    }
+
+    rv = ical_render(conv, comp, outputs, 1, 0, frames);
+
+    for (i = 0; i < children->nelts; i++) {
+        icalcomponent_add_component(comp,
+                APR_ARRAY_IDX(children, i, icalcomponent *));
+    }
+
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    element = apr_pstrcat(conv->pool, "</",
+            component_name(conv, icalcomponent_isa(comp)), ">", NULL);
+
+    for (output = AP_ICAL_OUTPUT_ICAL; output <= AP_ICAL_OUTPUT_JCAL;
+            output++) {
+        const char *str = frames[output].data, *split = NULL;
+        apr_size_t len = frames[output].len;
+
+        if (!(outputs & ICAL_OUTPUT_BIT(output))) {
+            continue;
+        }
+
+        /* find where the subcomponents would have been */
+        switch (output) {
+        case AP_ICAL_OUTPUT_ICAL: {
+            split = last_match(str, len, "END:");
+            break;
+        }
+        case AP_ICAL_OUTPUT_XCAL: {
+            split = last_match(str, len, element);
+            break;
+        }
+        case AP_ICAL_OUTPUT_JCAL: {
+            split = last_match(str, len, "[]]");
+            if (split) {
+                split++;
+            }
+            break;
+        }
+        }
+
+        /* an empty xCal element is collapsed, we cannot split it */
+        if (!split) {
+            return APR_ENOTIMPL;
+        }
+
+        heads[output].data = str;
+        heads[output].len = split - str;
+        tails[output].data = split;
+        tails[output].len = len - heads[output].len;
+    }
+
+    return APR_SUCCESS;
+}
+
+static void fragment_append(apr_bucket_brigade *bb, const char *data,
+        apr_size_t len)
+{
+    if (len) {
+        APR_BRIGADE_INSERT_TAIL(bb,
+                apr_bucket_immortal_create(data, len, bb->bucket_alloc));
+    }
+}
+
+apr_status_t ical_write_fragments(ical_conv *conv, const ical_fragment *head,
+        const ical_fragment * const *frags, int count,
+        const ical_fragment *tail)
+{
+    const char *open = "", *sep = "", *close = "";
+    int i;
+
+    switch (conv->output) {
+    case AP_ICAL_OUTPUT_XCAL: {
+        open = "<components>";
+        close = "</components>";
+        break;
+    }
+    case AP_ICAL_OUTPUT_JCAL: {
+        sep = ",";
+        break;
+    }
+    default: {
+        break;
+    }
+    }
+
+    fragment_append(conv->bb, head->data, head->len);
+    if (count) {
+        fragment_append(conv->bb, open, strlen(open));
+    }
+    for (i = 0; i < count; i++) {
+        if (i) {
+            fragment_append(conv->bb, sep, strlen(sep));
+        }
+        fragment_append(conv->bb, frags[i]->data, frags[i]->len);
+    }
+    if (count) {
+        fragment_append(conv->bb, close, strlen(close));
+    }
+    fragment_append(conv->bb, tail->data, tail->len);
+
+    return APR_SUCCESS;
+}
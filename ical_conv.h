@@ -0,0 +1,224 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_conv.h: iCalendar conversions
+ *
+ * The conversions depend on APR only, and write to a bucket brigade
+ * using an ical_conv context, so that they can be used both from within
+ * the httpd filter and from the command line.
+ */
+
+#ifndef ICAL_CONV_H
+#define ICAL_CONV_H
+
+#include "apr_pools.h"
+#include "apr_buckets.h"
+#include "apr_hash.h"
+
+#include <libical/ical.h>
+
+typedef enum {
+    AP_ICAL_FILTER_NONE,
+    AP_ICAL_FILTER_NEXT,
+    AP_ICAL_FILTER_LAST,
+    AP_ICAL_FILTER_FUTURE,
+    AP_ICAL_FILTER_PAST,
+    AP_ICAL_FILTER_UNKNOWN
+} ap_ical_filter_e;
+
+typedef enum {
+    AP_ICAL_FORMAT_NONE,
+    AP_ICAL_FORMAT_SPACED,
+    AP_ICAL_FORMAT_PRETTY,
+    AP_ICAL_FORMAT_UNKNOWN
+} ap_ical_format_e;
+
+typedef enum {
+    AP_ICAL_OUTPUT_NEGOTIATED,
+    AP_ICAL_OUTPUT_ICAL,
+    AP_ICAL_OUTPUT_XCAL,
+    AP_ICAL_OUTPUT_JCAL
+} ap_ical_output_e;
+
+typedef enum {
+    AP_ICAL_UTF8_PASS,
+    AP_ICAL_UTF8_REPLACE,
+    AP_ICAL_UTF8_REJECT,
+    AP_ICAL_UTF8_UNKNOWN
+} ap_ical_utf8_e;
+
+/* size of a buffer that holds any date or date-time written by
+ * ical_format_time().
+ */
+#define ICAL_TIME_SIZE 32
+
+/* number of outputs, arrays of fragments are indexed by output */
+#define ICAL_OUTPUT_COUNT (AP_ICAL_OUTPUT_JCAL + 1)
+
+/* set of outputs to render */
+#define ICAL_OUTPUT_BIT(output) (1 << (output))
+#define ICAL_OUTPUT_ALL (ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_ICAL) \
+        | ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_XCAL) \
+        | ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_JCAL))
+
+typedef struct ical_stats {
+    apr_size_t allocs; /* buffers allocated to hold output */
+    apr_size_t alloc_bytes; /* size of the buffers allocated */
+    apr_size_t copies; /* copies made of output already written */
+    apr_size_t copy_bytes; /* size of the copies made */
+    apr_size_t scratch_peak; /* most temporary memory held at once */
+} ical_stats;
+
+typedef struct ical_conv {
+    apr_pool_t *pool; /* pool for temporary allocations */
+    apr_pool_t *scratch; /* parent of short lived pools, or NULL for pool */
+    apr_bucket_brigade *bb; /* converted output is written here */
+    apr_brigade_flush flush; /* passes on the brigade as it fills, or NULL */
+    void *flush_ctx; /* context passed to flush */
+    apr_size_t flush_size; /* bytes to write before the brigade is passed on */
+    apr_size_t buffered; /* bytes written since the brigade was passed on */
+    ical_stats stats; /* allocations and copies made of the output */
+    apr_hash_t *names; /* lowercase X- and IANA names, created on demand */
+    icaltimezone *tz; /* timezone to convert to, or NULL */
+    const char *uid; /* uid to match, or NULL */
+    apr_size_t budget; /* occurrences that may still be expanded */
+    ap_ical_output_e output; /* output to write */
+    ap_ical_filter_e filter; /* type of filtering */
+    ap_ical_format_e format; /* type of formatting */
+} ical_conv;
+
+typedef struct ical_fragment {
+    const char *data; /* rendered output */
+    apr_size_t len; /* length of rendered output */
+} ical_fragment;
+
+/**
+ * Work out the lowercase names of each kind of component, property,
+ * parameter and value. Must be called once before any threads are
+ * started, the names live as long as the pool.
+ */
+void ical_names_init(apr_pool_t *pool);
+
+/**
+ * Parse the name of a filter, returning AP_ICAL_FILTER_UNKNOWN if
+ * not recognised.
+ */
+ap_ical_filter_e ical_parse_filter(const char *arg, apr_off_t len);
+
+/**
+ * Parse the name of a format, returning AP_ICAL_FORMAT_UNKNOWN if
+ * not recognised.
+ */
+ap_ical_format_e ical_parse_format(const char *arg, apr_off_t len);
+
+/**
+ * Parse the name of a UTF-8 policy, returning AP_ICAL_UTF8_UNKNOWN if
+ * not recognised.
+ */
+ap_ical_utf8_e ical_parse_utf8(const char *arg, apr_off_t len);
+
+/**
+ * Return the length of the text that is valid UTF-8, which is the length
+ * of the text if all of it is valid.
+ */
+apr_size_t ical_utf8_valid(const char *str, apr_size_t len);
+
+/**
+ * Return a NUL terminated copy of the text with each byte that is not
+ * valid UTF-8 replaced with U+FFFD, and the new length in len.
+ */
+char *ical_utf8_replace(apr_pool_t *pool, const char *str, apr_size_t *len);
+
+/**
+ * Write the date or date-time into the buffer as it appears in xCal and
+ * jCal, for example 2020-01-01T10:00:00Z. The buffer must hold
+ * ICAL_TIME_SIZE bytes. Returns the buffer.
+ */
+const char *ical_format_time(char *buf, struct icaltimetype tt);
+
+/**
+ * Return the length of the text before the first byte that a jCal string
+ * escapes: a control character, quote, backslash or '/'. The text is
+ * scanned a word at a time.
+ */
+apr_size_t ical_json_span(const char *str, apr_size_t len);
+
+/**
+ * Convert all date-times in the component to the timezone in the
+ * context, removing the original timezone. The component is returned.
+ */
+icalcomponent *ical_timezone_component(ical_conv *conv, icalcomponent *comp,
+        icaltimezone *oldtz);
+
+/**
+ * Remove the subcomponents that do not pass the uid match or filter in
+ * the context. Recurring subcomponents are judged by their occurrences
+ * either side of now, expanded within the budget of the context, and the
+ * rest, including those the budget does not stretch to, by their own end.
+ * Where the component has been through ical_timezone_component(), the
+ * calendar as parsed is given as original, left unchanged, so that times
+ * are judged in the timezones they were given in, and rules recur there.
+ * Timezones are left in place. Subcomponents removed are freed along with
+ * the pool of the context. The component is returned.
+ */
+icalcomponent *ical_filter_component(ical_conv *conv, icalcomponent *comp,
+        icalcomponent *original);
+
+/**
+ * Remove the timezones no longer referenced by the remaining
+ * subcomponents, freeing them along with the pool of the context. If the
+ * timezone of the context is referenced, its timezone is added, with only
+ * the observances needed for the years given in it. The component is
+ * returned.
+ */
+icalcomponent *ical_timezone_used(ical_conv *conv, icalcomponent *comp);
+
+/**
+ * Write the component to the brigade in the context, in the output
+ * format of the context. If a flush function is present in the context,
+ * the brigade may be passed on before the component is complete.
+ */
+apr_status_t ical_write(ical_conv *conv, icalcomponent *comp);
+
+/**
+ * Render a subcomponent on its own to each of the given set of outputs in
+ * a single pass, exactly as it would appear within the output of
+ * ical_write(). Fragments are indexed by output. Returns APR_ENOTIMPL if
+ * the outputs and format of the context cannot be rendered in isolation.
+ */
+apr_status_t ical_render_component(ical_conv *conv, icalcomponent *comp,
+        int outputs, ical_fragment *frags);
+
+/**
+ * Render the output of ical_write() for the component with all of its
+ * subcomponents removed to each of the given set of outputs, split into
+ * the parts before and after where the subcomponents would appear.
+ * Fragments are indexed by output. Returns APR_ENOTIMPL if the outputs
+ * and format of the context cannot be rendered in isolation.
+ */
+apr_status_t ical_render_frame(ical_conv *conv, icalcomponent *comp,
+        int outputs, ical_fragment *heads, ical_fragment *tails);
+
+/**
+ * Write previously rendered fragments to the brigade in the context,
+ * without copying. The fragments must outlive the brigade.
+ */
+apr_status_t ical_write_fragments(ical_conv *conv, const ical_fragment *head,
+        const ical_fragment * const *frags, int count,
+        const ical_fragment *tail);
+
+#endif /* ICAL_CONV_H */
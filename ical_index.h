@@ -0,0 +1,99 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_index.h: Precompiled calendar index format
+ *
+ * An index is compiled offline by icalindex from a calendar containing a
+ * single VCALENDAR, and is mapped read only by mod_ical when found next
+ * to the source calendar. All offsets are relative to the start of the
+ * file, so that the index can be mapped at any address, and shared by all
+ * processes through the page cache.
+ *
+ * The index consists of a header, followed by one entry for each
+ * component of the calendar in source order, the entries sorted by end
+ * time, the heads of the UID hash chains, and a string arena containing
+ * the calendar with all indexed components removed (the prologue), the
+ * iCal text of each component, and the UID of each component.
+ *
+ * Recurring components, and the components that replace one of their
+ * occurrences, are marked as such. Their end is the end of the first
+ * occurrence only, and they are always parsed for the filter to expand.
+ */
+
+#ifndef ICAL_INDEX_H
+#define ICAL_INDEX_H
+
+#include "apr.h"
+#include "apr_lib.h"
+
+#define ICAL_INDEX_MAGIC "ICALIDX"
+#define ICAL_INDEX_VERSION 2
+#define ICAL_INDEX_BYTEORDER 0x01020304
+#define ICAL_INDEX_SUFFIX ".idx"
+
+/* slack in seconds applied to end times, to allow for floating times and
+ * dates that are interpreted relative to a timezone at request time.
+ */
+#define ICAL_INDEX_SLACK (2 * 86400)
+
+/* the component recurs, or replaces an occurrence of one that does */
+#define ICAL_INDEX_RECURS 0x01
+
+typedef struct ical_index_header {
+    char magic[8]; /* ICAL_INDEX_MAGIC */
+    apr_uint32_t version; /* ICAL_INDEX_VERSION */
+    apr_uint32_t byteorder; /* ICAL_INDEX_BYTEORDER in native order */
+    apr_uint64_t source_size; /* size of the source calendar */
+    apr_int64_t source_mtime; /* modification time of the source calendar */
+    apr_uint32_t count; /* number of indexed components */
+    apr_uint32_t buckets; /* number of UID hash buckets, a power of two */
+    apr_uint64_t prologue; /* offset of the calendar without components */
+    apr_uint32_t prologue_len; /* length of the prologue */
+    apr_uint32_t prologue_split; /* offset of END:VCALENDAR in the prologue */
+    apr_uint64_t entries; /* offset of the entries in source order */
+    apr_uint64_t order; /* offset of the entry numbers sorted by end time */
+    apr_uint64_t uids; /* offset of the UID hash chain heads */
+    apr_uint64_t arena; /* offset of the string arena */
+    apr_uint64_t arena_len; /* length of the string arena */
+} ical_index_header;
+
+typedef struct ical_index_entry {
+    apr_int64_t end; /* end of the component in seconds since the epoch */
+    apr_uint64_t ical; /* arena offset of the iCal text of the component */
+    apr_uint32_t ical_len; /* length of the iCal text */
+    apr_uint32_t uid; /* arena offset of the UID */
+    apr_uint32_t uid_len; /* length of the UID, zero if none */
+    apr_uint32_t uid_next; /* next entry in the hash chain plus one, or zero */
+    apr_uint32_t flags; /* ICAL_INDEX_RECURS */
+    apr_uint32_t unused; /* zero, keeps the entries aligned */
+} ical_index_entry;
+
+/* case insensitive FNV-1a, UIDs are matched with strcasecmp() */
+static APR_INLINE apr_uint32_t ical_index_hash(const char *str, apr_size_t len)
+{
+    apr_uint32_t hash = 2166136261U;
+    apr_size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (apr_uint32_t) apr_tolower((unsigned char) str[i]);
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+#endif /* ICAL_INDEX_H */
@@ -0,0 +1,531 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_recur.c: Occurrences of recurring components
+ */
+
+#include "apr_hash.h"
+#include "apr_md5.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
+
+#include "config.h"
+
+#include <libical/ical.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ical_recur.h"
+#include "ical_tz.h"
+
+typedef struct ical_recur_list {
+    apr_int64_t from; /* time the occurrences were expanded from */
+    apr_int64_t until; /* first time the occurrences no longer answer for */
+    apr_int64_t before; /* end of the last occurrence ending by from */
+    int has_before; /* an occurrence ends at or before from */
+    int count; /* number of occurrences ending after from */
+    apr_int64_t *ends; /* ends of the occurrences after from, in order */
+} ical_recur_list;
+
+typedef struct ical_recur_cache {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_rwlock_t *lock; /* guards lists */
+#endif
+    apr_pool_t *lists_pool; /* lists live here, cleared when too many */
+    apr_hash_t *lists; /* lists by recurrence and times of the component */
+    int stored; /* lists stored since lists_pool was last cleared */
+} ical_recur_cache;
+
+static ical_recur_cache *recur_cache;
+
+static apr_status_t recur_cache_cleanup(void *data)
+{
+    recur_cache = NULL;
+    return APR_SUCCESS;
+}
+
+apr_status_t ical_recur_init(apr_pool_t *pool)
+{
+    ical_recur_cache *cache;
+    apr_status_t rv;
+
+    if (recur_cache) {
+        return APR_SUCCESS;
+    }
+
+    cache = apr_pcalloc(pool, sizeof(ical_recur_cache));
+    cache->pool = pool;
+
+    rv = apr_pool_create(&cache->lists_pool, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    cache->lists = apr_hash_make(cache->lists_pool);
+
+#if APR_HAS_THREADS
+    rv = apr_thread_rwlock_create(&cache->lock, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+#endif
+
+    recur_cache = cache;
+    apr_pool_cleanup_register(pool, NULL, recur_cache_cleanup,
+            apr_pool_cleanup_null);
+
+    return APR_SUCCESS;
+}
+
+/* seconds since the epoch, floating times are treated as UTC */
+static apr_int64_t recur_time(struct icaltimetype tt)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+
+    if (!tt.is_date && tt.zone && tt.zone != utc) {
+        tt = ical_tz_convert(tt, utc);
+    }
+
+    return (apr_int64_t) icaltime_as_timet(tt);
+}
+
+/* the timezone given by the TZID parameter of the property, from the
+ * timezones of the calendar first, then the builtin timezones, noting
+ * which if asked.
+ */
+static icaltimezone *recur_zone(icalcomponent *comp, icalproperty *prop,
+        int *builtin)
+{
+    icalparameter *param = icalproperty_get_first_parameter(prop,
+            ICAL_TZID_PARAMETER);
+    const char *tzid = param ? icalparameter_get_tzid(param) : NULL;
+    icalcomponent *parent;
+    icaltimezone *zone;
+
+    if (!tzid) {
+        return NULL;
+    }
+
+    parent = icalcomponent_get_parent(comp);
+    zone = parent ? icalcomponent_get_timezone(parent, tzid) : NULL;
+    if (builtin) {
+        *builtin = !zone;
+    }
+
+    return zone ? zone : ical_tz_find(tzid);
+}
+
+apr_int64_t ical_recur_seconds(icalcomponent *comp, icalproperty *prop,
+        struct icaltimetype tt)
+{
+    icaltimezone *zone = recur_zone(comp, prop, NULL);
+
+    if (zone) {
+        tt.zone = zone;
+    }
+
+    return recur_time(tt);
+}
+
+static int recur_compare(const void *a, const void *b)
+{
+    apr_int64_t ta = *(const apr_int64_t *) a;
+    apr_int64_t tb = *(const apr_int64_t *) b;
+
+    return ta < tb ? -1 : ta > tb ? 1 : 0;
+}
+
+static int recur_excluded(const apr_array_header_t *excluded,
+        apr_int64_t start)
+{
+    return bsearch(&start, excluded->elts, excluded->nelts,
+            sizeof(apr_int64_t), recur_compare) != NULL;
+}
+
+/* the TZID of a timezone of the calendar and a digest of its rules, as
+ * the same TZID may name different rules in different calendars. Each is
+ * digested once for the calendar, and remembered in zones. Builtin
+ * timezones last as long as the process, and are known by their address
+ * alone, without loading their rules.
+ */
+static const char *recur_zone_key(apr_pool_t *pool, icaltimezone *zone,
+        int builtin, apr_hash_t *zones)
+{
+    unsigned char digest[APR_MD5_DIGESTSIZE];
+    char hex[2 * APR_MD5_DIGESTSIZE + 1];
+    icalcomponent *vtimezone;
+    const char *tzid, *key;
+    char *str;
+    int i;
+
+    if (builtin) {
+        return apr_psprintf(pool, "%pp;", zone);
+    }
+
+    key = zones ? apr_hash_get(zones, &zone, sizeof(zone)) : NULL;
+    if (key) {
+        return key;
+    }
+
+    vtimezone = icaltimezone_get_component(zone);
+    tzid = icaltimezone_get_tzid(zone);
+    str = vtimezone ? icalcomponent_as_ical_string_r(vtimezone) : NULL;
+
+    memset(digest, 0, sizeof(digest));
+    if (str) {
+        apr_md5(digest, str, strlen(str));
+        icalmemory_free_buffer(str);
+    }
+    for (i = 0; i < APR_MD5_DIGESTSIZE; i++) {
+        apr_snprintf(hex + 2 * i, 3, "%02x", digest[i]);
+    }
+
+    key = apr_psprintf(pool, "%s;%s;", tzid ? tzid : "", hex);
+    if (zones) {
+        apr_hash_set(zones, apr_pmemdup(pool, &zone, sizeof(zone)),
+                sizeof(zone), key);
+    }
+
+    return key;
+}
+
+/* the recurrence and times of the component, the rules of the timezones
+ * they are given in, and the occurrences replaced by other components,
+ * which together decide the occurrences.
+ */
+static const char *recur_key(apr_pool_t *pool, icalcomponent *comp,
+        const apr_array_header_t *overridden, apr_hash_t *zones)
+{
+    apr_array_header_t *parts = apr_array_make(pool, 8, sizeof(char *));
+    apr_hash_t *keyed = apr_hash_make(pool);
+    icalproperty *prop;
+    int i;
+
+    for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+            prop;
+            prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        char *str;
+
+        switch (icalproperty_isa(prop)) {
+        case ICAL_DTSTART_PROPERTY:
+        case ICAL_DTEND_PROPERTY:
+        case ICAL_DURATION_PROPERTY:
+        case ICAL_RRULE_PROPERTY:
+        case ICAL_RDATE_PROPERTY:
+        case ICAL_EXDATE_PROPERTY: {
+            int builtin;
+            icaltimezone *zone = recur_zone(comp, prop, &builtin);
+
+            str = icalproperty_as_ical_string_r(prop);
+            if (str) {
+                APR_ARRAY_PUSH(parts, char *) = apr_pstrdup(pool, str);
+                icalmemory_free_buffer(str);
+            }
+            if (zone && !apr_hash_get(keyed, &zone, sizeof(zone))) {
+                icaltimezone **seen = apr_pmemdup(pool, &zone, sizeof(zone));
+
+                apr_hash_set(keyed, seen, sizeof(zone), seen);
+                APR_ARRAY_PUSH(parts, const char *) =
+                        recur_zone_key(pool, zone, builtin, zones);
+            }
+            break;
+        }
+        default: {
+            break;
+        }
+        }
+    }
+
+    for (i = 0; overridden && i < overridden->nelts; i++) {
+        APR_ARRAY_PUSH(parts, char *) = apr_psprintf(pool,
+                "%" APR_INT64_T_FMT ";",
+                APR_ARRAY_IDX(overridden, i, apr_int64_t));
+    }
+
+    return apr_array_pstrcat(pool, parts, 0);
+}
+
+static void recur_occurrence(ical_recur_list *list, apr_array_header_t *ends,
+        apr_int64_t end)
+{
+    if (end > list->from) {
+        APR_ARRAY_PUSH(ends, apr_int64_t) = end;
+    }
+    else if (!list->has_before || end > list->before) {
+        list->before = end;
+        list->has_before = 1;
+    }
+}
+
+/*
+ * Expand the occurrences of the component from its start until the first
+ * occurrence of each rule to start past the window, or until the budget
+ * runs out. Occurrences of a rule not expanded end after the last one that
+ * was, and the list answers for times until the earliest such end.
+ */
+static apr_status_t recur_expand(apr_pool_t *pool, icalcomponent *comp,
+        const apr_array_header_t *overridden, apr_int64_t now,
+        apr_size_t *budget, ical_recur_list *list)
+{
+    struct icaltimetype dtstart = icalcomponent_get_dtstart(comp);
+    struct icaltimetype dtend = icalcomponent_get_dtend(comp);
+    apr_array_header_t *excluded, *ends;
+    apr_int64_t start, duration, horizon = now + ICAL_RECUR_WINDOW;
+    icalproperty *prop;
+
+    if (icaltime_is_null_time(dtstart)) {
+        return APR_ENOENT;
+    }
+    if (!*budget) {
+        return APR_INCOMPLETE;
+    }
+
+    memset(list, 0, sizeof(ical_recur_list));
+    list->from = now;
+    list->until = APR_INT64_MAX;
+
+    start = recur_time(dtstart);
+    duration = icaltime_is_null_time(dtend) ? 0 : recur_time(dtend) - start;
+
+    /* occurrences removed, and occurrences replaced */
+    excluded = apr_array_make(pool, 8, sizeof(apr_int64_t));
+    for (prop = icalcomponent_get_first_property(comp, ICAL_EXDATE_PROPERTY);
+            prop;
+            prop = icalcomponent_get_next_property(comp,
+                    ICAL_EXDATE_PROPERTY)) {
+        APR_ARRAY_PUSH(excluded, apr_int64_t) = ical_recur_seconds(comp, prop,
+                icalproperty_get_exdate(prop));
+    }
+    if (overridden) {
+        apr_array_cat(excluded, overridden);
+    }
+    qsort(excluded->elts, excluded->nelts, sizeof(apr_int64_t),
+            recur_compare);
+
+    ends = apr_array_make(pool, 16, sizeof(apr_int64_t));
+
+    /* the start is always the first occurrence */
+    if (!recur_excluded(excluded, start)) {
+        recur_occurrence(list, ends, start + duration);
+    }
+
+    /* each date given, which are few enough not to count */
+    for (prop = icalcomponent_get_first_property(comp, ICAL_RDATE_PROPERTY);
+            prop;
+            prop = icalcomponent_get_next_property(comp,
+                    ICAL_RDATE_PROPERTY)) {
+        struct icaldatetimeperiodtype rdate = icalproperty_get_rdate(prop);
+        apr_int64_t rstart, rend;
+
+        if (!icaltime_is_null_time(rdate.time)) {
+            rstart = ical_recur_seconds(comp, prop, rdate.time);
+            rend = rstart + duration;
+        }
+        else {
+            rstart = ical_recur_seconds(comp, prop, rdate.period.start);
+            if (!icaltime_is_null_time(rdate.period.end)) {
+                rend = ical_recur_seconds(comp, prop, rdate.period.end);
+            }
+            else {
+                rend = rstart
+                        + icaldurationtype_as_int(rdate.period.duration);
+            }
+        }
+
+        if (!recur_excluded(excluded, rstart)) {
+            recur_occurrence(list, ends, rend);
+        }
+    }
+
+    /* each rule, up to the window */
+    for (prop = icalcomponent_get_first_property(comp, ICAL_RRULE_PROPERTY);
+            prop;
+            prop = icalcomponent_get_next_property(comp,
+                    ICAL_RRULE_PROPERTY)) {
+        icalrecur_iterator *iter = icalrecur_iterator_new(
+                icalproperty_get_rrule(prop), dtstart);
+        apr_int64_t last = APR_INT64_MIN;
+
+        if (!iter) {
+            continue;
+        }
+
+        while (1) {
+            struct icaltimetype next;
+            apr_int64_t occurrence;
+
+            if (!*budget) {
+                if (last < list->until) {
+                    list->until = last;
+                }
+                break;
+            }
+            (*budget)--;
+
+            next = icalrecur_iterator_next(iter);
+            if (icaltime_is_null_time(next)) {
+                break;
+            }
+            next.zone = dtstart.zone;
+
+            occurrence = recur_time(next);
+            last = occurrence + duration;
+
+            if (!recur_excluded(excluded, occurrence)) {
+                recur_occurrence(list, ends, last);
+            }
+
+            if (occurrence > horizon) {
+                if (last < list->until) {
+                    list->until = last;
+                }
+                break;
+            }
+        }
+
+        icalrecur_iterator_free(iter);
+    }
+
+    /* the budget ran out before now was reached */
+    if (list->until <= list->from) {
+        return APR_INCOMPLETE;
+    }
+
+    qsort(ends->elts, ends->nelts, sizeof(apr_int64_t), recur_compare);
+    list->ends = (apr_int64_t *) ends->elts;
+    list->count = ends->nelts;
+
+    return APR_SUCCESS;
+}
+
+static void recur_query(const ical_recur_list *list, apr_int64_t now,
+        ical_recur_ends *found)
+{
+    int low = 0, high = list->count, after;
+
+    memset(found, 0, sizeof(ical_recur_ends));
+
+    /* first end at or after now */
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+
+        if (list->ends[mid] < now) {
+            low = mid + 1;
+        }
+        else {
+            high = mid;
+        }
+    }
+    if (list->has_before && list->before >= now) {
+        found->next = list->before;
+        found->has_next = 1;
+    }
+    else if (low < list->count) {
+        found->next = list->ends[low];
+        found->has_next = 1;
+    }
+
+    /* last end at or before now */
+    after = low;
+    while (after < list->count && list->ends[after] <= now) {
+        after++;
+    }
+    if (after > 0) {
+        found->last = list->ends[after - 1];
+        found->has_last = 1;
+    }
+    else if (list->has_before) {
+        found->last = list->before;
+        found->has_last = 1;
+    }
+}
+
+apr_status_t ical_recur_find(apr_pool_t *pool, icalcomponent *comp,
+        const apr_array_header_t *overridden, apr_int64_t now,
+        apr_size_t *budget, apr_hash_t *zones, ical_recur_ends *ends)
+{
+    ical_recur_list list, *cached = NULL;
+    const char *key;
+    apr_status_t rv;
+
+    /* replacements of a single occurrence stand alone */
+    if ((!icalcomponent_get_first_property(comp, ICAL_RRULE_PROPERTY)
+            && !icalcomponent_get_first_property(comp, ICAL_RDATE_PROPERTY))
+            || icalcomponent_get_first_property(comp,
+                    ICAL_RECURRENCEID_PROPERTY)) {
+        return APR_ENOENT;
+    }
+
+    key = recur_key(pool, comp, overridden, zones);
+
+    if (recur_cache) {
+        int found = 0;
+
+#if APR_HAS_THREADS
+        apr_thread_rwlock_rdlock(recur_cache->lock);
+#endif
+        cached = apr_hash_get(recur_cache->lists, key, APR_HASH_KEY_STRING);
+        if (cached && cached->from <= now && now < cached->until) {
+            recur_query(cached, now, ends);
+            found = 1;
+        }
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(recur_cache->lock);
+#endif
+
+        if (found) {
+            return APR_SUCCESS;
+        }
+    }
+
+    rv = recur_expand(pool, comp, overridden, now, budget, &list);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    if (recur_cache) {
+
+#if APR_HAS_THREADS
+        apr_thread_rwlock_wrlock(recur_cache->lock);
+#endif
+        if (recur_cache->stored >= ICAL_RECUR_CACHE_MAX) {
+            apr_pool_clear(recur_cache->lists_pool);
+            recur_cache->lists = apr_hash_make(recur_cache->lists_pool);
+            recur_cache->stored = 0;
+        }
+        cached = apr_pmemdup(recur_cache->lists_pool, &list,
+                sizeof(ical_recur_list));
+        cached->ends = apr_pmemdup(recur_cache->lists_pool, list.ends,
+                list.count * sizeof(apr_int64_t));
+        apr_hash_set(recur_cache->lists,
+                apr_pstrdup(recur_cache->lists_pool, key),
+                APR_HASH_KEY_STRING, cached);
+        recur_cache->stored++;
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(recur_cache->lock);
+#endif
+
+    }
+
+    recur_query(&list, now, ends);
+
+    return APR_SUCCESS;
+}
@@ -0,0 +1,91 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_recur.h: Occurrences of recurring components
+ *
+ * A component with an RRULE or RDATE is expanded into its occurrences,
+ * less those removed by EXDATE and those replaced by another component
+ * with the same UID and a matching RECURRENCE-ID, so that filters can
+ * find the occurrences either side of the current time.
+ *
+ * Occurrences are expanded from the start of the component up to a window
+ * past the current time, and each expansion is limited by a budget of
+ * occurrences shared by the whole request. Only the end of the last
+ * occurrence to end before the expansion, and the ends of the occurrences
+ * after it, are kept, and are remembered for the life of the process by
+ * the recurrence and times of the component and the rules of their
+ * timezones, so that later requests up to the end of the window do not
+ * expand the component again.
+ */
+
+#ifndef ICAL_RECUR_H
+#define ICAL_RECUR_H
+
+#include "apr_hash.h"
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+#include <libical/ical.h>
+
+/* occurrences are expanded up to this many seconds past the current time */
+#define ICAL_RECUR_WINDOW (366 * 86400)
+
+/* most occurrences expanded by a single request */
+#define ICAL_RECUR_BUDGET 100000
+
+/* most expansions remembered before the cache is emptied and started
+ * again, so that expansions replaced as time moves on cannot grow the
+ * cache without limit.
+ */
+#define ICAL_RECUR_CACHE_MAX 4096
+
+typedef struct ical_recur_ends {
+    apr_int64_t next; /* end of the first occurrence ending at or after now */
+    apr_int64_t last; /* end of the last occurrence ending at or before now */
+    int has_next; /* an occurrence ends at or after now */
+    int has_last; /* an occurrence ends at or before now */
+} ical_recur_ends;
+
+/**
+ * Create the cache of expanded occurrences, which lives as long as the
+ * pool. Must be called before any threads are started. Without the cache,
+ * components are expanded each time they are asked for.
+ */
+apr_status_t ical_recur_init(apr_pool_t *pool);
+
+/**
+ * Return the time in seconds since the epoch of the date or date-time
+ * value of the property, in the timezone given by its TZID parameter.
+ * Floating times are treated as UTC.
+ */
+apr_int64_t ical_recur_seconds(icalcomponent *comp, icalproperty *prop,
+        struct icaltimetype tt);
+
+/**
+ * Find the ends of the occurrences of the component either side of now,
+ * in seconds since the epoch. Occurrences starting at the times given in
+ * overridden, an array of apr_int64_t, are left out. The budget is reduced
+ * by the occurrences expanded. The timezones of the calendar are digested
+ * once into zones, a hash made by the caller for each calendar, if given.
+ * Returns APR_ENOENT if the component does not recur, and APR_INCOMPLETE
+ * if the budget ran out before now was reached.
+ */
+apr_status_t ical_recur_find(apr_pool_t *pool, icalcomponent *comp,
+        const apr_array_header_t *overridden, apr_int64_t now,
+        apr_size_t *budget, apr_hash_t *zones, ical_recur_ends *ends);
+
+#endif /* ICAL_RECUR_H */
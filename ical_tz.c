@@ -0,0 +1,1051 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_tz.c: Timezone lookups
+ */
+
+#include "apr_hash.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#if APR_HAS_THREADS
+#include "apr_thread_rwlock.h"
+#endif
+
+#include "config.h"
+
+#include <libical/ical.h>
+
+#include <string.h>
+
+#include "ical_tz.h"
+#include "ical_zoneinfo.h"
+
+/* remembered in place of a timezone that could not be found */
+static const char ical_tz_missing[] = "missing";
+
+/* remembered for a builtin timezone whose table is not yet built */
+static const char ical_tz_unbuilt[] = "unbuilt";
+
+typedef struct ical_tz_change {
+    apr_int64_t utc; /* time of the change in seconds since the epoch */
+    apr_int64_t local; /* earliest local time that may be on either side */
+    apr_int64_t settled; /* earliest local time after the change */
+    int offset; /* offset from UTC from the change onwards */
+    int daylight; /* daylight saving time from the change onwards */
+} ical_tz_change;
+
+typedef struct ical_tz_table {
+    apr_int64_t start; /* first time covered by the table */
+    apr_int64_t end; /* first time past the end of the table */
+    int offset; /* offset from UTC before the first change */
+    int daylight; /* daylight saving time before the first change */
+    int count; /* number of changes */
+    ical_tz_change *changes; /* changes in time order */
+    const ical_zoneinfo *zoneinfo; /* read from the system zoneinfo */
+} ical_tz_table;
+
+typedef struct ical_tz_maps {
+    apr_hash_t *tzids; /* timezones by TZID, then by location */
+    apr_hash_t *locations; /* timezones by location only */
+    apr_hash_t *tables; /* transition tables of builtin timezones */
+} ical_tz_maps;
+
+typedef struct ical_tz_cache {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_rwlock_t *lock; /* guards late, and fixed until frozen */
+#endif
+    int frozen; /* fixed is no longer changed, and is read without locks */
+    ical_tz_maps fixed; /* timezones found before the cache was frozen */
+    ical_tz_maps late; /* timezones first found after the cache was frozen */
+    apr_pool_t *misses_pool; /* misses live here, cleared when too many */
+    apr_hash_t *missing_tzids; /* TZIDs not found since frozen */
+    apr_hash_t *missing_locations; /* locations not found since frozen */
+    int missed; /* misses stored since misses_pool was last cleared */
+    apr_hash_t *vtimezones; /* truncated timezone components by span */
+    const char *zoneinfo; /* directory of TZif files, or NULL for libical */
+} ical_tz_cache;
+
+typedef struct ical_tz_span {
+    const icaltimezone *zone;
+    int first; /* first year covered */
+    int last; /* last year covered */
+} ical_tz_span;
+
+static ical_tz_cache *tz_cache;
+
+static apr_status_t tz_cache_cleanup(void *data)
+{
+    tz_cache = NULL;
+    return APR_SUCCESS;
+}
+
+static void tz_maps_make(ical_tz_maps *maps, apr_pool_t *pool)
+{
+    maps->tzids = apr_hash_make(pool);
+    maps->locations = apr_hash_make(pool);
+    maps->tables = apr_hash_make(pool);
+}
+
+/* maps that new lookups are remembered in, only changed under the lock */
+static ical_tz_maps *tz_maps(void)
+{
+    return tz_cache->frozen ? &tz_cache->late : &tz_cache->fixed;
+}
+
+static apr_hash_t *tz_names(ical_tz_maps *maps, int location)
+{
+    return location ? maps->locations : maps->tzids;
+}
+
+/* names not found since the cache was frozen, only changed under the lock */
+static apr_hash_t *tz_misses(int location)
+{
+    return location ? tz_cache->missing_locations : tz_cache->missing_tzids;
+}
+
+/* remember a name not found since the cache was frozen, starting again
+ * once too many are remembered, so that a stream of unknown names can
+ * neither grow the cache nor push out the names that are found.
+ */
+static void tz_missed(const char *name, int location)
+{
+    if (tz_cache->missed >= ICAL_TZ_MISSES_MAX) {
+        apr_pool_clear(tz_cache->misses_pool);
+        tz_cache->missing_tzids = apr_hash_make(tz_cache->misses_pool);
+        tz_cache->missing_locations = apr_hash_make(tz_cache->misses_pool);
+        tz_cache->missed = 0;
+    }
+
+    apr_hash_set(tz_misses(location), apr_pstrdup(tz_cache->misses_pool,
+            name), APR_HASH_KEY_STRING, ical_tz_missing);
+    tz_cache->missed++;
+}
+
+static void tz_builtin(icaltimezone *tz)
+{
+    apr_hash_t *tables = tz_maps()->tables;
+
+    if (!apr_hash_get(tz_cache->fixed.tables, &tz, sizeof(tz))
+            && !apr_hash_get(tables, &tz, sizeof(tz))) {
+        icaltimezone **key = apr_palloc(tz_cache->pool, sizeof(tz));
+        *key = tz;
+        apr_hash_set(tables, key, sizeof(tz), ical_tz_unbuilt);
+    }
+}
+
+apr_status_t ical_tz_init(apr_pool_t *pool)
+{
+    ical_tz_cache *cache;
+    apr_status_t rv = APR_SUCCESS;
+
+    if (tz_cache) {
+        return APR_SUCCESS;
+    }
+
+    cache = apr_pcalloc(pool, sizeof(ical_tz_cache));
+    cache->pool = pool;
+    tz_maps_make(&cache->fixed, pool);
+    tz_maps_make(&cache->late, pool);
+    cache->vtimezones = apr_hash_make(pool);
+
+    rv = apr_pool_create(&cache->misses_pool, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+    cache->missing_tzids = apr_hash_make(cache->misses_pool);
+    cache->missing_locations = apr_hash_make(cache->misses_pool);
+
+#if APR_HAS_THREADS
+    rv = apr_thread_rwlock_create(&cache->lock, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+#endif
+
+    tz_cache = cache;
+    apr_pool_cleanup_register(pool, NULL, tz_cache_cleanup,
+            apr_pool_cleanup_null);
+
+    tz_builtin(icaltimezone_get_utc_timezone());
+
+    return rv;
+}
+
+static icaltimezone *tz_search(const char *name, int location)
+{
+    icaltimezone *tz = NULL;
+
+    /* first, try read the TZID, and if that fails, treat it as a location */
+    if (!location) {
+        tz = icaltimezone_get_builtin_timezone_from_tzid(name);
+    }
+    if (!tz) {
+        tz = icaltimezone_get_builtin_timezone(name);
+    }
+
+    return tz;
+}
+
+static icaltimezone *tz_lookup(const char *name, int location)
+{
+    const void *found = NULL;
+    apr_hash_t *hash;
+
+    if (!name) {
+        return NULL;
+    }
+
+    if (!tz_cache) {
+        return tz_search(name, location);
+    }
+
+    if (tz_cache->frozen) {
+        found = apr_hash_get(tz_names(&tz_cache->fixed, location), name,
+                APR_HASH_KEY_STRING);
+        if (found) {
+            return found == ical_tz_missing ? NULL : (icaltimezone *) found;
+        }
+    }
+
+    hash = tz_names(tz_maps(), location);
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(tz_cache->lock);
+#endif
+    found = apr_hash_get(hash, name, APR_HASH_KEY_STRING);
+    if (!found && tz_cache->frozen) {
+        found = apr_hash_get(tz_misses(location), name, APR_HASH_KEY_STRING);
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    if (!found) {
+
+        /* libical searches are not thread safe, search under the lock */
+#if APR_HAS_THREADS
+        apr_thread_rwlock_wrlock(tz_cache->lock);
+#endif
+        found = apr_hash_get(hash, name, APR_HASH_KEY_STRING);
+        if (!found && tz_cache->frozen) {
+            found = apr_hash_get(tz_misses(location), name,
+                    APR_HASH_KEY_STRING);
+        }
+        if (!found) {
+            icaltimezone *tz = tz_search(name, location);
+
+            found = tz ? (const void *) tz : ical_tz_missing;
+            if (tz) {
+                tz_builtin(tz);
+            }
+            if (!tz && tz_cache->frozen) {
+                tz_missed(name, location);
+            }
+            else if (apr_hash_count(hash) < ICAL_TZ_CACHE_MAX) {
+                apr_hash_set(hash, apr_pstrdup(tz_cache->pool, name),
+                        APR_HASH_KEY_STRING, found);
+            }
+        }
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    }
+
+    return found == ical_tz_missing ? NULL : (icaltimezone *) found;
+}
+
+icaltimezone *ical_tz_find(const char *tzid)
+{
+    return tz_lookup(tzid, 0);
+}
+
+icaltimezone *ical_tz_location(const char *location)
+{
+    return tz_lookup(location, 1);
+}
+
+/* seconds since the epoch of the fields of the time, ignoring the zone */
+static apr_int64_t tz_seconds(const struct icaltimetype *tt)
+{
+    apr_int64_t y = tt->year - (tt->month <= 2);
+    apr_int64_t era = (y >= 0 ? y : y - 399) / 400;
+    apr_int64_t yoe = y - era * 400;
+    apr_int64_t doy = (153 * (tt->month + (tt->month > 2 ? -3 : 9)) + 2) / 5
+            + tt->day - 1;
+    apr_int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    apr_int64_t days = era * 146097 + doe - 719468;
+
+    return ((days * 24 + tt->hour) * 60 + tt->minute) * 60 + tt->second;
+}
+
+/* set the fields of the time from seconds since the epoch */
+static void tz_fields(struct icaltimetype *tt, apr_int64_t secs)
+{
+    apr_int64_t days = (secs >= 0 ? secs : secs - 86399) / 86400;
+    apr_int64_t rem = secs - days * 86400;
+    apr_int64_t z = days + 719468;
+    apr_int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    apr_int64_t doe = z - era * 146097;
+    apr_int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    apr_int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    apr_int64_t mp = (5 * doy + 2) / 153;
+
+    tt->day = doy - (153 * mp + 2) / 5 + 1;
+    tt->month = mp + (mp < 10 ? 3 : -9);
+    tt->year = yoe + era * 400 + (tt->month <= 2);
+    tt->hour = rem / 3600;
+    tt->minute = rem / 60 % 60;
+    tt->second = rem % 60;
+}
+
+static int tz_offset_at(icaltimezone *zone, apr_int64_t secs, int *daylight)
+{
+    struct icaltimetype tt = icaltime_null_time();
+
+    tz_fields(&tt, secs);
+    tt.zone = icaltimezone_get_utc_timezone();
+
+    return icaltimezone_get_utc_offset_of_utc_time(zone, &tt, daylight);
+}
+
+static void tz_change_set(ical_tz_change *change, apr_int64_t utc,
+        int from, int to, int daylight)
+{
+    change->utc = utc;
+    change->local = utc + (from < to ? from : to);
+    change->settled = utc + (from < to ? to : from);
+    change->offset = to;
+    change->daylight = daylight;
+}
+
+static void tz_change_push(apr_array_header_t *changes, apr_int64_t utc,
+        int from, int to, int daylight)
+{
+    tz_change_set(apr_array_push(changes), utc, from, to, daylight);
+}
+
+/*
+ * Every change recorded in the TZif file is read, from the first year of
+ * the calendar, so that the table covers all times before its end. Past
+ * the end, the rule in the footer of the file is kept to answer for.
+ */
+static apr_status_t tz_table_zoneinfo(icaltimezone *zone,
+        ical_tz_table *table, apr_array_header_t *changes)
+{
+    const char *location = icaltimezone_get_location(zone);
+    struct icaltimetype edge = icaltime_null_time();
+    ical_zoneinfo zi;
+    apr_int64_t start;
+    apr_status_t rv;
+    int i, offset;
+
+    if (!location) {
+        return APR_ENOENT;
+    }
+
+    edge.year = edge.month = edge.day = 1;
+    start = tz_seconds(&edge);
+
+    rv = ical_zoneinfo_read(tz_cache->pool, tz_cache->zoneinfo, location,
+            start, table->end, &zi);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    table->start = start;
+    table->zoneinfo = apr_pmemdup(tz_cache->pool, &zi, sizeof(zi));
+    table->offset = offset = zi.offset;
+    table->daylight = zi.daylight;
+
+    for (i = 0; i < zi.changes->nelts; i++) {
+        ical_zoneinfo_change *change = &APR_ARRAY_IDX(zi.changes, i,
+                ical_zoneinfo_change);
+
+        tz_change_push(changes, change->utc, offset, change->offset,
+                change->daylight);
+        offset = change->offset;
+    }
+
+    return APR_SUCCESS;
+}
+
+/*
+ * The offsets of the timezone are read from the system zoneinfo if asked
+ * for. Otherwise they are sampled through libical across the years
+ * covered, and each change found is narrowed down to the second.
+ */
+static ical_tz_table *tz_table_build(icaltimezone *zone)
+{
+    ical_tz_table *table = apr_pcalloc(tz_cache->pool, sizeof(ical_tz_table));
+    apr_array_header_t *changes = apr_array_make(tz_cache->pool, 64,
+            sizeof(ical_tz_change));
+    struct icaltimetype now = icaltime_today();
+    struct icaltimetype edge = icaltime_null_time();
+    apr_int64_t secs;
+    int offset, daylight;
+
+    edge.month = edge.day = 1;
+    edge.year = now.year - ICAL_TZ_YEARS_BEFORE;
+    table->start = tz_seconds(&edge);
+    edge.year = now.year + ICAL_TZ_YEARS_AFTER;
+    table->end = tz_seconds(&edge);
+
+    /* the system zoneinfo, when asked for and understood */
+    if (tz_cache->zoneinfo
+            && tz_table_zoneinfo(zone, table, changes) == APR_SUCCESS) {
+        table->count = changes->nelts;
+        table->changes = (ical_tz_change *) changes->elts;
+        return table;
+    }
+
+    table->offset = offset = tz_offset_at(zone, table->start,
+            &table->daylight);
+
+    for (secs = table->start + ICAL_TZ_SAMPLE; secs < table->end;
+            secs += ICAL_TZ_SAMPLE) {
+        int next = tz_offset_at(zone, secs, NULL);
+
+        if (next != offset) {
+            apr_int64_t lo = secs - ICAL_TZ_SAMPLE, hi = secs;
+
+            /* the change is after lo and no later than hi */
+            while (hi - lo > 1) {
+                apr_int64_t mid = lo + (hi - lo) / 2;
+
+                if (tz_offset_at(zone, mid, NULL) == offset) {
+                    lo = mid;
+                }
+                else {
+                    hi = mid;
+                }
+            }
+
+            tz_offset_at(zone, hi, &daylight);
+            tz_change_push(changes, hi, offset, next, daylight);
+            offset = next;
+        }
+
+    }
+
+    table->count = changes->nelts;
+    table->changes = (ical_tz_change *) changes->elts;
+
+    return table;
+}
+
+static const ical_tz_table *tz_table(const icaltimezone *zone)
+{
+    const void *found = NULL;
+    apr_hash_t *tables;
+
+    if (!tz_cache || !zone) {
+        return NULL;
+    }
+
+    /* every table in the frozen maps is built */
+    if (tz_cache->frozen) {
+        found = apr_hash_get(tz_cache->fixed.tables, &zone, sizeof(zone));
+        if (found) {
+            return found;
+        }
+    }
+
+    tables = tz_maps()->tables;
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(tz_cache->lock);
+#endif
+    found = apr_hash_get(tables, &zone, sizeof(zone));
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    if (found == ical_tz_unbuilt) {
+
+#if APR_HAS_THREADS
+        apr_thread_rwlock_wrlock(tz_cache->lock);
+#endif
+        found = apr_hash_get(tables, &zone, sizeof(zone));
+        if (found == ical_tz_unbuilt) {
+            found = tz_table_build((icaltimezone *) zone);
+            apr_hash_set(tables, &zone, sizeof(zone), found);
+        }
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    }
+
+    return found;
+}
+
+/* a table of the changes made by the rule in the footer of the TZif file
+ * in the years around the given time, for times near or past the end of a
+ * table read from the system zoneinfo.
+ */
+static int tz_table_near(const ical_tz_table *table, apr_int64_t secs,
+        ical_tz_table *near, ical_tz_change *changes)
+{
+    const ical_zoneinfo *zi = table->zoneinfo;
+    struct icaltimetype edge = icaltime_null_time();
+    ical_zoneinfo_change found[2];
+    apr_int64_t year, y;
+    int i, n, offset;
+
+    if (!zi || !zi->footer || secs < table->end - 86400) {
+        return 0;
+    }
+
+    tz_fields(&edge, secs);
+    year = edge.year;
+    edge.month = edge.day = 1;
+    edge.hour = edge.minute = edge.second = 0;
+
+    memset(near, 0, sizeof(ical_tz_table));
+    edge.year = year - 1;
+    near->start = tz_seconds(&edge);
+    edge.year = year + 2;
+    near->end = tz_seconds(&edge);
+    near->changes = changes;
+    near->zoneinfo = zi;
+
+    /* the rule only applies after the last transition in the file */
+    if (zi->until >= near->start) {
+        return 0;
+    }
+
+    /* the offset at the start is that after the last change of the year
+     * before.
+     */
+    n = ical_zoneinfo_year(zi, year - 2, found);
+    near->offset = offset = n ? found[n - 1].offset : zi->posix.std;
+    near->daylight = n ? found[n - 1].daylight : 0;
+
+    for (y = year - 1; y <= year + 1; y++) {
+        n = ical_zoneinfo_year(zi, y, found);
+        for (i = 0; i < n; i++) {
+            tz_change_set(&changes[near->count++], found[i].utc, offset,
+                    found[i].offset, found[i].daylight);
+            offset = found[i].offset;
+        }
+    }
+
+    return 1;
+}
+
+/* offset of the given UTC time, or zero if not covered by the table */
+static int tz_utc_offset(const ical_tz_table *table, apr_int64_t secs,
+        int *offset, int *daylight)
+{
+    ical_tz_change changes[6];
+    ical_tz_table near;
+    int lo = 0, hi;
+
+    if (tz_table_near(table, secs, &near, changes)) {
+        table = &near;
+    }
+
+    if (secs < table->start || secs >= table->end) {
+        return 0;
+    }
+    hi = table->count;
+
+    /* find the first change after the time */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (table->changes[mid].utc <= secs) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    *offset = lo ? table->changes[lo - 1].offset : table->offset;
+    if (daylight) {
+        *daylight = lo ? table->changes[lo - 1].daylight : table->daylight;
+    }
+
+    return 1;
+}
+
+/* offset of the given local time, or zero if not covered by the table or
+ * if the time is skipped or repeated by a change. Tables read from the
+ * system zoneinfo give skipped and repeated times the offset before the
+ * change, as RFC 5545 does.
+ */
+static int tz_local_offset(const ical_tz_table *table, apr_int64_t secs,
+        int *offset)
+{
+    ical_tz_change changes[6];
+    ical_tz_table near;
+    int lo = 0, hi;
+
+    if (tz_table_near(table, secs, &near, changes)) {
+        table = &near;
+    }
+
+    /* leave a day either side for the offset itself */
+    if (secs < table->start + 86400 || secs >= table->end - 86400) {
+        return 0;
+    }
+    hi = table->count;
+
+    /* find the first change that might be after the time */
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (table->changes[mid].local <= secs) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    if (lo && secs < table->changes[lo - 1].settled) {
+        if (!table->zoneinfo) {
+            return 0;
+        }
+        lo--;
+    }
+
+    *offset = lo ? table->changes[lo - 1].offset : table->offset;
+
+    return 1;
+}
+
+icaltimezone *ical_tz_preload(const char *location)
+{
+    icaltimezone *tz = ical_tz_location(location);
+
+    if (tz) {
+        /* loads and expands the zoneinfo */
+        icaltimezone_get_component(tz);
+        tz_table(tz);
+    }
+
+    return tz;
+}
+
+int ical_tz_preload_all(void)
+{
+    icalarray *zones = icaltimezone_get_builtin_timezones();
+    size_t i;
+    int count = 0;
+
+    for (i = 0; zones && i < zones->num_elements; i++) {
+        icaltimezone *tz = icalarray_element_at(zones, i);
+
+        if (icaltimezone_get_component(tz)) {
+            /* remember the names, the tables are built by
+             * ical_tz_build() so that they can be shared.
+             */
+            if (tz_cache && !tz_cache->frozen) {
+                const char *tzid = icaltimezone_get_tzid(tz);
+                const char *location = icaltimezone_get_location(tz);
+
+                if (tzid) {
+                    apr_hash_set(tz_cache->fixed.tzids,
+                            apr_pstrdup(tz_cache->pool, tzid),
+                            APR_HASH_KEY_STRING, tz);
+                }
+                if (location) {
+                    location = apr_pstrdup(tz_cache->pool, location);
+                    apr_hash_set(tz_cache->fixed.tzids, location,
+                            APR_HASH_KEY_STRING, tz);
+                    apr_hash_set(tz_cache->fixed.locations, location,
+                            APR_HASH_KEY_STRING, tz);
+                }
+                tz_builtin(tz);
+            }
+            count++;
+        }
+    }
+
+    return count;
+}
+
+static apr_status_t tz_vtimezone_cleanup(void *data)
+{
+    icalcomponent_free(data);
+    return APR_SUCCESS;
+}
+
+/* add an observance starting at the given UTC time */
+static icalcomponent *tz_observance(icalcomponent *vtz, const char **names,
+        apr_int64_t secs, int from, int to, int daylight)
+{
+    icalcomponent *obs = icalcomponent_new(daylight ?
+            ICAL_XDAYLIGHT_COMPONENT : ICAL_XSTANDARD_COMPONENT);
+    struct icaltimetype start = icaltime_null_time();
+
+    /* the start is given in the local time before the change */
+    tz_fields(&start, secs + from);
+
+    if (names[daylight != 0]) {
+        icalcomponent_add_property(obs,
+                icalproperty_new_tzname(names[daylight != 0]));
+    }
+    icalcomponent_add_property(obs, icalproperty_new_dtstart(start));
+    icalcomponent_add_property(obs, icalproperty_new_tzoffsetfrom(from));
+    icalcomponent_add_property(obs, icalproperty_new_tzoffsetto(to));
+
+    icalcomponent_add_component(vtz, obs);
+
+    return obs;
+}
+
+/* the rule in the footer of the TZif file the table was read from, where
+ * it answers for every time past the end of the table.
+ */
+static const ical_zoneinfo *tz_table_rule(const ical_tz_table *table)
+{
+    const ical_zoneinfo *zi = table->zoneinfo;
+
+    return zi && zi->footer && zi->until < table->end ? zi : NULL;
+}
+
+/* the changes made by a rule as a yearly RRULE on the local day of the
+ * change, or zero where the rule cannot be given as one.
+ */
+static int tz_rule_recur(const ical_zoneinfo_rule *rule, char *buf,
+        apr_size_t len)
+{
+    static const char *const days[] = { "SU", "MO", "TU", "WE", "TH", "FR",
+            "SA" };
+    /* changes given outside the day fall on a day either side */
+    int shift = (int) ((rule->time >= 0 ? rule->time : rule->time - 86399)
+            / 86400);
+    int first, i;
+    char *p;
+
+    switch (rule->kind) {
+    case 'J': {
+        struct icaltimetype tt = icaltime_null_time();
+
+        /* days of the year ignoring leap days are those of 1970 */
+        if (rule->day + shift < 1 || rule->day + shift > 365) {
+            return 0;
+        }
+        tz_fields(&tt, (apr_int64_t) (rule->day + shift - 1) * 86400);
+        apr_snprintf(buf, len, "RRULE:FREQ=YEARLY;BYMONTH=%d;BYMONTHDAY=%d",
+                tt.month, tt.day);
+        return 1;
+    }
+    case 'D': {
+        if (rule->day + shift < 0 || rule->day + shift > 365) {
+            return 0;
+        }
+        apr_snprintf(buf, len, "RRULE:FREQ=YEARLY;BYYEARDAY=%d",
+                rule->day + shift + 1);
+        return 1;
+    }
+    default: {
+        if (!shift) {
+            apr_snprintf(buf, len, "RRULE:FREQ=YEARLY;BYMONTH=%d;BYDAY=%d%s",
+                    rule->month, rule->week == 5 ? -1 : rule->week,
+                    days[rule->day]);
+            return 1;
+        }
+
+        /* the days of the month the weekday may fall on, moved with it,
+         * so long as they stay within the month.
+         */
+        first = (rule->week == 5 ? -7 : 7 * rule->week - 6) + shift;
+        if (rule->week == 5 ? first < -28 || first + 6 > -1 :
+                first < 1 || first + 6 > 28) {
+            return 0;
+        }
+        p = buf + apr_snprintf(buf, len,
+                "RRULE:FREQ=YEARLY;BYMONTH=%d;BYDAY=%s;BYMONTHDAY=",
+                rule->month, days[((rule->day + shift) % 7 + 7) % 7]);
+        for (i = 0; i < 7; i++) {
+            p += apr_snprintf(p, len - (p - buf), i ? ",%d" : "%d",
+                    first + i);
+        }
+        return 1;
+    }
+    }
+}
+
+/* add an observance recurring yearly by the rule, starting with the first
+ * change it makes at or after the given UTC time.
+ */
+static void tz_rule_observance(icalcomponent *vtz, const char **names,
+        const ical_zoneinfo_rule *rule, const char *recur, apr_int64_t after,
+        int from, int to, int daylight)
+{
+    struct icaltimetype tt = icaltime_null_time();
+    icalproperty *prop;
+    apr_int64_t year, utc;
+
+    tz_fields(&tt, after);
+    for (year = tt.year - 1;; year++) {
+        utc = ical_zoneinfo_day(rule, year) * 86400 + rule->time - from;
+        if (utc >= after) {
+            break;
+        }
+    }
+
+    prop = icalproperty_new_from_string(recur);
+    if (prop) {
+        icalcomponent_add_property(
+                tz_observance(vtz, names, utc, from, to, daylight), prop);
+    }
+}
+
+/* a timezone component with one observance for each change in the span */
+static icalcomponent *tz_vtimezone_build(icaltimezone *zone,
+        const ical_tz_table *table, apr_int64_t start, apr_int64_t end)
+{
+    icalcomponent *vtz = icalcomponent_new(ICAL_VTIMEZONE_COMPONENT);
+    const char *location = icaltimezone_get_location(zone);
+    const char *tznames = icaltimezone_get_tznames(zone);
+    const char *names[2] = { NULL, NULL };
+    const ical_zoneinfo *zi;
+    char standard[64], on[128], off[128];
+    int offset = table->offset, daylight = table->daylight;
+    int i;
+
+    /* builtin names are the standard and daylight names split by a slash */
+    if (tznames) {
+        const char *slash = strchr(tznames, '/');
+
+        if (slash && slash - tznames < (apr_ssize_t) sizeof(standard)) {
+            apr_cpystrn(standard, tznames, slash - tznames + 1);
+            names[0] = standard;
+            names[1] = slash + 1;
+        }
+        else {
+            names[0] = names[1] = tznames;
+        }
+    }
+
+    icalcomponent_add_property(vtz,
+            icalproperty_new_tzid(icaltimezone_get_tzid(zone)));
+    if (location) {
+        icalproperty *prop = icalproperty_new_x(location);
+
+        icalproperty_set_x_name(prop, "X-LIC-LOCATION");
+        icalcomponent_add_property(vtz, prop);
+    }
+
+    /* the offset in effect at the start of the span */
+    for (i = 0; i < table->count && table->changes[i].utc <= start; i++) {
+        offset = table->changes[i].offset;
+        daylight = table->changes[i].daylight;
+    }
+    tz_utc_offset(table, start, &offset, &daylight);
+    tz_observance(vtz, names, start, offset, offset, daylight);
+
+    /* followed by each change within the span */
+    for (; i < table->count && table->changes[i].utc < end; i++) {
+        tz_observance(vtz, names, table->changes[i].utc, offset,
+                table->changes[i].offset, table->changes[i].daylight);
+        offset = table->changes[i].offset;
+    }
+
+    /* past the end of the table, the rule in the footer of the TZif file
+     * recurs for ever. A rule that keeps to standard time needs nothing
+     * more, and one that cannot be given as an RRULE ends with the table.
+     */
+    if (end > table->end && (zi = tz_table_rule(table)) && zi->posix.rules
+            && tz_rule_recur(&zi->posix.start, on, sizeof(on))
+            && tz_rule_recur(&zi->posix.end, off, sizeof(off))) {
+        apr_int64_t after = start > table->end ? start : table->end;
+
+        tz_rule_observance(vtz, names, &zi->posix.start, on, after,
+                zi->posix.std, zi->posix.dst, 1);
+        tz_rule_observance(vtz, names, &zi->posix.end, off, after,
+                zi->posix.dst, zi->posix.std, 0);
+    }
+
+    return vtz;
+}
+
+icalcomponent *ical_tz_vtimezone(icaltimezone *zone, int first, int last)
+{
+    const ical_tz_table *table;
+    struct icaltimetype edge = icaltime_null_time();
+    ical_tz_span span;
+    icalcomponent *vtz;
+    apr_int64_t start, end;
+
+    memset(&span, 0, sizeof(span));
+    span.zone = zone;
+    span.first = first;
+    span.last = last;
+
+    edge.month = edge.day = 1;
+    edge.year = first;
+    start = tz_seconds(&edge);
+    edge.year = last + 1;
+    end = last < first ? APR_INT64_MAX : tz_seconds(&edge);
+
+    /* spans the table does not cover get every observance from libical,
+     * unless the rule of the TZif file the table was read from covers
+     * them.
+     */
+    table = tz_table(zone);
+    if (!table || start < table->start
+            || (end > table->end && !tz_table_rule(table))) {
+        return icalcomponent_new_clone(icaltimezone_get_component(zone));
+    }
+
+#if APR_HAS_THREADS
+    apr_thread_rwlock_rdlock(tz_cache->lock);
+#endif
+    vtz = apr_hash_get(tz_cache->vtimezones, &span, sizeof(span));
+    if (vtz) {
+        vtz = icalcomponent_new_clone(vtz);
+    }
+#if APR_HAS_THREADS
+    apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    if (!vtz) {
+
+#if APR_HAS_THREADS
+        apr_thread_rwlock_wrlock(tz_cache->lock);
+#endif
+        vtz = apr_hash_get(tz_cache->vtimezones, &span, sizeof(span));
+        if (vtz) {
+            vtz = icalcomponent_new_clone(vtz);
+        }
+        else {
+            vtz = tz_vtimezone_build(zone, table, start, end);
+            if (apr_hash_count(tz_cache->vtimezones) < ICAL_TZ_CACHE_MAX) {
+                apr_hash_set(tz_cache->vtimezones,
+                        apr_pmemdup(tz_cache->pool, &span, sizeof(span)),
+                        sizeof(span), vtz);
+                apr_pool_cleanup_register(tz_cache->pool, vtz,
+                        tz_vtimezone_cleanup, apr_pool_cleanup_null);
+                vtz = icalcomponent_new_clone(vtz);
+            }
+        }
+#if APR_HAS_THREADS
+        apr_thread_rwlock_unlock(tz_cache->lock);
+#endif
+
+    }
+
+    return vtz;
+}
+
+void ical_tz_zoneinfo(const char *dir)
+{
+    if (tz_cache && !tz_cache->frozen) {
+        tz_cache->zoneinfo = dir ? apr_pstrdup(tz_cache->pool, dir) : NULL;
+    }
+}
+
+void ical_tz_build(void)
+{
+    apr_hash_index_t *hi;
+
+    if (!tz_cache || tz_cache->frozen) {
+        return;
+    }
+
+    for (hi = apr_hash_first(NULL, tz_cache->fixed.tables); hi;
+            hi = apr_hash_next(hi)) {
+        const void *key;
+        void *val;
+
+        apr_hash_this(hi, &key, NULL, &val);
+        if (val == ical_tz_unbuilt) {
+            icaltimezone *zone = *(icaltimezone * const *) key;
+
+            icaltimezone_get_component(zone);
+            apr_hash_set(tz_cache->fixed.tables, key, sizeof(zone),
+                    tz_table_build(zone));
+        }
+    }
+}
+
+void ical_tz_freeze(void)
+{
+    if (!tz_cache || tz_cache->frozen) {
+        return;
+    }
+
+    /* build every table still outstanding, so that the frozen maps are
+     * complete and need never be changed.
+     */
+    ical_tz_build();
+
+    tz_cache->frozen = 1;
+}
+
+struct icaltimetype ical_tz_convert(struct icaltimetype tt,
+        icaltimezone *zone)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    const ical_tz_table *from = NULL, *to = NULL;
+    struct icaltimetype ret = tt;
+    apr_int64_t secs;
+    int offset;
+
+    /* dates and floating times are not adjusted */
+    if (tt.is_date || !tt.zone || !zone || tt.zone == zone || tt.month < 1
+            || tt.month > 12) {
+        return icaltime_convert_to_zone(tt, zone);
+    }
+
+    /* UTC needs no table */
+    if (tt.zone != utc) {
+        from = tz_table(tt.zone);
+    }
+    if (zone != utc) {
+        to = tz_table(zone);
+    }
+
+    /* to UTC by the table of the zone converted from, or else by libical
+     * where the zone converted to has a table of its own.
+     */
+    secs = tz_seconds(&tt);
+    if (from && tz_local_offset(from, secs, &offset)) {
+        secs -= offset;
+    }
+    else if (tt.zone != utc) {
+        if (!to) {
+            return icaltime_convert_to_zone(tt, zone);
+        }
+        ret = icaltime_convert_to_zone(tt, utc);
+        secs = tz_seconds(&ret);
+    }
+
+    /* then from UTC by the table of the zone converted to, or else by
+     * libical, so that each table is used wherever it covers the time.
+     */
+    offset = 0;
+    if (to && !tz_utc_offset(to, secs, &offset, NULL)) {
+        to = NULL;
+    }
+    tz_fields(&ret, secs + offset);
+    ret.zone = zone;
+    if (!to && zone != utc) {
+        ret.zone = utc;
+        return icaltime_convert_to_zone(ret, zone);
+    }
+
+    return ret;
+}
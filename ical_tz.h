@@ -0,0 +1,151 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_tz.h: Timezone lookups and conversions
+ *
+ * Looking up a builtin timezone by TZID or location searches the whole of
+ * the libical builtin table. The result of each lookup, including a
+ * failed lookup, is remembered for the life of the process, so that each
+ * distinct TZID is only searched for once.
+ *
+ * Once the threads that share the cache are about to start, the cache is
+ * frozen. Everything remembered until then is never changed again and is
+ * read without locks, only timezones first found afterwards are looked up
+ * and remembered under a lock. Names not found afterwards are remembered
+ * apart from those found, up to a limit, so that repeated unknown names
+ * are answered under the read lock.
+ *
+ * Each builtin timezone found has a table of the changes in its offset
+ * from UTC over a range of years, built when first needed, so that times
+ * can be converted between builtin timezones with a binary search. The
+ * table is read from libical, or from the system zoneinfo if asked, in
+ * which case it covers every change in the TZif file, and the rule in the
+ * footer of the file answers for times past its end. The same tables give
+ * the timezone components sent with a converted calendar, cut down to the
+ * years the calendar needs.
+ */
+
+#ifndef ICAL_TZ_H
+#define ICAL_TZ_H
+
+#include "apr_pools.h"
+
+#include <libical/ical.h>
+
+/* most distinct names remembered, so that unknown names cannot grow the
+ * cache without limit.
+ */
+#define ICAL_TZ_CACHE_MAX 4096
+
+/* most names not found remembered once the cache is frozen, before they
+ * are forgotten and remembered afresh.
+ */
+#define ICAL_TZ_MISSES_MAX 1024
+
+/* years covered by each table of changes, before and after this year.
+ * Tables read from the system zoneinfo cover every year before.
+ */
+#define ICAL_TZ_YEARS_BEFORE 10
+#define ICAL_TZ_YEARS_AFTER 20
+
+/* interval in seconds at which offsets are sampled to find the changes */
+#define ICAL_TZ_SAMPLE (6 * 3600)
+
+/**
+ * Create the cache of timezone lookups, which lives as long as the pool.
+ * Must be called before any threads are started. Lookups made before the
+ * cache is created are not remembered.
+ */
+apr_status_t ical_tz_init(apr_pool_t *pool);
+
+/**
+ * Find the builtin timezone with the given TZID, or failing that with the
+ * given location. Returns NULL if neither is found.
+ */
+icaltimezone *ical_tz_find(const char *tzid);
+
+/**
+ * Find the builtin timezone with the given location, such as
+ * Europe/London. Returns NULL if not found.
+ */
+icaltimezone *ical_tz_location(const char *location);
+
+/**
+ * Load the builtin timezone with the given location from libical, and
+ * build its table of changes, now rather than when first used. Returns
+ * NULL if not found. Must be called before any threads are started.
+ */
+icaltimezone *ical_tz_preload(const char *location);
+
+/**
+ * Load every builtin timezone from libical, returning the number loaded.
+ * Their names are remembered, and their tables of changes are built by
+ * ical_tz_build() or ical_tz_freeze(). Each table sampled from libical
+ * takes tens of thousands of lookups, so building every table is slow,
+ * of the order of seconds, unless read from the system zoneinfo. Must be
+ * called before any threads are started.
+ */
+int ical_tz_preload_all(void);
+
+/**
+ * Return a new timezone component for the builtin timezone, with only the
+ * observances needed to cover the years first to last inclusive, or from
+ * first on without end where last is before first. Tables read from the
+ * system zoneinfo end with observances recurring by the rule in the
+ * footer of the TZif file. Where the table of changes does not cover the
+ * years, the full component from libical is returned instead. Components
+ * are remembered by span, the caller owns the copy returned.
+ */
+icalcomponent *ical_tz_vtimezone(icaltimezone *zone, int first, int last);
+
+/**
+ * Read the offsets of builtin timezones from the TZif file of the same
+ * location beneath the given directory, such as /usr/share/zoneinfo,
+ * rather than from libical, falling back to libical where the file is
+ * missing or not understood. NULL reads from libical. Applies to tables
+ * built from now on. Must be called before any threads are started.
+ */
+void ical_tz_zoneinfo(const char *dir);
+
+/**
+ * Build the table of changes of every timezone found so far that is not
+ * yet built, so that processes forked afterwards share the tables rather
+ * than each building their own. Must be called before any threads are
+ * started.
+ */
+void ical_tz_build(void);
+
+/**
+ * Build the table of changes of every timezone found so far, and read
+ * them, and the lookups remembered so far, without locks from now on.
+ * Must be called before any threads are started.
+ */
+void ical_tz_freeze(void);
+
+/**
+ * Convert the time to the given timezone, exactly as
+ * icaltime_convert_to_zone() does. Where both timezones are builtin or UTC,
+ * and the time is covered by their tables and not skipped or repeated by
+ * a change, libical is not consulted. Otherwise libical converts to or
+ * from UTC only for the side not covered, so that tables read from the
+ * system zoneinfo are always followed. Those tables give times skipped or
+ * repeated the offset before the change, as RFC 5545 does.
+ */
+struct icaltimetype ical_tz_convert(struct icaltimetype tt,
+        icaltimezone *zone);
+
+#endif /* ICAL_TZ_H */
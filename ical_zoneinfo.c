@@ -0,0 +1,467 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_zoneinfo.c: Timezone offsets from the system zoneinfo database
+ */
+
+#include "apr_file_io.h"
+#include "apr_mmap.h"
+#include "apr_lib.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+
+#include "config.h"
+
+#include <string.h>
+
+#include "ical_zoneinfo.h"
+
+/* size of the header before the data of each version in a TZif file */
+#define TZIF_HEADER_SIZE 44
+
+/* size of each local time type in a TZif file */
+#define TZIF_TYPE_SIZE 6
+
+typedef struct tzif_header {
+    int version; /* version of the file */
+    apr_uint32_t isutcnt; /* number of UT/local indicators */
+    apr_uint32_t isstdcnt; /* number of standard/wall indicators */
+    apr_uint32_t leapcnt; /* number of leap second records */
+    apr_uint32_t timecnt; /* number of transition times */
+    apr_uint32_t typecnt; /* number of local time types */
+    apr_uint32_t charcnt; /* size of the designations */
+} tzif_header;
+
+static apr_uint32_t tzif_uint32(const unsigned char *p)
+{
+    return ((apr_uint32_t) p[0] << 24) | ((apr_uint32_t) p[1] << 16)
+            | ((apr_uint32_t) p[2] << 8) | p[3];
+}
+
+static apr_int64_t tzif_int64(const unsigned char *p)
+{
+    return (apr_int64_t) (((apr_uint64_t) tzif_uint32(p) << 32)
+            | tzif_uint32(p + 4));
+}
+
+static int tzif_header_read(const unsigned char *p, apr_size_t len,
+        tzif_header *h)
+{
+    if (len < TZIF_HEADER_SIZE || memcmp(p, "TZif", 4)) {
+        return 0;
+    }
+
+    h->version = p[4] ? p[4] - '0' : 1;
+    h->isutcnt = tzif_uint32(p + 20);
+    h->isstdcnt = tzif_uint32(p + 24);
+    h->leapcnt = tzif_uint32(p + 28);
+    h->timecnt = tzif_uint32(p + 32);
+    h->typecnt = tzif_uint32(p + 36);
+    h->charcnt = tzif_uint32(p + 40);
+
+    return 1;
+}
+
+/* size of the header and the data that follows, with times of timesize */
+static apr_uint64_t tzif_size(const tzif_header *h, int timesize)
+{
+    return TZIF_HEADER_SIZE + (apr_uint64_t) h->timecnt * (timesize + 1)
+            + (apr_uint64_t) h->typecnt * TZIF_TYPE_SIZE + h->charcnt
+            + (apr_uint64_t) h->leapcnt * (timesize + 4) + h->isstdcnt
+            + h->isutcnt;
+}
+
+static int tzif_leap(apr_int64_t year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static int tzif_month_days(apr_int64_t year, int month)
+{
+    static const int days[] = { 31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30,
+            31 };
+
+    return days[month - 1] + (month == 2 && tzif_leap(year));
+}
+
+/* days since the epoch of the given date */
+static apr_int64_t tzif_days(apr_int64_t year, int month, int day)
+{
+    apr_int64_t y = year - (month <= 2);
+    apr_int64_t era = (y >= 0 ? y : y - 399) / 400;
+    apr_int64_t yoe = y - era * 400;
+    apr_int64_t doy = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day
+            - 1;
+
+    return era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+}
+
+/* year of the given time in seconds since the epoch */
+static apr_int64_t tzif_year(apr_int64_t secs)
+{
+    apr_int64_t z = (secs >= 0 ? secs : secs - 86399) / 86400 + 719468;
+    apr_int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+    apr_int64_t doe = z - era * 146097;
+    apr_int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    apr_int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+
+    return yoe + era * 400 + (doy >= 306);
+}
+
+/* a name of at least three letters, or any name quoted in angle brackets */
+static const char *posix_name(const char *p)
+{
+    const char *start = p;
+
+    if (*p == '<') {
+        p = strchr(p, '>');
+        return p ? p + 1 : NULL;
+    }
+
+    while (apr_isalpha(*p)) {
+        p++;
+    }
+
+    return p - start >= 3 ? p : NULL;
+}
+
+static const char *posix_number(const char *p, int *n)
+{
+    if (!apr_isdigit(*p)) {
+        return NULL;
+    }
+
+    *n = 0;
+    while (apr_isdigit(*p)) {
+        if (*n > 9999) {
+            return NULL;
+        }
+        *n = *n * 10 + (*p++ - '0');
+    }
+
+    return p;
+}
+
+/* [+-]hh[:mm[:ss]] in seconds */
+static const char *posix_time(const char *p, apr_int64_t *secs)
+{
+    int sign = 1, h, m = 0, s = 0;
+
+    if (*p == '+' || *p == '-') {
+        sign = (*p++ == '-') ? -1 : 1;
+    }
+
+    if (!(p = posix_number(p, &h))) {
+        return NULL;
+    }
+    if (*p == ':') {
+        if (!(p = posix_number(p + 1, &m))) {
+            return NULL;
+        }
+        if (*p == ':' && !(p = posix_number(p + 1, &s))) {
+            return NULL;
+        }
+    }
+
+    *secs = sign * ((apr_int64_t) h * 3600 + m * 60 + s);
+
+    return p;
+}
+
+static const char *posix_rule(const char *p, ical_zoneinfo_rule *rule)
+{
+    if (*p == 'M') {
+        rule->kind = 'M';
+        if (!(p = posix_number(p + 1, &rule->month)) || *p != '.'
+                || !(p = posix_number(p + 1, &rule->week)) || *p != '.'
+                || !(p = posix_number(p + 1, &rule->day))
+                || rule->month < 1 || rule->month > 12 || rule->week < 1
+                || rule->week > 5 || rule->day > 6) {
+            return NULL;
+        }
+    }
+    else if (*p == 'J') {
+        rule->kind = 'J';
+        if (!(p = posix_number(p + 1, &rule->day)) || rule->day < 1
+                || rule->day > 365) {
+            return NULL;
+        }
+    }
+    else {
+        rule->kind = 'D';
+        if (!(p = posix_number(p, &rule->day)) || rule->day > 365) {
+            return NULL;
+        }
+    }
+
+    /* changes are at two in the morning unless given */
+    rule->time = 7200;
+    if (*p == '/') {
+        p = posix_time(p + 1, &rule->time);
+    }
+
+    return p;
+}
+
+/* parse a POSIX TZ string such as CET-1CEST,M3.5.0,M10.5.0/3 */
+static int posix_parse(const char *p, ical_zoneinfo_posix *tz)
+{
+    apr_int64_t secs;
+
+    memset(tz, 0, sizeof(ical_zoneinfo_posix));
+
+    if (!(p = posix_name(p)) || !(p = posix_time(p, &secs))) {
+        return 0;
+    }
+
+    /* offsets are given west of UTC */
+    tz->std = tz->dst = (int) -secs;
+    if (!*p) {
+        return 1;
+    }
+
+    if (!(p = posix_name(p))) {
+        return 0;
+    }
+    tz->dst = tz->std + 3600;
+    if (*p && *p != ',') {
+        if (!(p = posix_time(p, &secs))) {
+            return 0;
+        }
+        tz->dst = (int) -secs;
+    }
+
+    /* daylight saving time with the default rules is not understood */
+    if (*p != ',' || !(p = posix_rule(p + 1, &tz->start)) || *p != ','
+            || !(p = posix_rule(p + 1, &tz->end)) || *p) {
+        return 0;
+    }
+    tz->rules = 1;
+
+    return 1;
+}
+
+apr_int64_t ical_zoneinfo_day(const ical_zoneinfo_rule *rule,
+        apr_int64_t year)
+{
+    switch (rule->kind) {
+    case 'J': {
+        return tzif_days(year, 1, 1) + rule->day - 1
+                + (tzif_leap(year) && rule->day >= 60);
+    }
+    case 'D': {
+        return tzif_days(year, 1, 1) + rule->day;
+    }
+    default: {
+        apr_int64_t first = tzif_days(year, rule->month, 1);
+        int mdays = tzif_month_days(year, rule->month);
+        int wday = (int) (((first + 4) % 7 + 7) % 7);
+        int day = (rule->day - wday + 7) % 7 + 7 * (rule->week - 1);
+
+        /* the fifth week is the last */
+        while (day >= mdays) {
+            day -= 7;
+        }
+
+        return first + day;
+    }
+    }
+}
+
+int ical_zoneinfo_year(const ical_zoneinfo *zi, apr_int64_t year,
+        ical_zoneinfo_change *changes)
+{
+    const ical_zoneinfo_posix *tz = &zi->posix;
+    ical_zoneinfo_change on, off;
+
+    if (!zi->footer || !tz->rules) {
+        return 0;
+    }
+
+    on.utc = ical_zoneinfo_day(&tz->start, year) * 86400 + tz->start.time
+            - tz->std;
+    on.offset = tz->dst;
+    on.daylight = 1;
+    off.utc = ical_zoneinfo_day(&tz->end, year) * 86400 + tz->end.time
+            - tz->dst;
+    off.offset = tz->std;
+    off.daylight = 0;
+
+    /* southern timezones leave daylight saving time first */
+    changes[0] = on.utc < off.utc ? on : off;
+    changes[1] = on.utc < off.utc ? off : on;
+
+    return 2;
+}
+
+/* apply a change at the given time, changes must be applied in order */
+static void tzif_change(ical_zoneinfo *zi, apr_int64_t start,
+        apr_int64_t end, apr_int64_t utc, int offset, int daylight)
+{
+    if (utc <= start) {
+        zi->offset = offset;
+        zi->daylight = daylight;
+    }
+    else if (utc < end) {
+        int current = zi->changes->nelts ?
+                APR_ARRAY_IDX(zi->changes, zi->changes->nelts - 1,
+                        ical_zoneinfo_change).offset : zi->offset;
+
+        if (offset != current) {
+            ical_zoneinfo_change *change = apr_array_push(zi->changes);
+
+            change->utc = utc;
+            change->offset = offset;
+            change->daylight = daylight;
+        }
+    }
+}
+
+static apr_status_t tzif_parse(apr_pool_t *pool, const unsigned char *data,
+        apr_size_t len, apr_int64_t start, apr_int64_t end,
+        ical_zoneinfo *zi)
+{
+    const unsigned char *times, *indexes, *types;
+    apr_uint64_t size;
+    apr_int64_t last = start;
+    tzif_header h;
+    char footer[256];
+    apr_uint32_t i;
+    int timesize = 4;
+
+    footer[0] = 0;
+    memset(zi, 0, sizeof(ical_zoneinfo));
+
+    if (!tzif_header_read(data, len, &h)) {
+        return APR_ENOTIMPL;
+    }
+
+    /* version 2 onwards repeat the data with 64 bit times, and a footer */
+    if (h.version >= 2) {
+        size = tzif_size(&h, 4);
+        if (size > len || !tzif_header_read(data + size, len - size, &h)) {
+            return APR_ENOTIMPL;
+        }
+        data += size;
+        len -= size;
+        timesize = 8;
+    }
+
+    /* times counting leap seconds are not understood */
+    size = tzif_size(&h, timesize);
+    if (size > len || !h.typecnt || h.leapcnt) {
+        return APR_ENOTIMPL;
+    }
+
+    times = data + TZIF_HEADER_SIZE;
+    indexes = times + (apr_size_t) h.timecnt * timesize;
+    types = indexes + h.timecnt;
+
+    if (timesize == 8 && size < len && data[size] == '\n') {
+        const unsigned char *nl = memchr(data + size + 1, '\n',
+                len - size - 1);
+
+        if (nl && nl - (data + size + 1) < (apr_ssize_t) sizeof(footer)) {
+            memcpy(footer, data + size + 1, nl - (data + size + 1));
+            footer[nl - (data + size + 1)] = 0;
+        }
+    }
+
+    /* times before the first transition are of the first type */
+    zi->changes = apr_array_make(pool, 64, sizeof(ical_zoneinfo_change));
+    zi->offset = (apr_int32_t) tzif_uint32(types);
+    zi->daylight = types[4];
+
+    for (i = 0; i < h.timecnt; i++) {
+        apr_int64_t utc = timesize == 8 ? tzif_int64(times + i * 8) :
+                (apr_int32_t) tzif_uint32(times + i * 4);
+        const unsigned char *type = types + indexes[i] * TZIF_TYPE_SIZE;
+
+        if (indexes[i] >= h.typecnt || (i && utc <= last)) {
+            return APR_ENOTIMPL;
+        }
+
+        tzif_change(zi, start, end, utc, (apr_int32_t) tzif_uint32(type),
+                type[4]);
+        last = utc;
+    }
+
+    /* times after the last transition follow the rules in the footer */
+    zi->footer = footer[0] && posix_parse(footer, &zi->posix);
+    zi->until = h.timecnt ? last : APR_INT64_MIN;
+    if (zi->footer) {
+        apr_int64_t year, from = h.timecnt && last > start ? last : start;
+
+        for (year = tzif_year(from) - 1; year <= tzif_year(end); year++) {
+            ical_zoneinfo_change found[2];
+            int j, n = ical_zoneinfo_year(zi, year, found);
+
+            for (j = 0; j < n; j++) {
+                if (!h.timecnt || found[j].utc > last) {
+                    tzif_change(zi, start, end, found[j].utc,
+                            found[j].offset, found[j].daylight);
+                }
+            }
+        }
+    }
+
+    return APR_SUCCESS;
+}
+
+apr_status_t ical_zoneinfo_read(apr_pool_t *pool, const char *dir,
+        const char *location, apr_int64_t start, apr_int64_t end,
+        ical_zoneinfo *zi)
+{
+    apr_pool_t *ptemp;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_status_t rv;
+
+    /* locations stay beneath the directory */
+    if (!location || !location[0] || location[0] == '/'
+            || strstr(location, "..")) {
+        return APR_EINVAL;
+    }
+
+    rv = apr_pool_create(&ptemp, pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
+
+    rv = apr_file_open(&file, apr_pstrcat(ptemp, dir, "/", location, NULL),
+            APR_FOPEN_READ | APR_FOPEN_BINARY, APR_FPROT_OS_DEFAULT, ptemp);
+    if (rv == APR_SUCCESS) {
+        rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+        if (rv == APR_SUCCESS && finfo.size < TZIF_HEADER_SIZE) {
+            rv = APR_ENOTIMPL;
+        }
+        if (rv == APR_SUCCESS) {
+            rv = apr_mmap_create(&mm, file, 0, (apr_size_t) finfo.size,
+                    APR_MMAP_READ, ptemp);
+        }
+        apr_file_close(file);
+    }
+
+    if (rv == APR_SUCCESS) {
+        rv = tzif_parse(pool, mm->mm, mm->size, start, end, zi);
+    }
+
+    apr_pool_destroy(ptemp);
+
+    return rv;
+}
@@ -0,0 +1,95 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * ical_zoneinfo.h: Timezone offsets from the system zoneinfo database
+ *
+ * The TZif file of a location, as described in RFC 8536, is mapped read
+ * only from beneath a directory such as /usr/share/zoneinfo, so that the
+ * file is shared by all processes through the page cache. The changes in
+ * offset from UTC over a span of time are read from the transitions in
+ * the file, followed by the POSIX TZ rule in the footer of the file for
+ * times past the last transition. The rule itself is kept, so that times
+ * past the span can still be answered for.
+ */
+
+#ifndef ICAL_ZONEINFO_H
+#define ICAL_ZONEINFO_H
+
+#include "apr_pools.h"
+#include "apr_tables.h"
+
+/* usual location of the system zoneinfo database */
+#define ICAL_ZONEINFO_DIR "/usr/share/zoneinfo"
+
+typedef struct ical_zoneinfo_change {
+    apr_int64_t utc; /* time of the change in seconds since the epoch */
+    int offset; /* offset from UTC from the change onwards */
+    int daylight; /* daylight saving time from the change onwards */
+} ical_zoneinfo_change;
+
+typedef struct ical_zoneinfo_rule {
+    char kind; /* 'J' day of the year ignoring leap days, 'D' day of the
+                * year from zero, or 'M' weekday of a week of a month */
+    int month; /* month, from one */
+    int week; /* week of the month from one, five being the last */
+    int day; /* day of the year, or day of the week from Sunday as zero */
+    apr_int64_t time; /* seconds after local midnight of the change */
+} ical_zoneinfo_rule;
+
+typedef struct ical_zoneinfo_posix {
+    int std; /* offset from UTC of standard time */
+    int dst; /* offset from UTC of daylight saving time */
+    int rules; /* daylight saving time is observed */
+    ical_zoneinfo_rule start; /* change to daylight saving time */
+    ical_zoneinfo_rule end; /* change back to standard time */
+} ical_zoneinfo_posix;
+
+typedef struct ical_zoneinfo {
+    int offset; /* offset from UTC at the start of the span */
+    int daylight; /* daylight saving time at the start of the span */
+    apr_array_header_t *changes; /* changes in offset within the span */
+    int footer; /* the POSIX TZ rule in the footer was understood */
+    apr_int64_t until; /* last transition, after which the rule applies */
+    ical_zoneinfo_posix posix; /* the POSIX TZ rule in the footer */
+} ical_zoneinfo;
+
+/**
+ * Read the changes in offset from UTC of the given location, such as
+ * Europe/London, after start and before end, from the TZif file of the
+ * location beneath the directory. Returns APR_ENOTIMPL if the file
+ * cannot be understood, such as a file that counts leap seconds.
+ */
+apr_status_t ical_zoneinfo_read(apr_pool_t *pool, const char *dir,
+        const char *location, apr_int64_t start, apr_int64_t end,
+        ical_zoneinfo *zi);
+
+/**
+ * Return the day of the rule in the given year, in days since the epoch.
+ */
+apr_int64_t ical_zoneinfo_day(const ical_zoneinfo_rule *rule,
+        apr_int64_t year);
+
+/**
+ * Fill in the changes in offset from UTC made by the POSIX TZ rule in the
+ * footer during the given year, in time order, returning the number of
+ * changes. None are made where the rule keeps to standard time, or where
+ * the footer was not understood.
+ */
+int ical_zoneinfo_year(const ical_zoneinfo *zi, apr_int64_t year,
+        ical_zoneinfo_change *changes);
+
+#endif /* ICAL_ZONEINFO_H */
@@ -0,0 +1,1040 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * icalbench.c: Benchmarks of the mod_ical conversions
+ *
+ * icalbench [-n count] [-j threads] [-z zone] [-Z dir] benchmark [file ...]
+ *
+ * Each benchmark times a path through the conversions against the way
+ * the same work was done before, and prints the time taken by each.
+ */
+
+#include "apr.h"
+#include "apr_buckets.h"
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_getopt.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_thread_proc.h"
+#include "apr_time.h"
+
+#include "config.h"
+
+#include <libical/ical.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ical_conv.h"
+#include "ical_recur.h"
+#include "ical_tz.h"
+#include "ical_zoneinfo.h"
+
+/* number of distinct values each pass works through */
+#define BENCH_VALUES 1024
+
+/* number of times memory use is reported during a soak */
+#define BENCH_SOAK_REPORTS 10
+
+typedef struct bench_ctx {
+    apr_pool_t *pool;
+    apr_file_t *out;
+    apr_file_t *err;
+    const char * const *files; /* files named after the benchmark */
+    int nfiles;
+    int count; /* passes to make */
+    int threads; /* most threads to run at once */
+    apr_array_header_t *zones; /* timezones to convert to */
+} bench_ctx;
+
+typedef struct bench_def {
+    const char *name;
+    int (*run)(bench_ctx *ctx);
+} bench_def;
+
+/* results are added here, so that the work cannot be optimised away */
+static volatile apr_size_t bench_sink;
+
+static const apr_getopt_option_t cmdline_opts[] =
+{
+    { "count", 'n', 1, "  -n, --count num\tPasses to make over the values of each benchmark. Defaults to 1000" },
+    { "threads", 'j', 1, "  -j, --threads num\tMost threads to run at once. Defaults to 4" },
+    { "timezone", 'z', 1, "  -z, --timezone zone\tTimezone to convert to, can be specified more than once. Defaults to America/New_York, Europe/London, Asia/Kolkata, Australia/Sydney and UTC" },
+    { "zoneinfo", 'Z', 1, "  -Z, --zoneinfo dir\tRead timezone offsets from the TZif files beneath the given directory, such as " ICAL_ZONEINFO_DIR },
+    { "help", 'h', 0, "  -h, --help\t\tDisplay this help message" },
+    { NULL, 0, 0, NULL }
+};
+
+static int help(apr_file_t *out, const char *name, const char *msg, int code)
+{
+    const apr_getopt_option_t *opts = cmdline_opts;
+
+    apr_file_printf(out,
+            "%s\n"
+            "\n"
+            "NAME\n"
+            "  %s - Benchmark the mod_ical conversions.\n"
+            "\n"
+            "SYNOPSIS\n"
+            "  %s [-n count] [-j threads] [-z zone] [-Z dir] benchmark\n"
+            "      [file ...]\n"
+            "\n"
+            "DESCRIPTION\n"
+            "  Each benchmark times a path through the conversions against\n"
+            "  the way the same work was done before, and prints the time\n"
+            "  taken by each. The benchmarks are:\n"
+            "\n"
+            "  format\tDates and date-times written with fixed width digits,\n"
+            "\t\tagainst apr_snprintf() and apr_psprintf().\n"
+            "\n"
+            "  escape\tThe text of each file escaped as a jCal string, with\n"
+            "\t\tclean runs found a word at a time, against a byte at a\n"
+            "\t\ttime.\n"
+            "\n"
+            "  convert\tThe date-times of each calendar, and the occurrences\n"
+            "\t\tof its rules, converted to each timezone through the\n"
+            "\t\ttables of offset changes, against libical.\n"
+            "\n"
+            "  threads\tThe conversions of convert run on one thread, then\n"
+            "\t\ttwo, four and so on up to the most threads, each\n"
+            "\t\tthread making every pass.\n"
+            "\n"
+            "  soak\t\tCount requests, each converting a calendar to the\n"
+            "\t\tnext timezone in turn exactly as mod_ical would, with\n"
+            "\t\tthe resident memory reported as they go.\n"
+            "\n"
+            "OPTIONS\n", msg ? msg : "", name, name);
+
+    while (opts->name) {
+        apr_file_printf(out, "%s\n\n", opts->description);
+        opts++;
+    }
+
+    return code;
+}
+
+static apr_time_t bench_report(bench_ctx *ctx, const char *name,
+        apr_uint64_t ops, apr_uint64_t bytes, apr_time_t start)
+{
+    apr_time_t took = apr_time_now() - start;
+
+    apr_file_printf(ctx->out,
+            "%-32s %12" APR_UINT64_T_FMT " ops %10.3f s %10.1f ns/op",
+            name, ops, (double) took / APR_USEC_PER_SEC,
+            ops ? (double) took * 1000 / ops : 0.0);
+    if (bytes && took) {
+        apr_file_printf(ctx->out, " %10.1f MB/s",
+                (double) bytes / took);
+    }
+    apr_file_printf(ctx->out, "\n");
+
+    return took;
+}
+
+static apr_status_t bench_read(bench_ctx *ctx, const char *name,
+        char **buffer, apr_size_t *len)
+{
+    apr_file_t *in;
+    apr_finfo_t finfo;
+    apr_status_t status;
+
+    status = apr_file_open(&in, name, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, ctx->pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(ctx->err, "Could not open '%s': %pm\n", name,
+                &status);
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, in);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(ctx->err, "Could not stat '%s': %pm\n", name,
+                &status);
+        apr_file_close(in);
+        return status;
+    }
+
+    *len = (apr_size_t) finfo.size;
+    *buffer = apr_palloc(ctx->pool, *len + 1);
+    status = apr_file_read_full(in, *buffer, *len, len);
+    apr_file_close(in);
+    if (status != APR_SUCCESS && status != APR_EOF) {
+        apr_file_printf(ctx->err, "Could not read '%s': %pm\n", name,
+                &status);
+        return status;
+    }
+    (*buffer)[*len] = 0;
+
+    return APR_SUCCESS;
+}
+
+/*
+ * format: dates and date-times as written to xCal and jCal.
+ */
+
+static void bench_times(struct icaltimetype *times)
+{
+    icaltimezone *utc = icaltimezone_get_utc_timezone();
+    int i;
+
+    /* a third each of dates, UTC date-times and local date-times */
+    for (i = 0; i < BENCH_VALUES; i++) {
+        struct icaltimetype tt = icaltime_null_time();
+
+        tt.year = 1990 + i % 60;
+        tt.month = 1 + i % 12;
+        tt.day = 1 + i % 28;
+        if (i % 3) {
+            tt.hour = i % 24;
+            tt.minute = i * 7 % 60;
+            tt.second = i * 13 % 60;
+            tt.zone = (i % 3 == 1) ? utc : NULL;
+        }
+        else {
+            tt.is_date = 1;
+        }
+
+        times[i] = tt;
+    }
+}
+
+/* as the dates were written before, allocating each from the pool */
+static const char *bench_psprintf(apr_pool_t *pool, struct icaltimetype tt)
+{
+    if (tt.is_date) {
+        return apr_psprintf(pool, "%04d-%02d-%02d", tt.year, tt.month,
+                tt.day);
+    }
+
+    return apr_psprintf(pool, "%04d-%02d-%02dT%02d:%02d:%02d%s", tt.year,
+            tt.month, tt.day, tt.hour, tt.minute, tt.second,
+            icaltime_is_utc(tt) ? "Z" : "");
+}
+
+/* the same format, written to a buffer on the stack */
+static const char *bench_snprintf(char *buf, struct icaltimetype tt)
+{
+    if (tt.is_date) {
+        apr_snprintf(buf, ICAL_TIME_SIZE, "%04d-%02d-%02d", tt.year,
+                tt.month, tt.day);
+    }
+    else {
+        apr_snprintf(buf, ICAL_TIME_SIZE, "%04d-%02d-%02dT%02d:%02d:%02d%s",
+                tt.year, tt.month, tt.day, tt.hour, tt.minute, tt.second,
+                icaltime_is_utc(tt) ? "Z" : "");
+    }
+
+    return buf;
+}
+
+static int bench_format(bench_ctx *ctx)
+{
+    struct icaltimetype *times = apr_palloc(ctx->pool,
+            BENCH_VALUES * sizeof(struct icaltimetype));
+    apr_uint64_t ops = (apr_uint64_t) ctx->count * BENCH_VALUES;
+    char buf[ICAL_TIME_SIZE], check[ICAL_TIME_SIZE];
+    apr_pool_t *pool;
+    apr_time_t start;
+    int i, j;
+
+    bench_times(times);
+
+    /* all three must agree before they are compared */
+    for (i = 0; i < BENCH_VALUES; i++) {
+        if (strcmp(ical_format_time(buf, times[i]),
+                bench_snprintf(check, times[i]))) {
+            apr_file_printf(ctx->err, "Formats differ: '%s' and '%s'\n",
+                    buf, check);
+            return 1;
+        }
+    }
+
+    start = apr_time_now();
+    for (j = 0; j < ctx->count; j++) {
+        for (i = 0; i < BENCH_VALUES; i++) {
+            bench_sink += ical_format_time(buf, times[i])[ICAL_TIME_SIZE / 4];
+        }
+    }
+    bench_report(ctx, "format fixed width", ops, 0, start);
+
+    start = apr_time_now();
+    for (j = 0; j < ctx->count; j++) {
+        for (i = 0; i < BENCH_VALUES; i++) {
+            bench_sink += bench_snprintf(buf, times[i])[ICAL_TIME_SIZE / 4];
+        }
+    }
+    bench_report(ctx, "format apr_snprintf", ops, 0, start);
+
+    /* the pool is cleared after each pass, as a request pool would be */
+    apr_pool_create(&pool, ctx->pool);
+    start = apr_time_now();
+    for (j = 0; j < ctx->count; j++) {
+        for (i = 0; i < BENCH_VALUES; i++) {
+            bench_sink += bench_psprintf(pool, times[i])[ICAL_TIME_SIZE / 4];
+        }
+        apr_pool_clear(pool);
+    }
+    bench_report(ctx, "format apr_psprintf", ops, 0, start);
+    apr_pool_destroy(pool);
+
+    return 0;
+}
+
+/*
+ * escape: text escaped as a jCal string, such as a long DESCRIPTION.
+ */
+
+/* write the escape for a byte of a jCal string, returning its length */
+static apr_size_t bench_json_escape(char *buf, unsigned char c)
+{
+    static const char hex[] = "0123456789abcdef";
+
+    switch (c) {
+    case '\b':
+        memcpy(buf, "\\b", 2);
+        return 2;
+    case '\n':
+        memcpy(buf, "\\n", 2);
+        return 2;
+    case '\r':
+        memcpy(buf, "\\r", 2);
+        return 2;
+    case '\t':
+        memcpy(buf, "\\t", 2);
+        return 2;
+    case '\f':
+        memcpy(buf, "\\f", 2);
+        return 2;
+    case '"':
+    case '\\':
+    case '/':
+        buf[0] = '\\';
+        buf[1] = c;
+        return 2;
+    default:
+        memcpy(buf, "\\u00", 4);
+        buf[4] = hex[c >> 4];
+        buf[5] = hex[c & 0xf];
+        return 6;
+    }
+}
+
+/* clean runs found a word at a time, as jCal strings are written */
+static apr_size_t bench_json_words(char *buf, const char *str,
+        apr_size_t len)
+{
+    char *pos = buf;
+    apr_size_t i = 0;
+
+    while (1) {
+        apr_size_t span = ical_json_span(str + i, len - i);
+
+        memcpy(pos, str + i, span);
+        pos += span;
+        i += span;
+        if (i == len) {
+            break;
+        }
+        pos += bench_json_escape(pos, str[i++]);
+    }
+
+    return pos - buf;
+}
+
+/* each byte examined in turn, as jCal strings were written before */
+static apr_size_t bench_json_bytes(char *buf, const char *str,
+        apr_size_t len)
+{
+    char *pos = buf;
+    apr_size_t i, start = 0;
+
+    for (i = 0; i < len; i++) {
+        unsigned char c = str[i];
+
+        if (c < 0x20 || c == '"' || c == '\\' || c == '/') {
+            memcpy(pos, str + start, i - start);
+            pos += i - start;
+            pos += bench_json_escape(pos, c);
+            start = i + 1;
+        }
+    }
+    memcpy(pos, str + start, i - start);
+    pos += i - start;
+
+    return pos - buf;
+}
+
+static int bench_escape(bench_ctx *ctx)
+{
+    apr_uint64_t ops = (apr_uint64_t) ctx->count * ctx->nfiles;
+    apr_uint64_t bytes = 0;
+    char **texts, *buf, *check;
+    apr_size_t *lens, most = 0;
+    apr_time_t start;
+    int i, j;
+
+    if (!ctx->nfiles) {
+        apr_file_printf(ctx->err, "No text files specified, such as the "
+                "DESCRIPTION or X-ALT-DESC of an event saved to a file.\n");
+        return 1;
+    }
+
+    texts = apr_palloc(ctx->pool, ctx->nfiles * sizeof(char *));
+    lens = apr_palloc(ctx->pool, ctx->nfiles * sizeof(apr_size_t));
+    for (i = 0; i < ctx->nfiles; i++) {
+        if (bench_read(ctx, ctx->files[i], &texts[i], &lens[i])
+                != APR_SUCCESS) {
+            return 1;
+        }
+        if (lens[i] > most) {
+            most = lens[i];
+        }
+        bytes += (apr_uint64_t) lens[i] * ctx->count;
+    }
+
+    /* no byte grows to more than six */
+    buf = apr_palloc(ctx->pool, most * 6 + 1);
+    check = apr_palloc(ctx->pool, most * 6 + 1);
+
+    /* both must agree before they are compared */
+    for (i = 0; i < ctx->nfiles; i++) {
+        apr_size_t len = bench_json_words(buf, texts[i], lens[i]);
+
+        if (len != bench_json_bytes(check, texts[i], lens[i])
+                || memcmp(buf, check, len)) {
+            apr_file_printf(ctx->err, "Escapes of '%s' differ\n",
+                    ctx->files[i]);
+            return 1;
+        }
+    }
+
+    start = apr_time_now();
+    for (j = 0; j < ctx->count; j++) {
+        for (i = 0; i < ctx->nfiles; i++) {
+            bench_sink += bench_json_words(buf, texts[i], lens[i]);
+        }
+    }
+    bench_report(ctx, "escape word at a time", ops, bytes, start);
+
+    start = apr_time_now();
+    for (j = 0; j < ctx->count; j++) {
+        for (i = 0; i < ctx->nfiles; i++) {
+            bench_sink += bench_json_bytes(buf, texts[i], lens[i]);
+        }
+    }
+    bench_report(ctx, "escape byte at a time", ops, bytes, start);
+
+    return 0;
+}
+
+/*
+ * convert: the times of recurring calendars converted between timezones.
+ */
+
+static apr_status_t bench_calendar(bench_ctx *ctx, const char *name,
+        icalcomponent **root)
+{
+    apr_status_t status;
+    apr_size_t len;
+    char *buffer;
+
+    status = bench_read(ctx, name, &buffer, &len);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    *root = icalparser_parse_string(buffer);
+    if (!*root) {
+        apr_file_printf(ctx->err, "Could not parse '%s'\n", name);
+        return APR_EGENERAL;
+    }
+
+    return APR_SUCCESS;
+}
+
+/* each date-time given in a timezone, as ical_timezone_component() finds
+ * them, and up to BENCH_VALUES occurrences of each rule, as the filter
+ * expands them.
+ */
+static void bench_collect(icalcomponent *comp, apr_array_header_t *times)
+{
+    struct icaltimetype dtstart = icaltime_null_time();
+    icalcomponent *scomp;
+    icalproperty *prop;
+
+    for (prop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
+            prop;
+            prop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY)) {
+        icalparameter *param = icalproperty_get_first_parameter(prop,
+                ICAL_TZID_PARAMETER);
+        icalvalue *val = icalproperty_get_value(prop);
+        icaltimezone *zone;
+        struct icaltimetype tt;
+
+        zone = param ? ical_tz_find(icalparameter_get_tzid(param)) : NULL;
+        if (!zone || !val) {
+            continue;
+        }
+
+        switch (icalvalue_isa(val)) {
+        case ICAL_DATETIME_VALUE: {
+            tt = icalvalue_get_datetime(val);
+            break;
+        }
+        case ICAL_DATETIMEPERIOD_VALUE: {
+            tt = icalvalue_get_datetimeperiod(val).time;
+            break;
+        }
+        default: {
+            continue;
+        }
+        }
+        if (icaltime_is_null_time(tt) || tt.is_date) {
+            continue;
+        }
+
+        tt.zone = zone;
+        APR_ARRAY_PUSH(times, struct icaltimetype) = tt;
+
+        if (icalproperty_isa(prop) == ICAL_DTSTART_PROPERTY) {
+            dtstart = tt;
+        }
+    }
+
+    /* rules are walked apart, the component has one property iterator */
+    for (prop = icalcomponent_get_first_property(comp, ICAL_RRULE_PROPERTY);
+            prop && !icaltime_is_null_time(dtstart);
+            prop = icalcomponent_get_next_property(comp,
+                    ICAL_RRULE_PROPERTY)) {
+        icalrecur_iterator *iter = icalrecur_iterator_new(
+                icalproperty_get_rrule(prop), dtstart);
+        int i;
+
+        for (i = 0; iter && i < BENCH_VALUES; i++) {
+            struct icaltimetype next = icalrecur_iterator_next(iter);
+
+            if (icaltime_is_null_time(next)) {
+                break;
+            }
+            next.zone = dtstart.zone;
+            APR_ARRAY_PUSH(times, struct icaltimetype) = next;
+        }
+        if (iter) {
+            icalrecur_iterator_free(iter);
+        }
+    }
+
+    for (scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+            scomp;
+            scomp = icalcomponent_get_next_component(comp,
+                    ICAL_ANY_COMPONENT)) {
+        if (icalcomponent_isa(scomp) != ICAL_VTIMEZONE_COMPONENT) {
+            bench_collect(scomp, times);
+        }
+    }
+}
+
+/* the times of the calendars given, with the tables of their timezones
+ * built and each timezone expanded once by libical, so that neither is
+ * timed.
+ */
+static apr_status_t bench_load(bench_ctx *ctx, apr_array_header_t **times)
+{
+    int i, k;
+
+    if (!ctx->nfiles) {
+        apr_file_printf(ctx->err, "No calendars specified.\n");
+        return APR_EINVAL;
+    }
+
+    *times = apr_array_make(ctx->pool, BENCH_VALUES,
+            sizeof(struct icaltimetype));
+    for (i = 0; i < ctx->nfiles; i++) {
+        icalcomponent *root;
+
+        if (bench_calendar(ctx, ctx->files[i], &root) != APR_SUCCESS) {
+            return APR_EGENERAL;
+        }
+        bench_collect(root, *times);
+        icalcomponent_free(root);
+    }
+    if (!(*times)->nelts) {
+        apr_file_printf(ctx->err, "No date-times in a builtin timezone "
+                "were found.\n");
+        return APR_ENOENT;
+    }
+
+    /* as a server would before its threads start */
+    ical_tz_freeze();
+
+    for (k = 0; k < ctx->zones->nelts; k++) {
+        icaltimezone *zone = APR_ARRAY_IDX(ctx->zones, k, icaltimezone *);
+
+        for (i = 0; i < (*times)->nelts; i++) {
+            struct icaltimetype tt = APR_ARRAY_IDX(*times, i,
+                    struct icaltimetype);
+
+            bench_sink += ical_tz_convert(tt, zone).hour;
+            bench_sink += icaltime_convert_to_zone(tt, zone).hour;
+        }
+    }
+
+    apr_file_printf(ctx->out, "%d date-times and occurrences\n",
+            (*times)->nelts);
+
+    return APR_SUCCESS;
+}
+
+static int bench_convert(bench_ctx *ctx)
+{
+    apr_array_header_t *times;
+    apr_uint64_t ops;
+    apr_time_t start;
+    int i, j, k;
+
+    if (bench_load(ctx, &times) != APR_SUCCESS) {
+        return 1;
+    }
+
+    ops = (apr_uint64_t) ctx->count * times->nelts;
+    for (k = 0; k < ctx->zones->nelts; k++) {
+        icaltimezone *zone = APR_ARRAY_IDX(ctx->zones, k, icaltimezone *);
+        const char *location = icaltimezone_get_location(zone);
+
+        if (!location) {
+            location = icaltimezone_get_tzid(zone);
+        }
+
+        start = apr_time_now();
+        for (j = 0; j < ctx->count; j++) {
+            for (i = 0; i < times->nelts; i++) {
+                bench_sink += ical_tz_convert(APR_ARRAY_IDX(times, i,
+                        struct icaltimetype), zone).hour;
+            }
+        }
+        bench_report(ctx, apr_psprintf(ctx->pool, "convert %s tables",
+                location), ops, 0, start);
+
+        start = apr_time_now();
+        for (j = 0; j < ctx->count; j++) {
+            for (i = 0; i < times->nelts; i++) {
+                bench_sink += icaltime_convert_to_zone(APR_ARRAY_IDX(times, i,
+                        struct icaltimetype), zone).hour;
+            }
+        }
+        bench_report(ctx, apr_psprintf(ctx->pool, "convert %s libical",
+                location), ops, 0, start);
+    }
+
+    return 0;
+}
+
+/*
+ * threads: the conversions of convert spread across threads, as the
+ * worker and event MPMs spread requests.
+ */
+
+#if APR_HAS_THREADS
+typedef struct bench_thread {
+    bench_ctx *ctx;
+    const apr_array_header_t *times;
+    int libical; /* convert through libical rather than the tables */
+    apr_size_t sum; /* results, added to the sink once joined */
+} bench_thread;
+
+static void *APR_THREAD_FUNC bench_thread_run(apr_thread_t *thread,
+        void *data)
+{
+    bench_thread *bt = data;
+    const apr_array_header_t *zones = bt->ctx->zones;
+    int i, j, k;
+
+    for (j = 0; j < bt->ctx->count; j++) {
+        for (k = 0; k < zones->nelts; k++) {
+            icaltimezone *zone = APR_ARRAY_IDX(zones, k, icaltimezone *);
+
+            for (i = 0; i < bt->times->nelts; i++) {
+                struct icaltimetype tt = APR_ARRAY_IDX(bt->times, i,
+                        struct icaltimetype);
+
+                bt->sum += (bt->libical ? icaltime_convert_to_zone(tt, zone)
+                        : ical_tz_convert(tt, zone)).hour;
+            }
+        }
+    }
+
+    if (thread) {
+        apr_thread_exit(thread, APR_SUCCESS);
+    }
+
+    return NULL;
+}
+
+static apr_time_t bench_threads_run(bench_ctx *ctx,
+        const apr_array_header_t *times, int threads, int libical,
+        apr_time_t single)
+{
+    apr_thread_t **workers = apr_pcalloc(ctx->pool,
+            threads * sizeof(apr_thread_t *));
+    bench_thread *bts = apr_pcalloc(ctx->pool,
+            threads * sizeof(bench_thread));
+    apr_uint64_t ops = (apr_uint64_t) threads * ctx->count * times->nelts
+            * ctx->zones->nelts;
+    apr_status_t status;
+    apr_time_t start, took;
+    int i;
+
+    for (i = 0; i < threads; i++) {
+        bts[i].ctx = ctx;
+        bts[i].times = times;
+        bts[i].libical = libical;
+    }
+
+    start = apr_time_now();
+    for (i = 0; i < threads; i++) {
+        status = apr_thread_create(&workers[i], NULL, bench_thread_run,
+                &bts[i], ctx->pool);
+        if (status != APR_SUCCESS) {
+            apr_file_printf(ctx->err, "Could not create thread: %pm\n",
+                    &status);
+            workers[i] = NULL;
+        }
+    }
+    for (i = 0; i < threads; i++) {
+        if (workers[i]) {
+            apr_thread_join(&status, workers[i]);
+            bench_sink += bts[i].sum;
+        }
+    }
+    took = bench_report(ctx, apr_psprintf(ctx->pool, "threads %d %s",
+            threads, libical ? "libical" : "tables"), ops, 0, start);
+
+    /* the same work per thread, so linear scaling takes the same time */
+    if (single && took) {
+        apr_file_printf(ctx->out, "%-32s %12.2fx of one thread, %d%% of "
+                "linear\n", "", (double) single * threads / took,
+                (int) (100 * single / took));
+    }
+
+    return took;
+}
+#endif
+
+static int bench_threads(bench_ctx *ctx)
+{
+#if APR_HAS_THREADS
+    apr_array_header_t *times;
+    int libical;
+
+    if (bench_load(ctx, &times) != APR_SUCCESS) {
+        return 1;
+    }
+
+    for (libical = 0; libical < 2; libical++) {
+        apr_time_t single = bench_threads_run(ctx, times, 1, libical, 0);
+        int threads;
+
+        for (threads = 2; threads < ctx->threads; threads *= 2) {
+            bench_threads_run(ctx, times, threads, libical, single);
+        }
+        if (ctx->threads > 1) {
+            bench_threads_run(ctx, times, ctx->threads, libical, single);
+        }
+    }
+
+    return 0;
+#else
+    apr_file_printf(ctx->err, "Threads are not supported.\n");
+    return 1;
+#endif
+}
+
+/*
+ * soak: memory use over many requests converted to a timezone.
+ */
+
+static apr_status_t icalcomponent_cleanup(void *data)
+{
+    icalcomponent *comp = data;
+    icalcomponent_free(comp);
+    return APR_SUCCESS;
+}
+
+/* resident memory in kB, or zero where it cannot be read */
+static apr_off_t bench_rss(apr_pool_t *pool)
+{
+    apr_file_t *status;
+    char line[256];
+    apr_off_t rss = 0;
+
+    if (apr_file_open(&status, "/proc/self/status", APR_FOPEN_READ,
+            APR_FPROT_OS_DEFAULT, pool) != APR_SUCCESS) {
+        return 0;
+    }
+
+    while (apr_file_gets(line, sizeof(line), status) == APR_SUCCESS) {
+        if (!strncmp(line, "VmRSS:", 6)) {
+            apr_strtoff(&rss, line + 6, NULL, 10);
+            break;
+        }
+    }
+
+    apr_file_close(status);
+
+    return rss;
+}
+
+/* one request, as mod_ical converts a calendar with no caches */
+static apr_status_t bench_request(bench_ctx *ctx, const char *buffer,
+        icaltimezone *zone, ap_ical_output_e output)
+{
+    apr_pool_t *pool;
+    icalcomponent *root, *comp, *next;
+    ical_conv conv;
+    apr_status_t status = APR_SUCCESS;
+
+    apr_pool_create(&pool, ctx->pool);
+
+    memset(&conv, 0, sizeof(conv));
+    conv.pool = pool;
+    conv.bb = apr_brigade_create(pool, apr_bucket_alloc_create(pool));
+    conv.tz = zone;
+    conv.budget = ICAL_RECUR_BUDGET;
+    conv.output = output;
+    conv.filter = AP_ICAL_FILTER_FUTURE;
+    conv.format = AP_ICAL_FORMAT_NONE;
+
+    root = icalparser_parse_string(buffer);
+    if (!root) {
+        apr_pool_destroy(pool);
+        return APR_EGENERAL;
+    }
+    apr_pool_cleanup_register(pool, root, icalcomponent_cleanup,
+            apr_pool_cleanup_null);
+
+    if (icalcomponent_isa(root) == ICAL_XROOT_COMPONENT) {
+        comp = icalcomponent_get_first_component(root, ICAL_ANY_COMPONENT);
+    }
+    else {
+        comp = root;
+    }
+
+    while (comp && status == APR_SUCCESS) {
+
+        next = (comp == root) ? NULL :
+                icalcomponent_get_next_component(root, ICAL_ANY_COMPONENT);
+
+        /* filtered before conversion, so that rules recur in the
+         * timezones they were given in.
+         */
+        comp = ical_timezone_used(&conv, ical_timezone_component(&conv,
+                ical_filter_component(&conv, comp, NULL), NULL));
+        if (comp) {
+            status = ical_write(&conv, comp);
+        }
+
+        comp = next;
+    }
+
+    bench_sink += conv.buffered;
+
+    apr_pool_destroy(pool);
+
+    return status;
+}
+
+static int bench_soak(bench_ctx *ctx)
+{
+    char **buffers;
+    apr_size_t len;
+    apr_off_t first = 0, rss;
+    apr_time_t start;
+    int every = ctx->count / BENCH_SOAK_REPORTS;
+    int i;
+
+    if (!ctx->nfiles) {
+        apr_file_printf(ctx->err, "No calendars specified.\n");
+        return 1;
+    }
+
+    buffers = apr_palloc(ctx->pool, ctx->nfiles * sizeof(char *));
+    for (i = 0; i < ctx->nfiles; i++) {
+        if (bench_read(ctx, ctx->files[i], &buffers[i], &len)
+                != APR_SUCCESS) {
+            return 1;
+        }
+    }
+
+    /* as a server would before its threads start */
+    ical_names_init(ctx->pool);
+    ical_recur_init(ctx->pool);
+    ical_tz_freeze();
+
+    if (!every) {
+        every = 1;
+    }
+
+    start = apr_time_now();
+    for (i = 0; i < ctx->count; i++) {
+        icaltimezone *zone = APR_ARRAY_IDX(ctx->zones,
+                i % ctx->zones->nelts, icaltimezone *);
+
+        if (bench_request(ctx, buffers[i % ctx->nfiles], zone,
+                AP_ICAL_OUTPUT_ICAL + i % 3) != APR_SUCCESS) {
+            apr_file_printf(ctx->err, "Could not convert '%s'\n",
+                    ctx->files[i % ctx->nfiles]);
+            return 1;
+        }
+
+        /* the first report follows the caches filling up */
+        if ((i + 1) % every == 0) {
+            rss = bench_rss(ctx->pool);
+            if (!first) {
+                first = rss;
+            }
+            apr_file_printf(ctx->out, "%12d requests %10" APR_OFF_T_FMT
+                    " kB resident %+10" APR_OFF_T_FMT " kB\n", i + 1, rss,
+                    rss - first);
+        }
+    }
+    bench_report(ctx, "soak", ctx->count, 0, start);
+
+    return 0;
+}
+
+static const bench_def benchmarks[] =
+{
+    { "format", bench_format },
+    { "escape", bench_escape },
+    { "convert", bench_convert },
+    { "threads", bench_threads },
+    { "soak", bench_soak },
+    { NULL, NULL }
+};
+
+int main(int argc, const char * const argv[])
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    apr_file_t *out, *err;
+    const bench_def *bench;
+    bench_ctx ctx;
+    const char *optarg;
+    int optch;
+    int i;
+
+    /* lets get APR off the ground, and make sure it terminates cleanly */
+    if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (APR_SUCCESS != (status = apr_pool_create(&pool, NULL))) {
+        return 1;
+    }
+
+    apr_file_open_stderr(&err, pool);
+    apr_file_open_stdout(&out, pool);
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pool = pool;
+    ctx.out = out;
+    ctx.err = err;
+    ctx.count = 1000;
+    ctx.threads = 4;
+    ctx.zones = apr_array_make(pool, 8, sizeof(icaltimezone *));
+
+    ical_tz_init(pool);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        switch (optch) {
+        case 'n': {
+            ctx.count = atoi(optarg);
+            if (ctx.count < 1) {
+                return help(err, argv[0], "Count must be at least one.", 1);
+            }
+            break;
+        }
+        case 'j': {
+            ctx.threads = atoi(optarg);
+            if (ctx.threads < 1) {
+                return help(err, argv[0], "Threads must be at least one.", 1);
+            }
+            break;
+        }
+        case 'z': {
+            icaltimezone *zone = ical_tz_location(optarg);
+
+            if (!zone) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Timezone '%s' is not recognised.", optarg), 1);
+            }
+            APR_ARRAY_PUSH(ctx.zones, icaltimezone *) = zone;
+            break;
+        }
+        case 'Z': {
+            ical_tz_zoneinfo(optarg);
+            break;
+        }
+        case 'h': {
+            return help(out, argv[0], NULL, 0);
+        }
+        }
+
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, 1);
+    }
+
+    if (opt->ind == argc) {
+        return help(err, argv[0], "No benchmark specified.", 1);
+    }
+
+    for (bench = benchmarks; bench->name; bench++) {
+        if (!strcmp(bench->name, opt->argv[opt->ind])) {
+            break;
+        }
+    }
+    if (!bench->name) {
+        return help(err, argv[0], apr_psprintf(pool,
+                "Benchmark '%s' is not recognised.", opt->argv[opt->ind]), 1);
+    }
+
+    if (!ctx.zones->nelts) {
+        static const char * const zones[] = { "America/New_York",
+                "Europe/London", "Asia/Kolkata", "Australia/Sydney", "UTC",
+                NULL };
+
+        for (i = 0; zones[i]; i++) {
+            icaltimezone *zone = ical_tz_location(zones[i]);
+
+            if (zone) {
+                APR_ARRAY_PUSH(ctx.zones, icaltimezone *) = zone;
+            }
+        }
+    }
+
+    ctx.files = opt->argv + opt->ind + 1;
+    ctx.nfiles = argc - opt->ind - 1;
+
+    return bench->run(&ctx);
+}
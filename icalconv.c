@@ -0,0 +1,590 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * icalconv.c: Convert calendars offline using the mod_ical conversions
+ *
+ * icalconv [-o ical|xcal|jcal|all] calendar.ics [...]
+ *
+ * Each calendar is converted to each requested output, and written
+ * alongside the calendar, or into the given directory. Conversions are
+ * spread across the given number of threads.
+ */
+
+#include "apr.h"
+#include "apr_atomic.h"
+#include "apr_buckets.h"
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_getopt.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+#include "apr_thread_proc.h"
+
+#include "config.h"
+
+#include <libical/ical.h>
+
+#include <libxml/parser.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ical_conv.h"
+#include "ical_recur.h"
+#include "ical_tz.h"
+#include "ical_zoneinfo.h"
+
+typedef struct convert_job {
+    const char *source;
+    const char *target;
+    ap_ical_output_e output;
+} convert_job;
+
+typedef struct convert_batch {
+    apr_file_t *err;
+    convert_job *jobs;
+    apr_uint32_t count;
+    volatile apr_uint32_t next;
+    volatile apr_uint32_t failed;
+    icaltimezone *tz;
+    const char *uid;
+    ap_ical_filter_e filter;
+    ap_ical_format_e format;
+    apr_size_t budget;
+    int repeat;
+} convert_batch;
+
+static const apr_getopt_option_t cmdline_opts[] =
+{
+    { "output", 'o', 1, "  -o, --output ical|xcal|jcal|all\tOutput to write, can be specified more than once. Defaults to 'xcal' and 'jcal'" },
+    { "filter", 'f', 1, "  -f, --filter none|next|last|future|past\tFilter to apply. Defaults to 'none'" },
+    { "format", 'F', 1, "  -F, --format none|spaced|pretty\tFormatting of xCal and jCal. Defaults to 'none'" },
+    { "timezone", 'z', 1, "  -z, --timezone zone\tConvert all times to the given timezone" },
+    { "zoneinfo", 'Z', 1, "  -Z, --zoneinfo dir\tRead timezone offsets from the TZif files beneath the given directory, such as " ICAL_ZONEINFO_DIR },
+    { "uid", 'u', 1, "  -u, --uid uid\t\tKeep only the components with the given UID" },
+    { "budget", 'b', 1, "  -b, --budget num\tMost occurrences of recurring components to expand for each conversion. Defaults to 100000" },
+    { "directory", 'd', 1, "  -d, --directory dir\tWrite to the given directory. Defaults to the directory of each calendar" },
+    { "threads", 'j', 1, "  -j, --threads num\tNumber of conversions to run at once. Defaults to 1" },
+    { "repeat", 'r', 1, "  -r, --repeat num\tRepeat each conversion, for profiling. Defaults to 1" },
+    { "help", 'h', 0, "  -h, --help\t\tDisplay this help message" },
+    { NULL, 0, 0, NULL }
+};
+
+static int help(apr_file_t *out, const char *name, const char *msg, int code)
+{
+    const apr_getopt_option_t *opts = cmdline_opts;
+
+    apr_file_printf(out,
+            "%s\n"
+            "\n"
+            "NAME\n"
+            "  %s - Convert iCalendar files to iCal, xCal and jCal.\n"
+            "\n"
+            "SYNOPSIS\n"
+            "  %s [-o output] [-f filter] [-F format] [-z zone] [-u uid]\n"
+            "      [-b budget] [-d dir] [-j threads] [-r repeat]\n"
+            "      calendar.ics [...]\n"
+            "\n"
+            "DESCRIPTION\n"
+            "  Each calendar is converted to each requested output exactly as\n"
+            "  mod_ical would, and written next to the calendar, or to the given\n"
+            "  directory, with the suffix '.ics', '.xml' or '.json'. A calendar\n"
+            "  is never overwritten by its own conversion.\n"
+            "\n"
+            "OPTIONS\n", msg ? msg : "", name, name);
+
+    while (opts->name) {
+        apr_file_printf(out, "%s\n\n", opts->description);
+        opts++;
+    }
+
+    return code;
+}
+
+static apr_status_t icalcomponent_cleanup(void *data)
+{
+    icalcomponent *comp = data;
+    icalcomponent_free(comp);
+    return APR_SUCCESS;
+}
+
+static const char *target_name(apr_pool_t *pool, const char *source,
+        const char *dir, ap_ical_output_e output)
+{
+    const char *name = apr_filepath_name_get(source);
+    const char *suffix, *dot;
+    char *target;
+
+    switch (output) {
+    case AP_ICAL_OUTPUT_XCAL: {
+        suffix = ".xml";
+        break;
+    }
+    case AP_ICAL_OUTPUT_JCAL: {
+        suffix = ".json";
+        break;
+    }
+    default: {
+        suffix = ".ics";
+        break;
+    }
+    }
+
+    /* strip the suffix of the source, if any */
+    dot = strrchr(name, '.');
+    if (dot && dot != name) {
+        name = apr_pstrndup(pool, name, dot - name);
+    }
+
+    if (!dir) {
+        dir = apr_pstrndup(pool, source,
+                apr_filepath_name_get(source) - source);
+    }
+
+    if (APR_SUCCESS != apr_filepath_merge(&target, dir[0] ? dir : NULL,
+            apr_pstrcat(pool, name, suffix, NULL), APR_FILEPATH_NATIVE, pool)) {
+        return NULL;
+    }
+
+    return target;
+}
+
+static apr_status_t read_calendar(apr_pool_t *pool, apr_file_t *err,
+        const char *source, char **buffer)
+{
+    apr_file_t *in;
+    apr_finfo_t finfo;
+    apr_status_t status;
+    apr_size_t len;
+
+    status = apr_file_open(&in, source, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not open '%s': %pm\n", source, &status);
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE, in);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not stat '%s': %pm\n", source, &status);
+        return status;
+    }
+
+    len = (apr_size_t) finfo.size;
+    *buffer = apr_palloc(pool, len + 1);
+    status = apr_file_read_full(in, *buffer, len, &len);
+    if (status != APR_SUCCESS && status != APR_EOF) {
+        apr_file_printf(err, "Could not read '%s': %pm\n", source, &status);
+        return status;
+    }
+    (*buffer)[len] = 0;
+
+    apr_file_close(in);
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t write_brigade(apr_pool_t *pool, apr_file_t *err,
+        apr_bucket_brigade *bb, const char *target)
+{
+    apr_file_t *out;
+    apr_bucket *e;
+    apr_status_t status;
+    char *temp;
+
+    /* write to a temporary file and rename, so that readers never see a
+     * partial conversion.
+     */
+    temp = apr_pstrcat(pool, target, ".XXXXXX", NULL);
+    status = apr_file_mktemp(&out, temp, APR_FOPEN_CREATE | APR_FOPEN_READ
+            | APR_FOPEN_WRITE | APR_FOPEN_EXCL | APR_FOPEN_BINARY
+            | APR_FOPEN_BUFFERED, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not create '%s': %pm\n", temp, &status);
+        return status;
+    }
+
+    for (e = APR_BRIGADE_FIRST(bb);
+            e != APR_BRIGADE_SENTINEL(bb) && status == APR_SUCCESS;
+            e = APR_BUCKET_NEXT(e)) {
+        const char *data;
+        apr_size_t size;
+
+        status = apr_bucket_read(e, &data, &size, APR_BLOCK_READ);
+        if (status == APR_SUCCESS && size) {
+            status = apr_file_write_full(out, data, size, NULL);
+        }
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_file_close(out);
+    }
+    else {
+        apr_file_close(out);
+    }
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not write '%s': %pm\n", temp, &status);
+        apr_file_remove(temp, pool);
+        return status;
+    }
+
+    status = apr_file_rename(temp, target, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not rename '%s' to '%s': %pm\n", temp,
+                target, &status);
+        apr_file_remove(temp, pool);
+        return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+static apr_status_t convert(convert_batch *batch, convert_job *job)
+{
+    apr_pool_t *pool;
+    apr_status_t status;
+    char *buffer;
+    int i;
+
+    /* a pool of our own, pools are not shared between threads */
+    status = apr_pool_create(&pool, NULL);
+    if (status != APR_SUCCESS) {
+        return status;
+    }
+
+    status = read_calendar(pool, batch->err, job->source, &buffer);
+
+    for (i = 0; status == APR_SUCCESS && i < batch->repeat; i++) {
+        apr_pool_t *p;
+        ical_conv conv;
+        icalcomponent *root, *comp, *next;
+
+        apr_pool_create(&p, pool);
+
+        memset(&conv, 0, sizeof(conv));
+        conv.pool = p;
+        conv.bb = apr_brigade_create(p, apr_bucket_alloc_create(p));
+        conv.tz = batch->tz;
+        conv.uid = batch->uid;
+        conv.budget = batch->budget;
+        conv.output = job->output;
+        conv.filter = batch->filter;
+        conv.format = batch->format;
+
+        root = icalparser_parse_string(buffer);
+        if (!root) {
+            apr_file_printf(batch->err, "Could not parse '%s'\n",
+                    job->source);
+            status = APR_EGENERAL;
+            break;
+        }
+        apr_pool_cleanup_register(p, root, icalcomponent_cleanup,
+                apr_pool_cleanup_null);
+
+        /* several calendars in one file are parsed beneath an XROOT, and
+         * are written one after the other as mod_ical would.
+         */
+        if (icalcomponent_isa(root) == ICAL_XROOT_COMPONENT) {
+            comp = icalcomponent_get_first_component(root, ICAL_ANY_COMPONENT);
+        }
+        else {
+            comp = root;
+        }
+
+        while (comp && status == APR_SUCCESS) {
+
+            next = (comp == root) ? NULL :
+                    icalcomponent_get_next_component(root, ICAL_ANY_COMPONENT);
+
+            /* filtered before conversion, so that rules recur in the
+             * timezones they were given in.
+             */
+            comp = ical_timezone_used(&conv, ical_timezone_component(&conv,
+                    ical_filter_component(&conv, comp, NULL), NULL));
+            if (comp) {
+                status = ical_write(&conv, comp);
+                if (status != APR_SUCCESS) {
+                    apr_file_printf(batch->err, "Could not convert '%s': %pm\n",
+                            job->source, &status);
+                }
+            }
+
+            comp = next;
+        }
+
+        /* only the last of the repeated conversions is written */
+        if (status == APR_SUCCESS && i + 1 == batch->repeat) {
+            status = write_brigade(p, batch->err, conv.bb, job->target);
+        }
+
+        apr_pool_destroy(p);
+    }
+
+    apr_pool_destroy(pool);
+
+    return status;
+}
+
+static void *APR_THREAD_FUNC convert_thread(apr_thread_t *thread, void *data)
+{
+    convert_batch *batch = data;
+    apr_uint32_t i;
+
+    /* claim the next job until there are none left */
+    while ((i = apr_atomic_inc32(&batch->next)) < batch->count) {
+        if (convert(batch, &batch->jobs[i]) != APR_SUCCESS) {
+            apr_atomic_set32(&batch->failed, 1);
+        }
+    }
+
+    if (thread) {
+        apr_thread_exit(thread, APR_SUCCESS);
+    }
+
+    return NULL;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    apr_file_t *out, *err;
+    apr_array_header_t *jobs;
+    convert_batch batch;
+    const char *optarg;
+    const char *dir = NULL;
+    int outputs[AP_ICAL_OUTPUT_JCAL + 1] = { 0 };
+    int threads = 1;
+    int optch;
+    int i, j;
+
+    /* lets get APR off the ground, and make sure it terminates cleanly */
+    if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (APR_SUCCESS != (status = apr_pool_create(&pool, NULL))) {
+        return 1;
+    }
+
+    apr_file_open_stderr(&err, pool);
+    apr_file_open_stdout(&out, pool);
+
+    memset(&batch, 0, sizeof(batch));
+    batch.err = err;
+    batch.filter = AP_ICAL_FILTER_NONE;
+    batch.format = AP_ICAL_FORMAT_NONE;
+    batch.budget = ICAL_RECUR_BUDGET;
+    batch.repeat = 1;
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        switch (optch) {
+        case 'o': {
+            if (!strcmp(optarg, "ical")) {
+                outputs[AP_ICAL_OUTPUT_ICAL] = 1;
+            }
+            else if (!strcmp(optarg, "xcal")) {
+                outputs[AP_ICAL_OUTPUT_XCAL] = 1;
+            }
+            else if (!strcmp(optarg, "jcal")) {
+                outputs[AP_ICAL_OUTPUT_JCAL] = 1;
+            }
+            else if (!strcmp(optarg, "all")) {
+                outputs[AP_ICAL_OUTPUT_ICAL] = 1;
+                outputs[AP_ICAL_OUTPUT_XCAL] = 1;
+                outputs[AP_ICAL_OUTPUT_JCAL] = 1;
+            }
+            else {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Output '%s' must be one of 'ical', 'xcal', 'jcal' or 'all'.",
+                        optarg), 1);
+            }
+            break;
+        }
+        case 'f': {
+            batch.filter = ical_parse_filter(optarg, strlen(optarg));
+            if (batch.filter == AP_ICAL_FILTER_UNKNOWN) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Filter '%s' must be one of 'none', 'next', 'last', 'future' or 'past'.",
+                        optarg), 1);
+            }
+            break;
+        }
+        case 'F': {
+            batch.format = ical_parse_format(optarg, strlen(optarg));
+            if (batch.format == AP_ICAL_FORMAT_UNKNOWN) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Format '%s' must be one of 'none', 'spaced' or 'pretty'.",
+                        optarg), 1);
+            }
+            break;
+        }
+        case 'z': {
+            ical_tz_init(pool);
+            batch.tz = ical_tz_location(optarg);
+            if (!batch.tz) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Timezone '%s' is not recognised.", optarg), 1);
+            }
+            break;
+        }
+        case 'Z': {
+            ical_tz_init(pool);
+            ical_tz_zoneinfo(optarg);
+            break;
+        }
+        case 'u': {
+            batch.uid = optarg;
+            break;
+        }
+        case 'b': {
+            apr_off_t budget;
+
+            if (apr_strtoff(&budget, optarg, NULL, 10) != APR_SUCCESS
+                    || budget < 0) {
+                return help(err, argv[0],
+                        "Budget must be a number of occurrences, or zero.", 1);
+            }
+            batch.budget = (apr_size_t) budget;
+            break;
+        }
+        case 'd': {
+            dir = optarg;
+            break;
+        }
+        case 'j': {
+            threads = atoi(optarg);
+            if (threads < 1) {
+                return help(err, argv[0], "Threads must be at least one.", 1);
+            }
+            break;
+        }
+        case 'r': {
+            batch.repeat = atoi(optarg);
+            if (batch.repeat < 1) {
+                return help(err, argv[0], "Repeat must be at least one.", 1);
+            }
+            break;
+        }
+        case 'h': {
+            return help(out, argv[0], NULL, 0);
+        }
+        }
+
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, 1);
+    }
+
+    if (opt->ind == argc) {
+        return help(err, argv[0], "No calendars specified.", 1);
+    }
+
+    if (!outputs[AP_ICAL_OUTPUT_ICAL] && !outputs[AP_ICAL_OUTPUT_XCAL]
+            && !outputs[AP_ICAL_OUTPUT_JCAL]) {
+        outputs[AP_ICAL_OUTPUT_XCAL] = 1;
+        outputs[AP_ICAL_OUTPUT_JCAL] = 1;
+    }
+
+    /* one job for each calendar and output */
+    jobs = apr_array_make(pool, argc, sizeof(convert_job));
+    for (; opt->ind < argc; opt->ind++) {
+        const char *source = opt->argv[opt->ind];
+
+        for (j = AP_ICAL_OUTPUT_ICAL; j <= AP_ICAL_OUTPUT_JCAL; j++) {
+            convert_job *job;
+            char *path;
+
+            if (!outputs[j]) {
+                continue;
+            }
+
+            job = apr_array_push(jobs);
+            job->source = source;
+            job->output = j;
+            job->target = target_name(pool, source, dir, j);
+
+            if (!job->target) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Could not name the output for '%s'.", source), 1);
+            }
+            if (APR_SUCCESS == apr_filepath_merge(&path, NULL, source,
+                    APR_FILEPATH_NATIVE, pool) && !strcmp(path, job->target)) {
+                return help(err, argv[0], apr_psprintf(pool,
+                        "Output '%s' would overwrite the calendar, use --directory.",
+                        job->target), 1);
+            }
+        }
+    }
+
+    batch.jobs = (convert_job *) jobs->elts;
+    batch.count = jobs->nelts;
+
+    /* timezones, names and libxml2 are not safe to initialise from more
+     * than one thread at a time, load them now before the threads start.
+     */
+    if (batch.tz) {
+        icaltimezone_get_component(batch.tz);
+    }
+    ical_names_init(pool);
+    ical_tz_init(pool);
+    ical_tz_freeze();
+    ical_recur_init(pool);
+    xmlInitParser();
+
+#if APR_HAS_THREADS
+    if (threads > 1) {
+        apr_thread_t **workers;
+
+        apr_atomic_init(pool);
+
+        /* the main thread is one of the threads */
+        workers = apr_pcalloc(pool, (threads - 1) * sizeof(apr_thread_t *));
+        for (i = 0; i < threads - 1; i++) {
+            status = apr_thread_create(&workers[i], NULL, convert_thread,
+                    &batch, pool);
+            if (status != APR_SUCCESS) {
+                apr_file_printf(err, "Could not create thread: %pm\n",
+                        &status);
+                workers[i] = NULL;
+                break;
+            }
+        }
+
+        /* the main thread does its share too */
+        convert_thread(NULL, &batch);
+
+        for (i = 0; i < threads - 1; i++) {
+            if (workers[i]) {
+                apr_thread_join(&status, workers[i]);
+            }
+        }
+    }
+    else
+#endif
+    {
+        convert_thread(NULL, &batch);
+    }
+
+    xmlCleanupParser();
+
+    return batch.failed ? 1 : 0;
+}
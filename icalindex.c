@@ -0,0 +1,387 @@
+/* Licensed to the Apache Software Foundation (ASF) under one or more
+ * contributor license agreements.  See the NOTICE file distributed with
+ * this work for additional information regarding copyright ownership.
+ * The ASF licenses this file to You under the Apache License, Version 2.0
+ * (the "License"); you may not use this file except in compliance with
+ * the License.  You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * icalindex.c: Compile a calendar into an index for mod_ical
+ *
+ * icalindex calendar.ics [...]
+ *
+ * Each calendar is parsed, and an index is written alongside it as
+ * calendar.ics.idx. The index is used by mod_ical to find the components
+ * that pass a filter without parsing the whole calendar.
+ */
+
+#include "apr.h"
+#include "apr_general.h"
+#include "apr_file_io.h"
+#include "apr_getopt.h"
+#include "apr_strings.h"
+#include "apr_tables.h"
+
+#include "config.h"
+
+#include <libical/ical.h>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ical_index.h"
+
+typedef struct index_entry {
+    ical_index_entry entry;
+    char *ical;
+    const char *uid;
+    apr_size_t pos;
+} index_entry;
+
+static const apr_getopt_option_t cmdline_opts[] =
+{
+    { "output", 'o', 1, "  -o, --output file\tWrite the index to the given file" },
+    { "help", 'h', 0, "  -h, --help\t\tDisplay this help message" },
+    { NULL, 0, 0, NULL }
+};
+
+static int help(apr_file_t *out, const char *name, const char *msg, int code)
+{
+    const apr_getopt_option_t *opts = cmdline_opts;
+
+    apr_file_printf(out,
+            "%s\n"
+            "\n"
+            "NAME\n"
+            "  %s - Compile iCalendar files into mod_ical indexes.\n"
+            "\n"
+            "SYNOPSIS\n"
+            "  %s [-o file] calendar.ics [...]\n"
+            "\n"
+            "DESCRIPTION\n"
+            "  Each calendar is parsed and written to an index named after the\n"
+            "  calendar with the '" ICAL_INDEX_SUFFIX "' suffix. The index is used by\n"
+            "  mod_ical in place of the calendar while the calendar is unchanged.\n"
+            "\n"
+            "OPTIONS\n", msg ? msg : "", name, name);
+
+    while (opts->name) {
+        apr_file_printf(out, "%s\n\n", opts->description);
+        opts++;
+    }
+
+    return code;
+}
+
+static int entry_compare(const void *a, const void *b)
+{
+    const index_entry *ea = *(const index_entry **) a;
+    const index_entry *eb = *(const index_entry **) b;
+
+    if (ea->entry.end < eb->entry.end) {
+        return -1;
+    }
+    if (ea->entry.end > eb->entry.end) {
+        return 1;
+    }
+
+    /* keep source order for identical end times */
+    return ea->pos < eb->pos ? -1 : ea->pos > eb->pos ? 1 : 0;
+}
+
+static apr_status_t write_index(apr_pool_t *pool, apr_file_t *err,
+        const char *source, const char *target)
+{
+    apr_file_t *in, *out;
+    apr_finfo_t finfo;
+    apr_status_t status;
+    apr_size_t len, i;
+    apr_array_header_t *entries;
+    index_entry **order;
+    icalcomponent *root, *scomp;
+    icalcompiter iter;
+    ical_index_header header;
+    apr_uint32_t *buckets;
+    apr_uint64_t arena_len = 0;
+    char *buffer, *prologue, *split, *temp;
+
+    /* read the calendar */
+    status = apr_file_open(&in, source, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not open '%s': %pm\n", source, &status);
+        return status;
+    }
+
+    status = apr_file_info_get(&finfo, APR_FINFO_SIZE | APR_FINFO_MTIME, in);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not stat '%s': %pm\n", source, &status);
+        return status;
+    }
+
+    len = (apr_size_t) finfo.size;
+    buffer = apr_palloc(pool, len + 1);
+    status = apr_file_read_full(in, buffer, len, &len);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not read '%s': %pm\n", source, &status);
+        return status;
+    }
+    buffer[len] = 0;
+    apr_file_close(in);
+
+    /* parse the calendar, only a single VCALENDAR can be indexed */
+    root = icalparser_parse_string(buffer);
+    if (!root) {
+        apr_file_printf(err, "Could not parse '%s'\n", source);
+        return APR_EGENERAL;
+    }
+    if (icalcomponent_isa(root) != ICAL_VCALENDAR_COMPONENT) {
+        apr_file_printf(err,
+                "Could not index '%s': calendar must contain a single VCALENDAR\n",
+                source);
+        icalcomponent_free(root);
+        return APR_EGENERAL;
+    }
+
+    /* pull out each component, leaving timezones in the prologue */
+    entries = apr_array_make(pool, 16, sizeof(index_entry));
+    iter = icalcomponent_begin_component(root, ICAL_ANY_COMPONENT);
+    while ((scomp = icalcompiter_deref(&iter))) {
+        index_entry *e;
+        struct icaltimetype end;
+
+        icalcompiter_next(&iter);
+
+        if (icalcomponent_isa(scomp) == ICAL_VTIMEZONE_COMPONENT) {
+            continue;
+        }
+
+        e = apr_array_push(entries);
+        memset(e, 0, sizeof(index_entry));
+
+        end = icalcomponent_get_dtend(scomp);
+
+        e->pos = entries->nelts - 1;
+        e->entry.end = icaltime_as_timet_with_zone(end, end.zone);
+        if (icalcomponent_get_first_property(scomp, ICAL_RRULE_PROPERTY)
+                || icalcomponent_get_first_property(scomp,
+                        ICAL_RDATE_PROPERTY)
+                || icalcomponent_get_first_property(scomp,
+                        ICAL_RECURRENCEID_PROPERTY)) {
+            e->entry.flags |= ICAL_INDEX_RECURS;
+        }
+        e->uid = icalcomponent_get_uid(scomp);
+        e->uid = e->uid ? apr_pstrdup(pool, e->uid) : NULL;
+
+        temp = icalcomponent_as_ical_string_r(scomp);
+        e->ical = apr_pstrdup(pool, temp);
+        icalmemory_free_buffer(temp);
+
+        icalcomponent_remove_component(root, scomp);
+        icalcomponent_free(scomp);
+    }
+
+    temp = icalcomponent_as_ical_string_r(root);
+    prologue = apr_pstrdup(pool, temp);
+    icalmemory_free_buffer(temp);
+    icalcomponent_free(root);
+
+    split = NULL;
+    for (temp = strstr(prologue, "END:VCALENDAR"); temp;
+            temp = strstr(temp + 1, "END:VCALENDAR")) {
+        split = temp;
+    }
+    if (!split) {
+        apr_file_printf(err, "Could not index '%s': no END:VCALENDAR\n",
+                source);
+        return APR_EGENERAL;
+    }
+
+    /* lay out the index */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ICAL_INDEX_MAGIC, sizeof(ICAL_INDEX_MAGIC));
+    header.version = ICAL_INDEX_VERSION;
+    header.byteorder = ICAL_INDEX_BYTEORDER;
+    header.source_size = finfo.size;
+    header.source_mtime = finfo.mtime;
+    header.count = entries->nelts;
+
+    header.buckets = 1;
+    while (header.buckets < header.count) {
+        header.buckets <<= 1;
+    }
+
+    header.entries = sizeof(ical_index_header);
+    header.order = header.entries
+            + header.count * sizeof(ical_index_entry);
+    header.uids = header.order + header.count * sizeof(apr_uint32_t);
+    header.arena = header.uids + header.buckets * sizeof(apr_uint32_t);
+
+    header.prologue = header.arena;
+    header.prologue_len = strlen(prologue);
+    header.prologue_split = split - prologue;
+    arena_len += header.prologue_len;
+
+    buckets = apr_pcalloc(pool, header.buckets * sizeof(apr_uint32_t));
+    order = apr_palloc(pool, (header.count + 1) * sizeof(index_entry *));
+
+    for (i = 0; i < header.count; i++) {
+        index_entry *e = &APR_ARRAY_IDX(entries, i, index_entry);
+
+        e->entry.ical = arena_len;
+        e->entry.ical_len = strlen(e->ical);
+        arena_len += e->entry.ical_len;
+
+        if (e->uid) {
+            apr_uint32_t bucket;
+
+            e->entry.uid = arena_len;
+            e->entry.uid_len = strlen(e->uid);
+            arena_len += e->entry.uid_len;
+
+            bucket = ical_index_hash(e->uid, e->entry.uid_len)
+                    & (header.buckets - 1);
+            e->entry.uid_next = buckets[bucket];
+            buckets[bucket] = i + 1;
+        }
+
+        order[i] = e;
+    }
+    header.arena_len = arena_len;
+
+    qsort(order, header.count, sizeof(index_entry *), entry_compare);
+
+    /* write to a temporary file, and move it into place once complete */
+    temp = apr_pstrcat(pool, target, ".XXXXXX", NULL);
+    status = apr_file_mktemp(&out, temp,
+            APR_FOPEN_CREATE | APR_FOPEN_WRITE | APR_FOPEN_EXCL
+                    | APR_FOPEN_BINARY | APR_FOPEN_BUFFERED, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not create '%s': %pm\n", temp, &status);
+        return status;
+    }
+
+    status = apr_file_write_full(out, &header, sizeof(header), NULL);
+    for (i = 0; status == APR_SUCCESS && i < header.count; i++) {
+        index_entry *e = &APR_ARRAY_IDX(entries, i, index_entry);
+        status = apr_file_write_full(out, &e->entry, sizeof(ical_index_entry),
+                NULL);
+    }
+    for (i = 0; status == APR_SUCCESS && i < header.count; i++) {
+        apr_uint32_t pos = order[i]->pos;
+        status = apr_file_write_full(out, &pos, sizeof(pos), NULL);
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_file_write_full(out, buckets,
+                header.buckets * sizeof(apr_uint32_t), NULL);
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_file_write_full(out, prologue, header.prologue_len, NULL);
+    }
+    for (i = 0; status == APR_SUCCESS && i < header.count; i++) {
+        index_entry *e = &APR_ARRAY_IDX(entries, i, index_entry);
+        status = apr_file_write_full(out, e->ical, e->entry.ical_len, NULL);
+        if (status == APR_SUCCESS && e->uid) {
+            status = apr_file_write_full(out, e->uid, e->entry.uid_len, NULL);
+        }
+    }
+    if (status == APR_SUCCESS) {
+        status = apr_file_close(out);
+    }
+    else {
+        apr_file_close(out);
+    }
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not write '%s': %pm\n", temp, &status);
+        apr_file_remove(temp, pool);
+        return status;
+    }
+
+    status = apr_file_rename(temp, target, pool);
+    if (status != APR_SUCCESS) {
+        apr_file_printf(err, "Could not rename '%s' to '%s': %pm\n", temp,
+                target, &status);
+        apr_file_remove(temp, pool);
+        return status;
+    }
+
+    return APR_SUCCESS;
+}
+
+int main(int argc, const char * const argv[])
+{
+    apr_status_t status;
+    apr_pool_t *pool;
+    apr_getopt_t *opt;
+    apr_file_t *out, *err;
+    const char *optarg;
+    const char *output = NULL;
+    int optch;
+    int rc = 0;
+
+    /* lets get APR off the ground, and make sure it terminates cleanly */
+    if (APR_SUCCESS != (status = apr_app_initialize(&argc, &argv, NULL))) {
+        return 1;
+    }
+    atexit(apr_terminate);
+
+    if (APR_SUCCESS != (status = apr_pool_create(&pool, NULL))) {
+        return 1;
+    }
+
+    apr_file_open_stderr(&err, pool);
+    apr_file_open_stdout(&out, pool);
+
+    apr_getopt_init(&opt, pool, argc, argv);
+    while ((status = apr_getopt_long(opt, cmdline_opts, &optch, &optarg))
+            == APR_SUCCESS) {
+
+        switch (optch) {
+        case 'o': {
+            output = optarg;
+            break;
+        }
+        case 'h': {
+            return help(out, argv[0], NULL, 0);
+        }
+        }
+
+    }
+    if (APR_SUCCESS != status && APR_EOF != status) {
+        return help(err, argv[0], NULL, 1);
+    }
+
+    if (opt->ind == argc) {
+        return help(err, argv[0], "No calendars specified.", 1);
+    }
+    if (output && opt->ind + 1 != argc) {
+        return help(err, argv[0], "Only one calendar allowed with --output.",
+                1);
+    }
+
+    for (; opt->ind < argc; opt->ind++) {
+        const char *source = opt->argv[opt->ind];
+        apr_pool_t *p;
+
+        apr_pool_create(&p, pool);
+
+        if (write_index(p, err, source, output ? output :
+                apr_pstrcat(p, source, ICAL_INDEX_SUFFIX, NULL))
+                != APR_SUCCESS) {
+            rc = 1;
+        }
+
+        apr_pool_destroy(p);
+    }
+
+    return rc;
+}
@@ -32,6 +32,12 @@
 #include "ap_expr.h"
 #include "apr_strings.h"
 #include "apr_lib.h"
+#include "apr_file_io.h"
+#include "apr_hash.h"
+#include "apr_mmap.h"
+#include "apr_allocator.h"
+#include "apr_thread_mutex.h"
+#include "apr_thread_proc.h"
 
 #undef PACKAGE_BUGREPORT
 #undef PACKAGE_NAME
@@ -41,78 +47,140 @@
 #include "config.h"
 
 #include <libical/ical.h>
-#include <libical/icalclassify.h>
-#include <libical/icalrecur.h>
-
-#include <libxml/encoding.h>
-#include <libxml/xmlwriter.h>
-
-#ifdef HAVE_JSON_C_JSON_H
-#include <json-c/json.h>
-#endif
-#ifdef HAVE_JSON_H
-#include <json.h>
-#endif
-
 
 #include <string.h>
 
+#include "ical_conv.h"
+#include "ical_index.h"
+#include "ical_recur.h"
+#include "ical_tz.h"
+#include "ical_zoneinfo.h"
+
 module AP_MODULE_DECLARE_DATA ical_module;
 
 
 #define DEFAULT_ICAL_FILTER AP_ICAL_FILTER_NEXT
 #define DEFAULT_ICAL_FORMAT AP_ICAL_FORMAT_NONE
+#define DEFAULT_ICAL_FLUSH_SIZE (64 * 1024)
+
+/* maximum number of calendar variants cached per process */
+#define ICAL_CACHE_MAX 64
+
+/* maximum number of parsed calendars cached per process, counting each
+ * timezone converted to separately.
+ */
+#define ICAL_VARIANT_MAX 32
+
+/* most free memory kept by each thread for the next request */
+#define ICAL_THREAD_MAX_FREE (1024 * 1024)
+
+typedef struct ical_cache_entry {
+    apr_pool_t *pool; /* fragments live here, destroyed when unused */
+    const char *key; /* file, version and rendering of the calendar */
+    const char *filename; /* file rendered */
+    apr_time_t mtime; /* modification time of the file rendered */
+    apr_off_t size; /* size of the file rendered */
+    apr_time_t used; /* last time the entry was used */
+    int outputs; /* outputs rendered together on each miss */
+    apr_hash_t *frames; /* rendered heads and tails of each calendar */
+    apr_hash_t *fragments; /* rendered components of each calendar */
+    apr_uint32_t refcount; /* number of requests using this entry */
+    int stale; /* entry is no longer in the cache */
+} ical_cache_entry;
+
+/* calendars parsed from a file and converted to a timezone, cloned for
+ * each request so that they can be filtered.
+ */
+typedef struct ical_variant {
+    apr_pool_t *pool; /* calendars are freed when destroyed */
+    const char *key; /* file, version and timezone of the calendars */
+    const char *filename; /* file parsed */
+    apr_time_t mtime; /* modification time of the file parsed */
+    apr_off_t size; /* size of the file parsed */
+    apr_time_t used; /* last time the variant was used */
+    apr_array_header_t *comps; /* calendars in the file, never changed */
+    struct ical_variant *base; /* calendars as parsed, held while this
+                                * variant converted from them lives */
+    apr_uint32_t refcount; /* number of requests and variants using this */
+    int stale; /* variant is no longer in the cache */
+} ical_variant;
+
+typedef struct ical_cache {
+    apr_pool_t *pool;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+    apr_hash_t *entries;
+    apr_hash_t *variants;
+} ical_cache;
 
-#define XCAL_HEADER "<?xml version=\"1.0\" encoding=\"utf-8\"?>" \
-  "<icalendar xmlns=\"urn:ietf:params:xml:ns:icalendar-2.0\">"
-#define XCAL_FOOTER "</icalendar>"
-
-typedef enum {
-    AP_ICAL_FILTER_NONE,
-    AP_ICAL_FILTER_NEXT,
-    AP_ICAL_FILTER_LAST,
-    AP_ICAL_FILTER_FUTURE,
-    AP_ICAL_FILTER_PAST,
-    AP_ICAL_FILTER_UNKNOWN
-} ap_ical_filter_e;
-
-typedef enum {
-    AP_ICAL_FORMAT_NONE,
-    AP_ICAL_FORMAT_SPACED,
-    AP_ICAL_FORMAT_PRETTY,
-    AP_ICAL_FORMAT_UNKNOWN
-} ap_ical_format_e;
-
-typedef enum {
-    AP_ICAL_OUTPUT_NEGOTIATED,
-    AP_ICAL_OUTPUT_ICAL,
-    AP_ICAL_OUTPUT_XCAL,
-    AP_ICAL_OUTPUT_JCAL
-} ap_ical_output_e;
+/* key of a fragment: the calendar within the response, and the position
+ * of the component within the calendar as originally parsed.
+ */
+typedef struct ical_cache_key {
+    apr_uint32_t calendar;
+    apr_uint32_t component;
+} ical_cache_key;
+
+static ical_cache *cache;
+
+/* state kept by each thread from one request to the next */
+typedef struct ical_thread {
+    apr_pool_t *pool; /* parent of scratch pools, keeps freed memory */
+    icalparser *parser; /* parser left clean by the last request, or NULL */
+} ical_thread;
+
+#if APR_HAS_THREADS
+static apr_threadkey_t *thread_key;
+#else
+static ical_thread *thread_single;
+#endif
 
 typedef struct ical_ctx {
-    apr_bucket_brigade *bb;
+    ical_conv conv;
     apr_bucket_brigade *tmp;
+    apr_pool_t *scratch; /* holds the current line, cleared for each line */
+    ical_thread *thread;
     icalparser *parser;
-    icaltimezone *tz;
-    const char *uid;
+    const ical_index_header *index;
+    apr_array_header_t *selected;
+    ical_cache_entry *cache;
+    ical_variant *variant; /* calendars to clone instead of parsing */
+    apr_array_header_t *parsed; /* calendars as parsed, to be cached */
+    apr_array_header_t *converted; /* calendars converted, to be cached */
+    apr_uint32_t calendars;
+    ap_ical_utf8_e utf8;
     int seen_eol;
     int eat_crlf;
     int seen_eos;
-    ap_ical_output_e output;
-    ap_ical_filter_e filter;
-    ap_ical_format_e format;
+    int rejected;
 } ical_ctx;
 
+typedef struct ical_server_conf {
+    apr_array_header_t *preload; /* locations of timezones to load at start */
+    int preload_all; /* load every builtin timezone at start */
+    const char *zoneinfo; /* directory of TZif files, or NULL for libical */
+} ical_server_conf;
+
 typedef struct ical_conf {
     unsigned int timezone_set:1; /* has timezone been set */
     unsigned int filter_set:1; /* has filtering been set */
     unsigned int format_set:1; /* has formatting been set */
     unsigned int uid_set:1; /* has formatting been set */
+    unsigned int index_set:1; /* has index been set */
+    unsigned int cache_set:1; /* has cache been set */
+    unsigned int flush_size_set:1; /* has flush size been set */
+    unsigned int utf8_set:1; /* has utf8 policy been set */
+    unsigned int recur_budget_set:1; /* has recurrence budget been set */
     icaltimezone *timezone; /* override the timezone */
     ap_ical_filter_e filter; /* type of filtering */
     ap_expr_info_t *uid; /* override the uid */
     ap_ical_format_e format; /* type of formatting */
+    int index; /* use precompiled indexes */
+    int cache; /* cache rendered components */
+    apr_size_t flush_size; /* pass on the response every flush_size bytes */
+    ap_ical_utf8_e utf8; /* handling of invalid UTF-8 */
+    apr_size_t recur_budget; /* most occurrences expanded per request */
 } ical_conf;
 
 static apr_status_t icalparser_cleanup(void *data)
@@ -122,1993 +190,1128 @@ static apr_status_t icalparser_cleanup(void *data)
     return APR_SUCCESS;
 }
 
-static apr_status_t jsonbuffer_cleanup(void *data)
-{
-    json_object *buf = data;
-    json_object_put(buf);
-    return APR_SUCCESS;
-}
-
-static apr_status_t xmlbuffer_cleanup(void *data)
+static apr_status_t icalcomponent_cleanup(void *data)
 {
-    xmlBufferPtr buf = data;
-    xmlBufferFree(buf);
+    icalcomponent *comp = data;
+    icalcomponent_free(comp);
     return APR_SUCCESS;
 }
 
-static apr_status_t xmlwriter_cleanup(void *data)
+static apr_status_t scratch_cleanup(void *data)
 {
-    xmlTextWriterPtr writer = data;
-    xmlFreeTextWriter(writer);
+    apr_pool_t *scratch = data;
+    apr_pool_destroy(scratch);
     return APR_SUCCESS;
 }
 
-static char *strlwr(char *str)
+#if APR_HAS_THREADS
+static void thread_destroy(void *data)
 {
-    apr_size_t i;
-    apr_size_t len;
-
-    if (str) {
-        len = strlen(str);
-
-        for (i = 0; i < len; i++)
-            str[i] = apr_tolower((unsigned char) str[i]);
+    ical_thread *thread = data;
 
+    if (thread->parser) {
+        icalparser_free(thread->parser);
     }
-
-    return str;
+    apr_pool_destroy(thread->pool);
 }
+#endif
 
-#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP
-static const char *icalrecur_weekday_to_string(icalrecurrencetype_weekday kind)
+static ical_thread *thread_create(void)
 {
-    switch (kind) {
-    case ICAL_SUNDAY_WEEKDAY: {
-        return "SU";
-    }
-    case ICAL_MONDAY_WEEKDAY: {
-        return "MO";
-    }
-    case ICAL_TUESDAY_WEEKDAY: {
-        return "TU";
-    }
-    case ICAL_WEDNESDAY_WEEKDAY: {
-        return "WE";
-    }
-    case ICAL_THURSDAY_WEEKDAY: {
-        return "TH";
-    }
-    case ICAL_FRIDAY_WEEKDAY: {
-        return "FR";
-    }
-    case ICAL_SATURDAY_WEEKDAY: {
-        return "SA";
+    apr_allocator_t *allocator;
+    apr_pool_t *pool;
+    ical_thread *thread;
+#if APR_HAS_THREADS
+    apr_thread_mutex_t *mutex;
+#endif
+
+    if (apr_allocator_create(&allocator) != APR_SUCCESS) {
+        return NULL;
     }
-    default: {
-        return "UNKNOWN";
+    apr_allocator_max_free_set(allocator, ICAL_THREAD_MAX_FREE);
+
+    if (apr_pool_create_unmanaged_ex(&pool, NULL, allocator) != APR_SUCCESS) {
+        apr_allocator_destroy(allocator);
+        return NULL;
     }
+    apr_allocator_owner_set(allocator, pool);
+
+#if APR_HAS_THREADS
+    /* the request pool, and so our scratch pools, may be destroyed by
+     * another thread once the response is written.
+     */
+    if (apr_thread_mutex_create(&mutex, APR_THREAD_MUTEX_DEFAULT,
+            pool) != APR_SUCCESS) {
+        apr_pool_destroy(pool);
+        return NULL;
     }
-}
+    apr_allocator_mutex_set(allocator, mutex);
 #endif
 
-#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP || !HAVE_ICALRECURRENCETYPE_MONTH_MONTH
-#define ICAL_LEAP_MONTH 0x1000
-#endif
+    thread = apr_pcalloc(pool, sizeof(ical_thread));
+    thread->pool = pool;
 
-#if !HAVE_ICALRECURRENCETYPE_MONTH_IS_LEAP
-static int icalrecurrencetype_month_is_leap(short month)
-{
-    return (month & ICAL_LEAP_MONTH);
+    return thread;
 }
-#endif
 
-#if !HAVE_ICALRECURRENCETYPE_MONTH_MONTH
-static int icalrecurrencetype_month_month(short month)
+static ical_thread *thread_get(void)
 {
-    return (month & ~ICAL_LEAP_MONTH);
-}
-#endif
+#if APR_HAS_THREADS
+    ical_thread *thread = NULL;
 
-static apr_status_t icalduration_to_json(const char *element,
-        struct icaldurationtype duration, json_object *jarray)
-{
-    apr_status_t rv = APR_SUCCESS;
+    if (!thread_key) {
+        return NULL;
+    }
 
-    /* write duration element */
-    {
-        char *str = icaldurationtype_as_ical_string_r(duration);
-        json_object_array_add(jarray, json_object_new_string(str));
-        icalmemory_free_buffer(str);
+    apr_threadkey_private_get((void **) &thread, thread_key);
+    if (!thread) {
+        thread = thread_create();
+        if (thread && apr_threadkey_private_set(thread,
+                thread_key) != APR_SUCCESS) {
+            thread_destroy(thread);
+            thread = NULL;
+        }
     }
 
-    return rv;
+    return thread;
+#else
+    return thread_single;
+#endif
 }
 
-static apr_status_t icalduration_to_xml(const char *element,
-        struct icaldurationtype duration, xmlTextWriterPtr writer)
+/* take the parser left by the last request on this thread, if any */
+static icalparser *thread_parser(ical_thread *thread)
 {
-    apr_status_t rv = APR_SUCCESS;
+    icalparser *parser;
 
-    /* write duration element */
-    {
-        char *str = icaldurationtype_as_ical_string_r(duration);
-        xmlTextWriterWriteFormatElement(writer,
-                BAD_CAST element, "%s", str);
-        icalmemory_free_buffer(str);
+    if (thread && thread->parser) {
+        parser = thread->parser;
+        thread->parser = NULL;
+        return parser;
     }
 
-    return rv;
+    return icalparser_new();
 }
 
-static apr_status_t icaltime_to_json(ap_filter_t *f, const char *element,
-        struct icaltimetype tt, json_object *jarray)
+/* keep a parser for the next request if it finished cleanly */
+static void thread_parser_release(ical_thread *thread, icalparser *parser)
 {
-    apr_status_t rv = APR_SUCCESS;
-
-    if (tt.is_date) {
-        json_object_array_add(jarray,
-                json_object_new_string(
-                        apr_psprintf(f->r->pool, "%04d-%02d-%02d", tt.year,
-                                tt.month, tt.day)));
+    if (thread && !thread->parser
+            && icalparser_get_state(parser) == ICALPARSER_SUCCESS) {
+        thread->parser = parser;
     }
     else {
-        json_object_array_add(jarray,
-                json_object_new_string(
-                        apr_psprintf(f->r->pool,
-                                "%04d-%02d-%02dT%02d:%02d:%02d", tt.year,
-                                tt.month, tt.day, tt.hour, tt.minute,
-                                tt.second)));
+        icalparser_free(parser);
     }
-
-    return rv;
 }
 
-static apr_status_t icaltime_to_xml(const char *element, struct icaltimetype tt,
-        xmlTextWriterPtr writer)
+/*
+ * Is the calendar the unchanged contents of the file? Only then can it be
+ * replaced by an index of the file, or by what was cached from the file,
+ * rather than the output of a script, or of a filter that ran before us.
+ */
+static int ical_from_file(ap_filter_t *f)
 {
-    apr_status_t rv = APR_SUCCESS;
-    int rc;
+    request_rec *r = f->r;
+    ap_filter_t *prev;
 
-    if (tt.is_date) {
-        rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element, "%04d-%02d-%02d", tt.year,
-                tt.month, tt.day);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    if (!r->filename || r->finfo.filetype != APR_REG) {
+        return 0;
     }
-    else {
-        rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                "%04d-%02d-%02dT%02d:%02d:%02d", tt.year, tt.month, tt.day,
-                tt.hour, tt.minute, tt.second);
-        if (rc < 0) {
-            return APR_EGENERAL;
+
+    /* files are served by the default handler, which is named after the
+     * content type when no other handler was set.
+     */
+    if (r->handler && strcmp(r->handler, AP_DEFAULT_HANDLER_NAME)
+            && (!r->content_type || strcmp(r->handler,
+                    ap_field_noparam(r->pool, r->content_type)))) {
+        return 0;
+    }
+
+    for (prev = r->output_filters; prev && prev != f; prev = prev->next) {
+        if (prev->frec->ftype < AP_FTYPE_PROTOCOL) {
+            return 0;
         }
     }
 
-    return rv;
+    return 1;
 }
 
-static apr_status_t icalrecurrence_byday_to_json(ap_filter_t *f,
-        const char *element, short *array, short limit, json_object *jobj)
+static apr_status_t index_open(ap_filter_t *f)
 {
-    int i;
-
-    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
-
-        json_object *jarray = json_object_new_array();
-        json_object_object_add(jobj, element, jarray);
-
-        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+    request_rec *r = f->r;
+    ical_ctx *ctx = f->ctx;
+    const ical_index_header *header;
+    const char *filename;
+    apr_file_t *file;
+    apr_finfo_t finfo;
+    apr_mmap_t *mm;
+    apr_uint64_t size = 0;
+    apr_status_t rv;
 
-            int pos = icalrecurrencetype_day_position(array[i]);
-            int dow = icalrecurrencetype_day_day_of_week(array[i]);
-            const char *daystr = icalrecur_weekday_to_string(dow);
+    /* only calendars served from a file can have an index */
+    if (!ical_from_file(f)) {
+        return APR_ENOENT;
+    }
 
-            if (pos == 0) {
+    filename = apr_pstrcat(r->pool, r->filename, ICAL_INDEX_SUFFIX, NULL);
 
-                json_object_array_add(jarray,
-                        json_object_new_string(
-                                apr_psprintf(f->r->pool, "%s", daystr)));
+    rv = apr_file_open(&file, filename, APR_FOPEN_READ | APR_FOPEN_BINARY,
+            APR_FPROT_OS_DEFAULT, r->pool);
+    if (rv != APR_SUCCESS) {
+        return rv;
+    }
 
-            }
-            else {
+    rv = apr_file_info_get(&finfo, APR_FINFO_SIZE, file);
+    if (rv == APR_SUCCESS && finfo.size < 0) {
+        rv = APR_EGENERAL;
+    }
+    if (rv == APR_SUCCESS) {
+        size = (apr_uint64_t) finfo.size;
+        if (size < sizeof(ical_index_header)) {
+            rv = APR_EGENERAL;
+        }
+    }
+    if (rv == APR_SUCCESS) {
+        rv = apr_mmap_create(&mm, file, 0, (apr_size_t) size,
+                APR_MMAP_READ, r->pool);
+    }
+    apr_file_close(file);
+    if (rv != APR_SUCCESS) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, rv, r,
+                "could not map index '%s', index ignored", filename);
+        return rv;
+    }
 
-                json_object_array_add(jarray,
-                        json_object_new_string(
-                                apr_psprintf(f->r->pool, "%d%s", pos, daystr)));
+    /* sanity check the layout */
+    header = mm->mm;
+    if (memcmp(header->magic, ICAL_INDEX_MAGIC, sizeof(ICAL_INDEX_MAGIC))
+            || header->version != ICAL_INDEX_VERSION
+            || header->byteorder != ICAL_INDEX_BYTEORDER
+            || !header->buckets
+            || (header->buckets & (header->buckets - 1))
+            || header->entries + (apr_uint64_t) header->count
+                    * sizeof(ical_index_entry) > size
+            || header->order + (apr_uint64_t) header->count
+                    * sizeof(apr_uint32_t) > size
+            || header->uids + (apr_uint64_t) header->buckets
+                    * sizeof(apr_uint32_t) > size
+            || header->arena + header->arena_len > size
+            || header->prologue + header->prologue_len > size
+            || header->prologue_split > header->prologue_len) {
+        ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, r,
+                "index '%s' is not a valid index, index ignored", filename);
+        return APR_EGENERAL;
+    }
 
-            }
+    /* stale? */
+    if (header->source_size != (apr_uint64_t) r->finfo.size
+            || header->source_mtime != r->finfo.mtime) {
+        ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                "index '%s' does not match '%s', index ignored", filename,
+                r->filename);
+        return APR_EGENERAL;
+    }
 
-        }
+    ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+            "using index '%s'", filename);
 
-    }
+    ctx->index = header;
 
     return APR_SUCCESS;
 }
 
-static apr_status_t icalrecurrence_byday_to_xml(const char *element,
-        short *array, short limit, xmlTextWriterPtr writer)
+static apr_uint32_t index_search(const ical_index_header *header,
+        apr_int64_t end, int after)
 {
-    int i, rc;
-
-    for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
-
-        int pos = icalrecurrencetype_day_position(array[i]);
-        int dow = icalrecurrencetype_day_day_of_week(array[i]);
-        const char *daystr = icalrecur_weekday_to_string(dow);
-
-        if (pos == 0) {
-            rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                    "%s", daystr);
+    const char *base = (const char *) header;
+    const ical_index_entry *entries =
+            (const ical_index_entry *) (base + header->entries);
+    const apr_uint32_t *order = (const apr_uint32_t *) (base + header->order);
+    apr_uint32_t low = 0, high = header->count;
+
+    /* first position whose end is at or after (after = 0), or strictly
+     * after (after = 1) the given time
+     */
+    while (low < high) {
+        apr_uint32_t mid = low + (high - low) / 2;
+        apr_int64_t candidate = entries[order[mid] % header->count].end;
+
+        if (candidate < end || (after && candidate == end)) {
+            low = mid + 1;
         }
         else {
-            rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                    "%d%s", pos, daystr);
+            high = mid;
         }
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
     }
 
-    return APR_SUCCESS;
+    return low;
 }
 
-static apr_status_t icalrecurrence_bymonth_to_json(ap_filter_t *f,
-        const char *element, short *array, short limit, json_object *jobj)
+static icalcomponent *index_component(ap_filter_t *f)
 {
-    int i;
+    ical_ctx *ctx = f->ctx;
+    const ical_index_header *header = ctx->index;
+    const char *base = (const char *) header;
+    const ical_index_entry *entries =
+            (const ical_index_entry *) (base + header->entries);
+    const apr_uint32_t *order = (const apr_uint32_t *) (base + header->order);
+    const apr_uint32_t *uids = (const apr_uint32_t *) (base + header->uids);
+    const char *arena = base + header->arena;
+    const char *prologue = base + header->prologue;
+    apr_int64_t now = apr_time_sec(apr_time_now());
+    apr_uint32_t i, first = 0, last = header->count;
+    apr_size_t total;
+    char *selected, *buffer, *pos;
 
-    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+    selected = apr_pcalloc(f->r->pool, header->count + 1);
 
-        json_object *jarray = json_object_new_array();
-        json_object_object_add(jobj, element, jarray);
+    /* uid match? short circuit everything */
+    if (ctx->conv.uid && ctx->conv.uid[0]) {
+        apr_size_t len = strlen(ctx->conv.uid);
+        apr_uint32_t next;
 
-        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+        next = uids[ical_index_hash(ctx->conv.uid, len)
+                & (header->buckets - 1)];
+        for (i = 0; next && next <= header->count && i < header->count; i++) {
+            const ical_index_entry *e = &entries[next - 1];
 
-            /* rfc7529 introduces the leap month */
-            if (icalrecurrencetype_month_is_leap(array[i])) {
+            if (e->uid_len == len && e->uid + len <= header->arena_len
+                    && !strncasecmp(arena + e->uid, ctx->conv.uid, len)) {
+                selected[next - 1] = 1;
+            }
 
-                json_object_array_add(jarray,
-                        json_object_new_string(
-                                apr_psprintf(f->r->pool, "%dL",
-                                        icalrecurrencetype_month_month(
-                                                array[i]))));
+            next = e->uid_next;
+        }
 
-            }
-            else {
+    }
 
-                json_object_array_add(jarray,
-                        json_object_new_int(
-                                (int32_t) icalrecurrencetype_month_month(
-                                        array[i])));
+    /* otherwise narrow down the time index to the components that could
+     * pass the filter, the filter makes the final decision.
+     */
+    else {
 
-            }
+        switch (ctx->conv.filter) {
+        case AP_ICAL_FILTER_NEXT: {
+            apr_uint32_t definite;
 
-        }
+            first = index_search(header, now - ICAL_INDEX_SLACK, 0);
 
-    }
+            /* nothing ending after a definitely future entry can be next,
+             * recurring entries may have occurrences before their end.
+             */
+            definite = index_search(header, now + ICAL_INDEX_SLACK, 0);
+            while (definite < header->count
+                    && entries[order[definite] % header->count].flags
+                            & ICAL_INDEX_RECURS) {
+                definite++;
+            }
+            if (definite < header->count) {
+                last = index_search(header,
+                        entries[order[definite] % header->count].end
+                                + 2 * ICAL_INDEX_SLACK, 1);
+            }
 
-    return APR_SUCCESS;
-}
+            break;
+        }
+        case AP_ICAL_FILTER_LAST: {
+            apr_uint32_t definite;
 
-static apr_status_t icalrecurrence_bymonth_to_xml(const char *element,
-        short *array, short limit, xmlTextWriterPtr writer)
-{
-    int i, rc;
+            last = index_search(header, now + ICAL_INDEX_SLACK, 1);
 
-    for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+            /* nothing ending before a definitely past entry can be last,
+             * recurring entries may have occurrences after their end.
+             */
+            definite = index_search(header, now - ICAL_INDEX_SLACK, 1);
+            while (definite > 0
+                    && entries[order[definite - 1] % header->count].flags
+                            & ICAL_INDEX_RECURS) {
+                definite--;
+            }
+            if (definite > 0) {
+                first = index_search(header,
+                        entries[order[definite - 1] % header->count].end
+                                - 2 * ICAL_INDEX_SLACK, 0);
+            }
 
-        if (icalrecurrencetype_month_is_leap(array[i])) {
-            rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                    "%dL", icalrecurrencetype_month_month(array[i]));
+            break;
         }
-        else {
-            rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                    "%d", array[i]);
+        case AP_ICAL_FILTER_FUTURE: {
+            first = index_search(header, now - ICAL_INDEX_SLACK, 0);
+            break;
+        }
+        case AP_ICAL_FILTER_PAST: {
+            last = index_search(header, now + ICAL_INDEX_SLACK, 1);
+            break;
+        }
+        default: {
+            /* none, passthrough */
+            break;
         }
-        if (rc < 0) {
-            return APR_EGENERAL;
         }
 
-    }
-
-    return APR_SUCCESS;
-}
-
-static apr_status_t icalrecurrence_by_to_json(const char *element, short *array,
-        short limit, json_object *jobj)
-{
-    int i;
+        for (i = first; i < last; i++) {
+            selected[order[i] % header->count] = 1;
+        }
 
-    if (array[0] != ICAL_RECURRENCE_ARRAY_MAX) {
+        /* recurring entries are expanded by the filter */
+        for (i = 0; i < header->count; i++) {
+            if (entries[i].flags & ICAL_INDEX_RECURS) {
+                selected[i] = 1;
+            }
+        }
 
-        json_object *jarray = json_object_new_array();
-        json_object_object_add(jobj, element, jarray);
+    }
 
-        for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+    /* reassemble the calendar from the prologue and the selected
+     * components, in source order
+     */
+    total = header->prologue_len;
+    for (i = 0; i < header->count; i++) {
+        if (selected[i]) {
+            if (entries[i].ical + entries[i].ical_len > header->arena_len) {
+                ap_log_rerror(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, f->r,
+                        "index for '%s' is corrupt, component %u ignored",
+                        f->r->filename, i);
+                selected[i] = 0;
+                continue;
+            }
+            total += entries[i].ical_len;
+        }
+    }
 
-            json_object_array_add(jarray,
-                    json_object_new_int((int32_t) array[i]));
+    /* remember which components we parsed, to identify them later */
+    ctx->selected = apr_array_make(f->r->pool, 16, sizeof(apr_uint32_t));
 
+    pos = buffer = apr_palloc(f->r->pool, total + 1);
+    memcpy(pos, prologue, header->prologue_split);
+    pos += header->prologue_split;
+    for (i = 0; i < header->count; i++) {
+        if (selected[i]) {
+            memcpy(pos, arena + entries[i].ical, entries[i].ical_len);
+            pos += entries[i].ical_len;
+            APR_ARRAY_PUSH(ctx->selected, apr_uint32_t) = i;
         }
-
     }
+    memcpy(pos, prologue + header->prologue_split,
+            header->prologue_len - header->prologue_split);
+    pos += header->prologue_len - header->prologue_split;
+    *pos = 0;
 
-    return APR_SUCCESS;
+    return icalparser_parse_string(buffer);
 }
 
-static apr_status_t icalrecurrence_by_to_xml(const char *element, short *array,
-        short limit, xmlTextWriterPtr writer)
+static void cache_lock(void)
 {
-    int i, rc;
-
-    for (i = 0; i < limit && array[i] != ICAL_RECURRENCE_ARRAY_MAX; i++) {
+#if APR_HAS_THREADS
+    apr_thread_mutex_lock(cache->mutex);
+#endif
+}
 
-        rc = xmlTextWriterWriteFormatElement(writer, BAD_CAST element,
-                "%d", array[i]);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+static void cache_unlock(void)
+{
+#if APR_HAS_THREADS
+    apr_thread_mutex_unlock(cache->mutex);
+#endif
+}
 
+/* call with the cache locked */
+static void cache_evict(ical_cache_entry *entry)
+{
+    apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, NULL);
+    entry->stale = 1;
+    if (!entry->refcount) {
+        apr_pool_destroy(entry->pool);
     }
-
-    return APR_SUCCESS;
 }
 
-static apr_status_t icalrecurrencetype_to_json(ap_filter_t *f,
-        struct icalrecurrencetype *recur, json_object *jarray)
+static apr_status_t cache_release(void *data)
 {
-    apr_status_t rv = APR_SUCCESS;
-    int rc;
+    ical_cache_entry *entry = data;
 
-    json_object *jobj = json_object_new_object();
-    json_object_array_add(jarray, jobj);
-
-    if (recur->freq != ICAL_NO_RECURRENCE) {
+    cache_lock();
+    entry->refcount--;
+    if (entry->stale && !entry->refcount) {
+        apr_pool_destroy(entry->pool);
+    }
+    cache_unlock();
 
-        if (recur->until.year != 0) {
+    return APR_SUCCESS;
+}
 
-            if (recur->until.is_date) {
-                json_object_object_add(jobj, "until",
-                        json_object_new_string(
-                                apr_psprintf(f->r->pool, "%04d-%02d-%02d",
-                                        recur->until.year, recur->until.month,
-                                        recur->until.day)));
+static apr_status_t cache_open(ap_filter_t *f)
+{
+    request_rec *r = f->r;
+    ical_ctx *ctx = f->ctx;
+    ical_cache_entry *entry, *oldest;
+    apr_hash_index_t *hi;
+    const char *key;
+    apr_pool_t *pool;
+
+    /* only calendars served from a file can be cached */
+    if (!cache || !ical_from_file(f)) {
+        return APR_ENOENT;
+    }
+
+    /* formatted xCal and jCal depend on nesting, and cannot be cached */
+    if (ctx->conv.output != AP_ICAL_OUTPUT_ICAL
+            && ctx->conv.format != AP_ICAL_FORMAT_NONE) {
+        return APR_ENOTIMPL;
+    }
+
+    /* each output is rendered on the same miss, and shares the entry */
+    key = apr_psprintf(r->pool,
+            "%s|%" APR_TIME_T_FMT "|%" APR_OFF_T_FMT "|%d|%d|%s|%d",
+            r->filename, r->finfo.mtime, r->finfo.size, ctx->utf8,
+            ctx->conv.format,
+            ctx->conv.tz ? icaltimezone_get_tzid(ctx->conv.tz) : "",
+            ctx->index != NULL);
+
+    cache_lock();
+
+    entry = apr_hash_get(cache->entries, key, APR_HASH_KEY_STRING);
+    if (!entry) {
+
+        /* throw away older versions of this file, and make room */
+        do {
+            oldest = NULL;
+            for (hi = apr_hash_first(NULL, cache->entries); hi;
+                    hi = apr_hash_next(hi)) {
+                ical_cache_entry *e;
+                void *val;
+
+                apr_hash_this(hi, NULL, NULL, &val);
+                e = val;
+
+                if (!strcmp(e->filename, r->filename)
+                        && (e->mtime != r->finfo.mtime
+                                || e->size != r->finfo.size)) {
+                    cache_evict(e);
+                }
+                else if (!oldest || e->used < oldest->used) {
+                    oldest = e;
+                }
             }
-            else {
-                json_object_object_add(jobj, "until",
-                        json_object_new_string(
-                                apr_psprintf(f->r->pool,
-                                        "%04d-%02d-%02dT%02d:%02d:%02d",
-                                        recur->until.year, recur->until.month,
-                                        recur->until.day, recur->until.hour,
-                                        recur->until.minute,
-                                        recur->until.second)));
+            if (oldest && apr_hash_count(cache->entries) >= ICAL_CACHE_MAX) {
+                cache_evict(oldest);
             }
+        } while (apr_hash_count(cache->entries) >= ICAL_CACHE_MAX);
 
+        if (apr_pool_create(&pool, cache->pool) != APR_SUCCESS) {
+            cache_unlock();
+            return APR_ENOMEM;
         }
 
-        if (recur->count != 0) {
+        entry = apr_pcalloc(pool, sizeof(ical_cache_entry));
+        entry->pool = pool;
+        entry->key = apr_pstrdup(pool, key);
+        entry->filename = apr_pstrdup(pool, r->filename);
+        entry->mtime = r->finfo.mtime;
+        entry->size = r->finfo.size;
+        entry->outputs = ctx->conv.format == AP_ICAL_FORMAT_NONE ?
+                ICAL_OUTPUT_ALL : ICAL_OUTPUT_BIT(AP_ICAL_OUTPUT_ICAL);
+        entry->frames = apr_hash_make(pool);
+        entry->fragments = apr_hash_make(pool);
 
-            json_object_object_add(jobj, "count",
-                    json_object_new_int((int32_t) recur->count));
+        apr_hash_set(cache->entries, entry->key, APR_HASH_KEY_STRING, entry);
+    }
 
-        }
+    entry->refcount++;
+    entry->used = apr_time_now();
 
-        if (recur->interval != 1) {
+    cache_unlock();
 
-            json_object_object_add(jobj, "interval",
-                    json_object_new_int((int32_t) recur->interval));
+    /* fragments are passed down the filter stack as immortal buckets, the
+     * entry must outlive the request.
+     */
+    apr_pool_cleanup_register(r->pool, entry, cache_release,
+            apr_pool_cleanup_null);
 
-        }
+    ctx->cache = entry;
 
-        rc = icalrecurrence_by_to_json("bysecond", recur->by_second,
-                ICAL_BY_SECOND_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    return APR_SUCCESS;
+}
 
-        rc = icalrecurrence_by_to_json("byminute", recur->by_minute,
-                ICAL_BY_MINUTE_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+/* number the subcomponents once converted, before they are filtered */
+static apr_hash_t *cache_number(ap_filter_t *f, icalcomponent *comp)
+{
+    ical_ctx *ctx = f->ctx;
+    apr_hash_t *numbers = apr_hash_make(f->r->pool);
+    icalcomponent *scomp;
+    apr_uint32_t i = 0, prologue = 0;
 
-        rc = icalrecurrence_by_to_json("byhour", recur->by_hour,
-                ICAL_BY_HOUR_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    /* components from an index follow the components of the prologue, and
+     * are numbered by their position in the index.
+     */
+    if (ctx->index && ctx->selected) {
+        prologue = icalcomponent_count_components(comp, ICAL_ANY_COMPONENT)
+                - ctx->selected->nelts;
+    }
 
-        rc = icalrecurrence_byday_to_json(f, "byday", recur->by_day, ICAL_BY_DAY_SIZE,
-                jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    for (scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
+            scomp;
+            scomp = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT),
+            i++) {
+        icalcomponent **key = apr_pmemdup(f->r->pool, &scomp, sizeof(scomp));
+        apr_uint32_t *number = apr_palloc(f->r->pool, sizeof(apr_uint32_t));
 
-        rc = icalrecurrence_by_to_json("bymonthday", recur->by_month_day,
-                ICAL_BY_MONTHDAY_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
+        if (ctx->index && ctx->selected && i >= prologue) {
+            *number = prologue
+                    + APR_ARRAY_IDX(ctx->selected, i - prologue, apr_uint32_t);
         }
-
-        rc = icalrecurrence_by_to_json("byyearday", recur->by_year_day,
-                ICAL_BY_YEARDAY_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
+        else {
+            *number = i;
         }
 
-        rc = icalrecurrence_by_to_json("byweekno", recur->by_week_no,
-                ICAL_BY_WEEKNO_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+        apr_hash_set(numbers, key, sizeof(scomp), number);
+    }
+
+    return numbers;
+}
+
+static ical_fragment *cache_keep(ical_conv *conv, apr_pool_t *pool,
+        const ical_fragment *frags, int count)
+{
+    ical_fragment *keep = apr_pcalloc(pool, count * sizeof(ical_fragment));
+    int i;
 
-        rc = icalrecurrence_bymonth_to_json(f, "bymonth", recur->by_month,
-                ICAL_BY_MONTH_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
+    for (i = 0; i < count; i++) {
+        if (frags[i].data) {
+            keep[i].data = apr_pmemdup(pool, frags[i].data, frags[i].len);
+            keep[i].len = frags[i].len;
+            conv->stats.allocs++;
+            conv->stats.alloc_bytes += frags[i].len;
+            conv->stats.copies++;
+            conv->stats.copy_bytes += frags[i].len;
         }
+    }
+
+    return keep;
+}
 
-        rc = icalrecurrence_by_to_json("bysetpos", recur->by_set_pos,
-                ICAL_BY_SETPOS_SIZE, jobj);
-        if (rc < 0) {
-            return APR_EGENERAL;
+static apr_status_t cache_write(ap_filter_t *f, icalcomponent *comp,
+        apr_uint32_t calendar, apr_hash_t *numbers)
+{
+    ical_ctx *ctx = f->ctx;
+    ical_cache_entry *entry = ctx->cache;
+    ap_ical_output_e output = ctx->conv.output;
+    ical_fragment *frame, **frags, **rendered, **chosen;
+    ical_cache_key *keys;
+    icalcomponent *scomp;
+    char *numbered;
+    apr_status_t rv;
+    int count, i, fresh = 0;
+
+    /* frames are stored as all heads followed by all tails, and fragments
+     * as one per output, so that one miss fills in every output.
+     */
+    count = icalcomponent_count_components(comp, ICAL_ANY_COMPONENT);
+    frags = apr_pcalloc(f->r->pool, (count + 1) * sizeof(ical_fragment *));
+    rendered = apr_pcalloc(f->r->pool, (count + 1) * sizeof(ical_fragment *));
+    keys = apr_pcalloc(f->r->pool, (count + 1) * sizeof(ical_cache_key));
+    numbered = apr_pcalloc(f->r->pool, count + 1);
+
+    /* pick up what has already been rendered */
+    cache_lock();
+    frame = apr_hash_get(entry->frames, &calendar, sizeof(calendar));
+    for (i = 0, scomp = icalcomponent_get_first_component(comp,
+            ICAL_ANY_COMPONENT); scomp && i < count;
+            scomp = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT),
+            i++) {
+        apr_uint32_t *number = apr_hash_get(numbers, &scomp, sizeof(scomp));
+
+        if (number) {
+            numbered[i] = 1;
+            keys[i].calendar = calendar;
+            keys[i].component = *number;
+            frags[i] = apr_hash_get(entry->fragments, &keys[i],
+                    sizeof(ical_cache_key));
+        }
+    }
+    cache_unlock();
+
+    /* render what is missing, to every output at once */
+    if (!frame) {
+        ical_fragment *rframe = apr_pcalloc(f->r->pool,
+                2 * ICAL_OUTPUT_COUNT * sizeof(ical_fragment));
+
+        rv = ical_render_frame(&ctx->conv, comp, entry->outputs, rframe,
+                rframe + ICAL_OUTPUT_COUNT);
+        if (rv != APR_SUCCESS) {
+            return rv;
         }
 
-        /* Monday is the default, so no need to write that out */
-        if (recur->week_start != ICAL_MONDAY_WEEKDAY
-                && recur->week_start != ICAL_NO_WEEKDAY) {
+        frame = rframe;
+        fresh = 1;
+    }
+    for (i = 0, scomp = icalcomponent_get_first_component(comp,
+            ICAL_ANY_COMPONENT); scomp && i < count;
+            scomp = icalcomponent_get_next_component(comp, ICAL_ANY_COMPONENT),
+            i++) {
+        if (!frags[i]) {
+            rendered[i] = apr_pcalloc(f->r->pool,
+                    ICAL_OUTPUT_COUNT * sizeof(ical_fragment));
 
-            int dow = icalrecurrencetype_day_day_of_week(recur->week_start);
+            rv = ical_render_component(&ctx->conv, scomp, entry->outputs,
+                    rendered[i]);
+            if (rv != APR_SUCCESS) {
+                return rv;
+            }
 
-            json_object_object_add(jobj, "wkst",
-                    json_object_new_string(
-                            apr_psprintf(f->r->pool, "%s",
-                                    icalrecur_weekday_to_string(dow))));
+            frags[i] = rendered[i];
+        }
+    }
 
+    /* keep what we rendered for next time, unless someone beat us to it.
+     * Components added during conversion have no number, and are not kept.
+     */
+    cache_lock();
+    if (!entry->stale) {
+        if (fresh
+                && !apr_hash_get(entry->frames, &calendar, sizeof(calendar))) {
+            apr_hash_set(entry->frames,
+                    apr_pmemdup(entry->pool, &calendar, sizeof(calendar)),
+                    sizeof(calendar),
+                    cache_keep(&ctx->conv, entry->pool, frame,
+                            2 * ICAL_OUTPUT_COUNT));
         }
+        for (i = 0; i < count; i++) {
+            if (rendered[i] && numbered[i]
+                    && !apr_hash_get(entry->fragments, &keys[i],
+                            sizeof(ical_cache_key))) {
+                apr_hash_set(entry->fragments,
+                        apr_pmemdup(entry->pool, &keys[i],
+                                sizeof(ical_cache_key)),
+                        sizeof(ical_cache_key),
+                        cache_keep(&ctx->conv, entry->pool, rendered[i],
+                                ICAL_OUTPUT_COUNT));
+            }
+        }
+    }
+    cache_unlock();
 
+    /* pick out the output we were asked for */
+    chosen = apr_pcalloc(f->r->pool, (count + 1) * sizeof(ical_fragment *));
+    for (i = 0; i < count; i++) {
+        chosen[i] = &frags[i][output];
     }
 
-    return rv;
+    return ical_write_fragments(&ctx->conv, &frame[output],
+            (const ical_fragment * const *) chosen, count,
+            &frame[ICAL_OUTPUT_COUNT + output]);
 }
 
-static apr_status_t icalrecurrencetype_to_xml(ap_filter_t *f,
-        struct icalrecurrencetype *recur, xmlTextWriterPtr writer)
+/* call with the cache locked, letting go of the calendars as parsed too
+ * once nothing else holds them.
+ */
+static void variant_destroy(ical_variant *variant)
 {
-    apr_status_t rv = APR_SUCCESS;
-    int rc;
-
-    if (recur->freq != ICAL_NO_RECURRENCE) {
-
-        if (recur->until.year != 0) {
+    ical_variant *base = variant->base;
 
-            if (recur->until.is_date) {
-                rc = xmlTextWriterWriteFormatElement(writer,
-                        BAD_CAST "until",
-                        "%04d-%02d-%02d", recur->until.year,
-                        recur->until.month, recur->until.day);
-            }
-            else {
-                rc = xmlTextWriterWriteFormatElement(writer,
-                        BAD_CAST "until",
-                        "%04d-%02d-%02dT%02d:%02d:%02d",
-                        recur->until.year, recur->until.month,
-                        recur->until.day, recur->until.hour,
-                        recur->until.minute, recur->until.second);
-            }
+    apr_pool_destroy(variant->pool);
+    if (base && !--base->refcount && base->stale) {
+        apr_pool_destroy(base->pool);
+    }
+}
 
-        }
+/* call with the cache locked */
+static void variant_evict(ical_variant *variant)
+{
+    apr_hash_set(cache->variants, variant->key, APR_HASH_KEY_STRING, NULL);
+    variant->stale = 1;
+    if (!variant->refcount) {
+        variant_destroy(variant);
+    }
+}
 
-        if (recur->count != 0) {
+static apr_status_t variant_release(void *data)
+{
+    ical_variant *variant = data;
 
-            rc = xmlTextWriterWriteFormatElement(writer,
-                    BAD_CAST "count", "%d", recur->count);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
+    cache_lock();
+    variant->refcount--;
+    if (variant->stale && !variant->refcount) {
+        variant_destroy(variant);
+    }
+    cache_unlock();
 
-        }
+    return APR_SUCCESS;
+}
 
-        if (recur->interval != 1) {
+static const char *variant_key(ap_filter_t *f, icaltimezone *tz)
+{
+    request_rec *r = f->r;
+    ical_ctx *ctx = f->ctx;
 
-            rc = xmlTextWriterWriteFormatElement(writer,
-                    BAD_CAST "interval", "%d", recur->interval);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
+    return apr_psprintf(r->pool, "%s|%" APR_TIME_T_FMT "|%" APR_OFF_T_FMT
+            "|%d|%s", r->filename, r->finfo.mtime, r->finfo.size, ctx->utf8,
+            tz ? icaltimezone_get_tzid(tz) : "");
+}
 
-        }
+/* call with the cache locked, the variant found is held until released */
+static ical_variant *variant_find(ap_filter_t *f, icaltimezone *tz)
+{
+    ical_variant *variant = apr_hash_get(cache->variants, variant_key(f, tz),
+            APR_HASH_KEY_STRING);
 
-        rc = icalrecurrence_by_to_xml("bysecond", recur->by_second,
-                ICAL_BY_SECOND_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    if (variant) {
+        variant->refcount++;
+        variant->used = apr_time_now();
+    }
 
-        rc = icalrecurrence_by_to_xml("byminute", recur->by_minute,
-                ICAL_BY_MINUTE_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    return variant;
+}
 
-        rc = icalrecurrence_by_to_xml("byhour", recur->by_hour,
-                ICAL_BY_HOUR_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+/* call with the cache locked, the calendars are taken over by the variant,
+ * which is held until released. Calendars converted to a timezone hold the
+ * variant of the calendars as parsed, base, so that they can be filtered
+ * by the times as parsed, and are not kept without it.
+ */
+static ical_variant *variant_store(ap_filter_t *f, icaltimezone *tz,
+        apr_array_header_t *comps, ical_variant *base)
+{
+    request_rec *r = f->r;
+    ical_variant *variant, *oldest;
+    apr_hash_index_t *hi;
+    const char *key = variant_key(f, tz);
+    apr_pool_t *pool;
+    int i;
 
-        rc = icalrecurrence_byday_to_xml("byday", recur->by_day, ICAL_BY_DAY_SIZE,
-                writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
+    /* someone beat us to it? */
+    variant = apr_hash_get(cache->variants, key, APR_HASH_KEY_STRING);
+    if (variant) {
+        for (i = 0; i < comps->nelts; i++) {
+            icalcomponent_free(APR_ARRAY_IDX(comps, i, icalcomponent *));
         }
+        variant->refcount++;
+        variant->used = apr_time_now();
+        return variant;
+    }
 
-        rc = icalrecurrence_by_to_xml("bymonthday", recur->by_month_day,
-                ICAL_BY_MONTHDAY_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+    /* throw away older versions of this file, and make room */
+    do {
+        oldest = NULL;
+        for (hi = apr_hash_first(NULL, cache->variants); hi;
+                hi = apr_hash_next(hi)) {
+            ical_variant *v;
+            void *val;
 
-        rc = icalrecurrence_by_to_xml("byyearday", recur->by_year_day,
-                ICAL_BY_YEARDAY_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
+            apr_hash_this(hi, NULL, NULL, &val);
+            v = val;
 
-        rc = icalrecurrence_by_to_xml("byweekno", recur->by_week_no,
-                ICAL_BY_WEEKNO_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
+            if (!strcmp(v->filename, r->filename)
+                    && (v->mtime != r->finfo.mtime
+                            || v->size != r->finfo.size)) {
+                variant_evict(v);
+            }
+            else if (!oldest || v->used < oldest->used) {
+                oldest = v;
+            }
         }
-
-        rc = icalrecurrence_bymonth_to_xml("bymonth", recur->by_month,
-                ICAL_BY_MONTH_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
+        if (oldest && apr_hash_count(cache->variants) >= ICAL_VARIANT_MAX) {
+            variant_evict(oldest);
         }
+    } while (apr_hash_count(cache->variants) >= ICAL_VARIANT_MAX);
 
-        rc = icalrecurrence_by_to_xml("bysetpos", recur->by_set_pos,
-                ICAL_BY_SETPOS_SIZE, writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
+    if ((tz && !base) || apr_pool_create(&pool, cache->pool) != APR_SUCCESS) {
+        for (i = 0; i < comps->nelts; i++) {
+            icalcomponent_free(APR_ARRAY_IDX(comps, i, icalcomponent *));
         }
+        return NULL;
+    }
 
-        /* Monday is the default, so no need to write that out */
-        if (recur->week_start != ICAL_MONDAY_WEEKDAY &&
-            recur->week_start != ICAL_NO_WEEKDAY) {
+    variant = apr_pcalloc(pool, sizeof(ical_variant));
+    variant->pool = pool;
+    variant->key = apr_pstrdup(pool, key);
+    variant->filename = apr_pstrdup(pool, r->filename);
+    variant->mtime = r->finfo.mtime;
+    variant->size = r->finfo.size;
+    variant->comps = apr_array_copy(pool, comps);
+    for (i = 0; i < comps->nelts; i++) {
+        apr_pool_cleanup_register(pool,
+                APR_ARRAY_IDX(comps, i, icalcomponent *),
+                icalcomponent_cleanup, apr_pool_cleanup_null);
+    }
+    variant->refcount = 1;
+    variant->used = apr_time_now();
+    if (tz) {
+        variant->base = base;
+        base->refcount++;
+    }
 
-            int dow = icalrecurrencetype_day_day_of_week(
-                    recur->week_start);
+    apr_hash_set(cache->variants, variant->key, APR_HASH_KEY_STRING, variant);
 
-            rc = xmlTextWriterWriteFormatElement(writer,
-                    BAD_CAST "wkst", "%s",
-                    icalrecur_weekday_to_string(dow));
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
+    return variant;
+}
 
-        }
+/* copies of the calendars, freed with the request unless kept */
+static icalcomponent *variant_clone(ap_filter_t *f, icalcomponent *comp)
+{
+    icalcomponent *clone = icalcomponent_new_clone(comp);
 
-    }
+    apr_pool_cleanup_register(f->r->pool, clone, icalcomponent_cleanup,
+            apr_pool_cleanup_null);
 
-    return rv;
+    return clone;
 }
 
-static apr_status_t icalvalue_multi_to_json(ap_filter_t *f, icalvalue *val,
-        json_object *jarray)
+static void variant_keep(ap_filter_t *f, apr_array_header_t *comps)
 {
-    if (val) {
-        char *str = icalvalue_as_ical_string_r(val);
-
-        if (str) {
-            char *slider = str;
-
-            while (slider) {
-                const char *token = slider;
-                slider = ap_strchr(slider, ',');
-
-                if (slider) {
-                    json_object_array_add(jarray,
-                            json_object_new_string(
-                                    apr_psprintf(f->r->pool, "%.*s",
-                                            (int) (slider - token), token)));
-                    slider++;
-                }
-                else {
-                    json_object_array_add(jarray,
-                            json_object_new_string(token));
-                }
-
-            }
-
-            icalmemory_free_buffer(str);
-        }
-
-    }
-
-    return APR_SUCCESS;
-}
-
-static apr_status_t icalvalue_multi_to_xml(ap_filter_t *f,
-        icalvalue *val, xmlTextWriterPtr writer)
-{
-    int rc = 0;
-
-    if (val) {
-        char *str;
-        icalvalue_kind kind = icalvalue_isa(val);
-        char *element = NULL;
-
-        /* work out the value type */
-        if (kind != ICAL_X_VALUE) {
-            element = apr_pstrdup(f->r->pool, icalvalue_kind_to_string(kind));
-        }
-        if (element) {
-            element = strlwr(element);
-        }
-        else {
-            element = "unknown";
-        }
-
-        /* write out each value */
-        str = icalvalue_as_ical_string_r(val);
-        if (str) {
-            char *slider = str;
-
-            while (slider) {
-                const char *token = slider;
-                slider = ap_strchr(slider, ',');
-
-                if (slider) {
-                    rc = xmlTextWriterWriteFormatElement(writer,
-                            BAD_CAST element, "%.*s",
-                            (int) (slider - token), token);
-                    slider++;
-                }
-                else {
-                    rc = xmlTextWriterWriteFormatElement(writer,
-                            BAD_CAST element, "%s", token);
-                }
-
-            }
-
-            icalmemory_free_buffer(str);
-        }
-
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-    }
-
-    return APR_SUCCESS;
-}
-
-static apr_status_t icalvalue_to_json(ap_filter_t *f, icalvalue *val,
-        json_object *jarray)
-{
-    apr_status_t rv = APR_SUCCESS;
-
-    if (val) {
-
-        icalvalue_kind kind = icalvalue_isa(val);
-        char *element = NULL;
-
-        /* work out the value type */
-        if (kind != ICAL_X_VALUE) {
-            element = apr_pstrdup(f->r->pool, icalvalue_kind_to_string(kind));
-        }
-        if (element) {
-            element = strlwr(element);
-        }
-        else {
-            element = "unknown";
-        }
-
-        /* handle each type */
-        switch (kind) {
-        case ICAL_ACTION_VALUE:
-        case ICAL_ATTACH_VALUE:
-        case ICAL_BINARY_VALUE:
-        case ICAL_BOOLEAN_VALUE:
-        case ICAL_CALADDRESS_VALUE:
-        case ICAL_CARLEVEL_VALUE:
-        case ICAL_CLASS_VALUE:
-        case ICAL_CMD_VALUE:
-        case ICAL_FLOAT_VALUE:
-        case ICAL_INTEGER_VALUE:
-        case ICAL_METHOD_VALUE:
-        case ICAL_QUERY_VALUE:
-        case ICAL_QUERYLEVEL_VALUE:
-        case ICAL_STATUS_VALUE:
-        case ICAL_STRING_VALUE:
-        case ICAL_TRANSP_VALUE:
-        case ICAL_URI_VALUE:
-        case ICAL_UTCOFFSET_VALUE:
-        {
-            char *str = icalvalue_as_ical_string_r(val);
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray, json_object_new_string(str));
-            icalmemory_free_buffer(str);
-
-            break;
-        }
-        case ICAL_GEO_VALUE: {
-            struct icalgeotype geo = icalvalue_get_geo(val);
-            json_object *jvalue = json_object_new_array();
-
-            json_object_array_add(jarray, json_object_new_string("float"));
-
-            json_object_array_add(jvalue, json_object_new_double(geo.lat));
-            json_object_array_add(jvalue, json_object_new_double(geo.lon));
-
-            json_object_array_add(jarray, jvalue);
-
-            break;
-        }
-        case ICAL_TEXT_VALUE: {
-            /* we explicitly don't escape text here */
-            const char* text = icalvalue_get_text(val);
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray, json_object_new_string(text));
-
-            break;
-        }
-        case ICAL_REQUESTSTATUS_VALUE: {
-            struct icalreqstattype requeststatus = icalvalue_get_requeststatus(val);
-            json_object *jvalue = json_object_new_array();
-
-            json_object_array_add(jarray, json_object_new_string("text"));
-
-            json_object_array_add(jvalue, json_object_new_string(icalenum_reqstat_code(requeststatus.code)));
-            json_object_array_add(jvalue, json_object_new_string(requeststatus.desc));
-
-            if (requeststatus.debug) {
-                json_object_array_add(jvalue, json_object_new_string(requeststatus.debug));
-            }
-
-            json_object_array_add(jarray, jvalue);
-
-            break;
-        }
-        case ICAL_PERIOD_VALUE: {
-            struct icalperiodtype period = icalvalue_get_period(val);
-            json_object *jvalue = json_object_new_array();
-
-            json_object_array_add(jarray, json_object_new_string(element));
-
-            rv = icaltime_to_json(f, "start", period.start, jvalue);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-
-            if (!icaltime_is_null_time(period.end)) {
-                icaltime_to_json(f, "end", period.start, jvalue);
-            }
-            else {
-                icalduration_to_json("duration", period.duration, jvalue);
-            }
-
-            json_object_array_add(jarray, jvalue);
-
-            break;
-        }
-        case ICAL_DATETIMEPERIOD_VALUE: {
-            struct icaldatetimeperiodtype datetimeperiod =
-                    icalvalue_get_datetimeperiod(val);
-            json_object *jvalue = json_object_new_array();
-
-            json_object_array_add(jarray, json_object_new_string(element));
-
-            if (!icaltime_is_null_time(datetimeperiod.time)) {
-                icaltime_to_json(f, "time", datetimeperiod.time, jvalue);
-            }
-            else {
-                rv = icaltime_to_json(f, "start", datetimeperiod.period.start,
-                        jvalue);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                if (!icaltime_is_null_time(datetimeperiod.period.end)) {
-                    icaltime_to_json(f, "end", datetimeperiod.period.start, jvalue);
-                }
-                else {
-                    icalduration_to_json("duration",
-                            datetimeperiod.period.duration, jvalue);
-                }
-            }
-
-            json_object_array_add(jarray, jvalue);
-
-            break;
-        }
-        case ICAL_DURATION_VALUE: {
-            struct icaldurationtype duration = icalvalue_get_duration(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray,
-                    json_object_new_string(
-                            icaldurationtype_as_ical_string(duration)));
-
-            break;
-        }
-        case ICAL_X_VALUE: {
-            const char* x = icalvalue_get_x(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray, json_object_new_string(x));
-
-            break;
-        }
-        case ICAL_RECUR_VALUE: {
-            struct icalrecurrencetype recur = icalvalue_get_recur(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            rv = icalrecurrencetype_to_json(f, &recur, jarray);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-
-            break;
-        }
-        case ICAL_TRIGGER_VALUE: {
-            struct icaltriggertype trigger = icalvalue_get_trigger(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            if (!icaltime_is_null_time(trigger.time)) {
-                icaltime_to_json(f, "time", trigger.time, jarray);
-            }
-            else {
-                icalduration_to_json("duration", trigger.duration, jarray);
-            }
-
-            break;
-        }
-        case ICAL_DATE_VALUE: {
-            struct icaltimetype date = icalvalue_get_date(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray,
-                    json_object_new_string(
-                            apr_psprintf(f->r->pool, "%04d-%02d-%02d",
-                                    date.year, date.month, date.day)));
-
-            break;
-        }
-        case ICAL_DATETIME_VALUE: {
-            struct icaltimetype datetime = icalvalue_get_datetime(val);
-
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray,
-                    json_object_new_string(
-                            apr_psprintf(f->r->pool,
-                                    "%04d-%02d-%02dT%02d:%02d:%02d",
-                                    datetime.year, datetime.month, datetime.day,
-                                    datetime.hour, datetime.minute,
-                                    datetime.second)));
-
-            break;
-        }
-        default: {
-            /* if we don't recognise it, add it as a string */
-            char *str = icalvalue_as_ical_string_r(val);
-            json_object_array_add(jarray, json_object_new_string(element));
-            json_object_array_add(jarray, json_object_new_string(str));
-            icalmemory_free_buffer(str);
-
-            break;
-        }
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalvalue_to_xml(ap_filter_t *f, icalvalue *val,
-        xmlTextWriterPtr writer)
-{
-    apr_status_t rv = APR_SUCCESS;
-    int rc = 0;
-
-    if (val) {
-        icalvalue_kind kind = icalvalue_isa(val);
-        char *element = NULL;
-
-        /* work out the value type */
-        if (kind != ICAL_X_VALUE) {
-            element = apr_pstrdup(f->r->pool, icalvalue_kind_to_string(kind));
-        }
-        if (element) {
-            element = strlwr(element);
-        }
-        else {
-            element = "unknown";
-        }
-
-        /* open value element */
-        rc = xmlTextWriterStartElement(writer, BAD_CAST
-                element);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-        /* handle each type */
-        switch (kind) {
-        case ICAL_ACTION_VALUE:
-        case ICAL_ATTACH_VALUE:
-        case ICAL_BINARY_VALUE:
-        case ICAL_BOOLEAN_VALUE:
-        case ICAL_CALADDRESS_VALUE:
-        case ICAL_CARLEVEL_VALUE:
-        case ICAL_CLASS_VALUE:
-        case ICAL_CMD_VALUE:
-        case ICAL_FLOAT_VALUE:
-        case ICAL_INTEGER_VALUE:
-        case ICAL_METHOD_VALUE:
-        case ICAL_QUERY_VALUE:
-        case ICAL_QUERYLEVEL_VALUE:
-        case ICAL_STATUS_VALUE:
-        case ICAL_STRING_VALUE:
-        case ICAL_TRANSP_VALUE:
-        case ICAL_URI_VALUE:
-        case ICAL_UTCOFFSET_VALUE:
-        {
-            char *str = icalvalue_as_ical_string_r(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%s", str);
-            icalmemory_free_buffer(str);
-
-            break;
-        }
-        case ICAL_GEO_VALUE: {
-            struct icalgeotype geo = icalvalue_get_geo(val);
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "latitude");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterWriteFormatString(writer, "%f", geo.lat);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "longitude");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterWriteFormatString(writer, "%f", geo.lon);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            break;
-        }
-        case ICAL_TEXT_VALUE: {
-            /* we explicitly don't escape text here */
-            const char* text = icalvalue_get_text(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%s", text);
-
-            break;
-        }
-        case ICAL_REQUESTSTATUS_VALUE: {
-            struct icalreqstattype requeststatus = icalvalue_get_requeststatus(val);
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "code");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterWriteFormatString(writer, "%s",
-                    icalenum_reqstat_code(requeststatus.code));
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "description");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterWriteFormatString(writer, "%s", requeststatus.desc);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            if (requeststatus.debug) {
-
-                rc = xmlTextWriterStartElement(writer, BAD_CAST "data");
-                if (rc < 0) {
-                    return APR_EGENERAL;
-                }
-
-                rc = xmlTextWriterWriteFormatString(writer, "%s",
-                        requeststatus.debug);
-                if (rc < 0) {
-                    return APR_EGENERAL;
-                }
-
-                rc = xmlTextWriterEndElement(writer);
-                if (rc < 0) {
-                    return APR_EGENERAL;
-                }
-
-            }
-
-            break;
-        }
-        case ICAL_PERIOD_VALUE: {
-            struct icalperiodtype period = icalvalue_get_period(val);
-
-            rv = icaltime_to_xml("start", period.start, writer);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-
-            if (!icaltime_is_null_time(period.end)) {
-                icaltime_to_xml("end", period.start, writer);
-            }
-            else {
-                icalduration_to_xml("duration", period.duration, writer);
-            }
-
-            break;
-        }
-        case ICAL_DATETIMEPERIOD_VALUE: {
-            struct icaldatetimeperiodtype datetimeperiod =
-                    icalvalue_get_datetimeperiod(val);
-
-            if (!icaltime_is_null_time(datetimeperiod.time)) {
-                icaltime_to_xml("time", datetimeperiod.time, writer);
-            }
-            else {
-                rv = icaltime_to_xml("start", datetimeperiod.period.start,
-                        writer);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                if (!icaltime_is_null_time(datetimeperiod.period.end)) {
-                    icaltime_to_xml("end", datetimeperiod.period.start, writer);
-                }
-                else {
-                    icalduration_to_xml("duration",
-                            datetimeperiod.period.duration, writer);
-                }
-            }
-
-            break;
-        }
-        case ICAL_DURATION_VALUE: {
-            struct icaldurationtype duration = icalvalue_get_duration(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%s",
-                    icaldurationtype_as_ical_string(duration));
-
-            break;
-        }
-        case ICAL_X_VALUE: {
-            const char* x = icalvalue_get_x(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%s", x);
-            break;
-        }
-        case ICAL_RECUR_VALUE: {
-            struct icalrecurrencetype recur = icalvalue_get_recur(val);
-
-            rv = icalrecurrencetype_to_xml(f, &recur, writer);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-
-            break;
-        }
-        case ICAL_TRIGGER_VALUE: {
-            struct icaltriggertype trigger = icalvalue_get_trigger(val);
-
-            if (!icaltime_is_null_time(trigger.time)) {
-                icaltime_to_xml("time", trigger.time, writer);
-            }
-            else {
-                icalduration_to_xml("duration", trigger.duration, writer);
-            }
-
-            break;
-        }
-        case ICAL_DATE_VALUE: {
-            struct icaltimetype date = icalvalue_get_date(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%04d-%02d-%02d",
-                    date.year, date.month, date.day);
-
-            break;
-        }
-        case ICAL_DATETIME_VALUE: {
-            struct icaltimetype datetime = icalvalue_get_datetime(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%04d-%02d-%02dT%02d:%02d:%02d",
-                    datetime.year, datetime.month, datetime.day, datetime.hour,
-                    datetime.minute, datetime.second);
-
-            break;
-        }
-        default: {
-            /* if we don't recognise it, write it as a string */
-            char *str = icalvalue_as_ical_string_r(val);
-            rc = xmlTextWriterWriteFormatString(writer, "%s", str);
-            icalmemory_free_buffer(str);
-
-            break;
-        }
-        }
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-        /* close property element */
-        rc = xmlTextWriterEndElement(writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalparameter_to_json(ap_filter_t *f, icalparameter *param,
-        json_object *jobject)
-{
-    apr_status_t rv = APR_SUCCESS;
-
-    if (param) {
-        char *element;
-        const char *str;
-        icalparameter_kind kind = icalparameter_isa(param);
-
-        /* work out the parameter name */
-        if (kind == ICAL_X_PARAMETER) {
-            element = apr_pstrdup(f->r->pool, icalparameter_get_xname(param));
-        }
-#ifdef ICAL_IANA_PARAMETER
-        else if (kind == ICAL_IANA_PARAMETER) {
-            element = apr_pstrdup(f->r->pool,
-                    icalparameter_get_iana_name(param));
-        }
-#endif
-        else {
-            element = apr_pstrdup(f->r->pool,
-                    icalparameter_kind_to_string(kind));
-        }
-
-        /* write parameter */
-        str = icalparameter_get_xvalue(param);
-        if (element && str) {
-            json_object_object_add(jobject, strlwr(element),
-                    json_object_new_string(str));
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalparameter_to_xml(ap_filter_t *f, icalparameter *param,
-        xmlTextWriterPtr writer)
-{
-    apr_status_t rv = APR_SUCCESS;
-
-    if (param) {
-        char *element;
-        const char *str;
-        icalparameter_kind kind = icalparameter_isa(param);
-
-        /* work out the parameter name */
-        if (kind == ICAL_X_PARAMETER) {
-            element = apr_pstrdup(f->r->pool, icalparameter_get_xname(param));
-        }
-#ifdef ICAL_IANA_PARAMETER
-        else if (kind == ICAL_IANA_PARAMETER) {
-            element = apr_pstrdup(f->r->pool,
-                    icalparameter_get_iana_name(param));
-        }
-#endif
-        else {
-            element = apr_pstrdup(f->r->pool,
-                    icalparameter_kind_to_string(kind));
-        }
-        element = strlwr(element);
-
-        /* write parameter */
-        str = icalparameter_get_xvalue(param);
-        if (element && str) {
-            xmlTextWriterWriteFormatElement(writer, BAD_CAST
-                    element, "%s", str);
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalproperty_to_json(ap_filter_t *f, icalproperty *prop,
-        json_object *jarray)
-{
-    apr_status_t rv = APR_SUCCESS;
-
-    if (prop) {
-        char *element;
-        const char *x_name;
-        icalparameter *sparam;
-        icalproperty_kind kind = icalproperty_isa(prop);
-        json_object *jprop, *jparam;
-
-        jprop = json_object_new_array();
-        json_object_array_add(jarray, jprop);
-
-        /* work out the parameter name */
-        x_name = icalproperty_get_x_name(prop);
-        if (kind == ICAL_X_PROPERTY && x_name != 0) {
-            element = apr_pstrdup(f->r->pool, x_name);
-        }
-        else {
-            element = apr_pstrdup(f->r->pool,
-                    icalproperty_kind_to_string(kind));
-        }
-
-        /* open property element */
-        json_object_array_add(jprop, json_object_new_string(strlwr(element)));
-
-        /* handle parameters */
-        jparam = json_object_new_object();
-        json_object_array_add(jprop, jparam);
-        sparam = icalproperty_get_first_parameter(prop, ICAL_ANY_PARAMETER);
-        if (sparam) {
-
-            while (sparam) {
-
-                rv = icalparameter_to_json(f, sparam, jparam);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                sparam = icalproperty_get_next_parameter(prop, ICAL_ANY_PARAMETER);
-            }
-
-        }
-
-        /* handle value */
-        switch (kind) {
-        case ICAL_CATEGORIES_PROPERTY:
-        case ICAL_RESOURCES_PROPERTY:
-        case ICAL_FREEBUSY_PROPERTY:
-        case ICAL_EXDATE_PROPERTY:
-        case ICAL_RDATE_PROPERTY: {
-            rv = icalvalue_multi_to_json(f, icalproperty_get_value(prop), jprop);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-            break;
-        }
-        default: {
-            rv = icalvalue_to_json(f, icalproperty_get_value(prop), jprop);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-            break;
-        }
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalproperty_to_xml(ap_filter_t *f, icalproperty *prop,
-        xmlTextWriterPtr writer)
-{
-    apr_status_t rv = APR_SUCCESS;
-    int rc;
-
-    if (prop) {
-        char *element;
-        const char *x_name;
-        icalparameter *sparam;
-        icalproperty_kind kind = icalproperty_isa(prop);
-
-        /* work out the parameter name */
-        x_name = icalproperty_get_x_name(prop);
-        if (kind == ICAL_X_PROPERTY && x_name != 0) {
-            element = apr_pstrdup(f->r->pool, x_name);
-        }
-        else {
-            element = apr_pstrdup(f->r->pool,
-                    icalproperty_kind_to_string(kind));
-        }
-
-        /* open property element */
-        element = strlwr(element);
-        rc = xmlTextWriterStartElement(writer, BAD_CAST
-                element);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-        /* handle parameters */
-        sparam = icalproperty_get_first_parameter(prop, ICAL_ANY_PARAMETER);
-        if (sparam) {
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "parameters");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            while (sparam) {
-
-                rv = icalparameter_to_xml(f, sparam, writer);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                sparam = icalproperty_get_next_parameter(prop, ICAL_ANY_PARAMETER);
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-        }
-
-        /* handle value */
-        switch (kind) {
-        case ICAL_CATEGORIES_PROPERTY:
-        case ICAL_RESOURCES_PROPERTY:
-        case ICAL_FREEBUSY_PROPERTY:
-        case ICAL_EXDATE_PROPERTY:
-        case ICAL_RDATE_PROPERTY: {
-            rv = icalvalue_multi_to_xml(f,
-                    icalproperty_get_value(prop), writer);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-            break;
-        }
-        default: {
-            rv = icalvalue_to_xml(f, icalproperty_get_value(prop), writer);
-            if (rv != APR_SUCCESS) {
-                return rv;
-            }
-            break;
-        }
-        }
-
-        /* close property element */
-        rc = xmlTextWriterEndElement(writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalcomponent_to_json(ap_filter_t *f, icalcomponent *comp,
-        json_object * array)
-{
-    apr_status_t rv = APR_SUCCESS;
-
-    if (comp) {
-        icalcomponent *scomp;
-        icalproperty *sprop;
-        char *element;
-        json_object *jprop, *jcomp;
-
-        /* open component element */
-        element = apr_pstrdup(f->r->pool,
-                icalcomponent_kind_to_string(icalcomponent_isa(comp)));
-        json_object_array_add(array, json_object_new_string(strlwr(element)));
-
-        /* handle properties */
-        jprop = json_object_new_array();
-        json_object_array_add(array, jprop);
-        sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
-        if (sprop) {
-
-            while (sprop) {
-
-                rv = icalproperty_to_json(f, sprop, jprop);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                sprop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY);
-            }
-
-        }
-
-        /* handle components */
-        jcomp = json_object_new_array();
-        json_object_array_add(array, jcomp);
-        scomp = icalcomponent_get_first_component (comp, ICAL_ANY_COMPONENT);
-        if (scomp) {
-
-            while (scomp) {
-
-                rv = icalcomponent_to_json(f, scomp, jcomp);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                scomp = icalcomponent_get_next_component (comp, ICAL_ANY_COMPONENT);
-            }
-
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t icalcomponent_to_xml(ap_filter_t *f, icalcomponent *comp,
-        xmlTextWriterPtr writer)
-{
-    apr_status_t rv = APR_SUCCESS;
-    int rc;
-
-    if (comp) {
-        icalcomponent *scomp;
-        icalproperty *sprop;
-        char *element;
-
-        /* open component element */
-        element = apr_pstrdup(f->r->pool,
-                icalcomponent_kind_to_string(icalcomponent_isa(comp)));
-        rc = xmlTextWriterStartElement(writer, BAD_CAST
-                strlwr(element));
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-        /* handle properties */
-        sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
-        if (sprop) {
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "properties");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            while (sprop) {
-
-                rv = icalproperty_to_xml(f, sprop, writer);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                sprop = icalcomponent_get_next_property(comp, ICAL_ANY_PROPERTY);
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-        }
-
-        /* handle components */
-        scomp = icalcomponent_get_first_component (comp, ICAL_ANY_COMPONENT);
-        if (scomp) {
-
-            rc = xmlTextWriterStartElement(writer, BAD_CAST "components");
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-            while (scomp) {
-
-                rv = icalcomponent_to_xml(f, scomp, writer);
-                if (rv != APR_SUCCESS) {
-                    return rv;
-                }
-
-                scomp = icalcomponent_get_next_component (comp, ICAL_ANY_COMPONENT);
-            }
-
-            rc = xmlTextWriterEndElement(writer);
-            if (rc < 0) {
-                return APR_EGENERAL;
-            }
-
-        }
-
-        /* close component element */
-        rc = xmlTextWriterEndElement(writer);
-        if (rc < 0) {
-            return APR_EGENERAL;
-        }
-
-    }
-
-    return rv;
-}
-
-static apr_status_t ical_to_xcal(ap_filter_t *f, icalcomponent *comp)
-{
-    apr_status_t rv;
-    int rc;
-    ical_ctx *ctx = f->ctx;
-    xmlBufferPtr buf;
-    xmlTextWriterPtr writer;
-
-    buf = xmlBufferCreate();
-    if (buf == NULL) {
-        return APR_ENOMEM;
-    }
-    apr_pool_cleanup_register(f->r->pool, buf, xmlbuffer_cleanup,
-            apr_pool_cleanup_null);
-
-    writer = xmlNewTextWriterMemory(buf, 0);
-    if (writer == NULL) {
-        return APR_ENOMEM;
-    }
-    apr_pool_cleanup_register(f->r->pool, writer, xmlwriter_cleanup,
-            apr_pool_cleanup_null);
-
-    if (ctx->format == AP_ICAL_FORMAT_PRETTY
-            || ctx->format == AP_ICAL_FORMAT_SPACED) {
-        xmlTextWriterSetIndent(writer, 1);
-        xmlTextWriterSetIndentString    (writer, BAD_CAST "  ");
-    }
-
-    rc = xmlTextWriterStartDocument(writer, NULL, "UTF-8", NULL);
-    if (rc < 0) {
-        return APR_EGENERAL;
-    }
-
-    rc = xmlTextWriterStartElementNS(writer, NULL, BAD_CAST "icalendar", BAD_CAST "urn:ietf:params:xml:ns:icalendar-2.0");
-    if (rc < 0) {
-        return APR_EGENERAL;
-    }
-
-    rv = icalcomponent_to_xml(f, comp, writer);
-    if (rv != APR_SUCCESS) {
-        return rv;
-    }
-
-    rc = xmlTextWriterEndElement(writer);
-    if (rc < 0) {
-        return APR_EGENERAL;
-    }
-
-    rc = xmlTextWriterEndDocument(writer);
-    if (rc < 0) {
-        return APR_EGENERAL;
-    }
-
-    apr_pool_cleanup_run(f->r->pool, writer, xmlwriter_cleanup);
-
-    rv = apr_brigade_puts(ctx->bb, NULL, NULL, (const char *) buf->content);
-    if (rv != APR_SUCCESS) {
-        return rv;
-    }
-
-    apr_pool_cleanup_run(f->r->pool, buf, xmlbuffer_cleanup);
-
-    return APR_SUCCESS;
-}
-
-static apr_status_t ical_to_jcal(ap_filter_t *f, icalcomponent *comp)
-{
-    apr_status_t rv;
-    ical_ctx *ctx = f->ctx;
-    json_object * jarray;
-    const char *str;
-
-    jarray = json_object_new_array();
-    if (jarray == NULL) {
-        return APR_ENOMEM;
-    }
-    apr_pool_cleanup_register(f->r->pool, jarray, jsonbuffer_cleanup,
-            apr_pool_cleanup_null);
-
-    rv = icalcomponent_to_json(f, comp, jarray);
-    if (rv != APR_SUCCESS) {
-        return rv;
-    }
-
-    str = json_object_to_json_string_ext(jarray,
-            ctx->format == AP_ICAL_FORMAT_PRETTY ? JSON_C_TO_STRING_PRETTY :
-            ctx->format == AP_ICAL_FORMAT_SPACED ? JSON_C_TO_STRING_SPACED :
-                    JSON_C_TO_STRING_PLAIN);
-    rv = apr_brigade_puts(ctx->bb, NULL, NULL, str);
-    if (rv != APR_SUCCESS) {
-        return rv;
-    }
-
-    apr_pool_cleanup_run(f->r->pool, jarray, jsonbuffer_cleanup);
-
-    return APR_SUCCESS;
-}
-
-static apr_status_t ical_to_ical(ap_filter_t *f, icalcomponent *comp)
-{
-    apr_status_t rv;
-    char *temp;
-    ical_ctx *ctx = f->ctx;
-
-    temp = icalcomponent_as_ical_string_r(comp);
-    rv = apr_brigade_write(ctx->bb, NULL, NULL, temp, strlen(temp));
-    free(temp);
-
-    return rv;
-}
-
-static ap_ical_filter_e parse_filter(const char *arg, apr_off_t len)
-{
-    if (!strncmp(arg, "none", len)) {
-        return AP_ICAL_FILTER_NONE;
-    }
-    else if (!strncmp(arg, "next", len)) {
-        return AP_ICAL_FILTER_NEXT;
-    }
-    else if (!strncmp(arg, "last", len)) {
-        return AP_ICAL_FILTER_LAST;
-    }
-    else if (!strncmp(arg, "future", len)) {
-        return AP_ICAL_FILTER_FUTURE;
-    }
-    else if (!strncmp(arg, "past", len)) {
-        return AP_ICAL_FILTER_PAST;
-    }
-    else {
-        return AP_ICAL_FILTER_UNKNOWN;
-    }
-}
-
-static ap_ical_format_e parse_format(const char *arg, apr_off_t len)
-{
-    if (!strncmp(arg, "none", len)) {
-        return AP_ICAL_FORMAT_NONE;
-    }
-    else if (!strncmp(arg, "pretty", len)) {
-        return AP_ICAL_FORMAT_PRETTY;
-    }
-    else if (!strncmp(arg, "spaced", len)) {
-        return AP_ICAL_FORMAT_SPACED;
-    }
-    else {
-        return AP_ICAL_FORMAT_UNKNOWN;
-    }
-}
-
-static icalcomponent *timezone_component(ap_filter_t *f, icalcomponent *comp,
-        icaltimezone *oldtz)
-{
-    ical_ctx *ctx = f->ctx;
-
-    if (comp && ctx->tz) {
-        icalcomponent *scomp, *oldtcomp = NULL, *newtcomp = NULL;
-        icalproperty *sprop;
-
-        /* handle properties */
-        sprop = icalcomponent_get_first_property(comp, ICAL_ANY_PROPERTY);
-        if (sprop) {
-
-            while (sprop) {
-                icalparameter *sparam;
-                icaltimezone *overridetz = oldtz;
-
-                /* handle parameters */
-                sparam = icalproperty_get_first_parameter(sprop,
-                        ICAL_ANY_PARAMETER);
-                if (sparam) {
-
-                    while (sparam) {
-                        icalparameter_kind pkind = icalparameter_isa(sparam);
-
-                        switch (pkind) {
-                        case ICAL_TZID_PARAMETER: {
-
-                            /* identify original timezone */
-                            const char *str = icalparameter_get_xvalue(sparam);
-                            if (str) {
-                                icaltimezone *tz;
-                                /* first, try read the TZID, and if that fails,
-                                 * treat it as a location.
-                                 */
-                                tz =
-                                        icaltimezone_get_builtin_timezone_from_tzid(
-                                                str);
-                                if (tz) {
-                                    icalparameter_set_xvalue(sparam,
-                                            icaltimezone_get_tzid(ctx->tz));
-                                }
-                                else {
-                                    tz = icaltimezone_get_builtin_timezone(
-                                            str);
-                                    if (tz) {
-                                        icalparameter_set_xvalue(sparam,
-                                                icaltimezone_get_tzid(ctx->tz));
-                                    }
-                                }
-                                if (tz) {
-                                    overridetz = tz;
-                                }
-                            }
-
-                            break;
-                        }
-                        default: {
-                            break;
-                        }
-                        }
-
-                        sparam = icalproperty_get_next_parameter(sprop,
-                                ICAL_ANY_PARAMETER);
-                    }
-
-                }
-
-                if (overridetz) {
-                    icalvalue *svalue;
-
-                    /* handle value */
-                    svalue = icalproperty_get_value(sprop);
-                    if (svalue) {
-                        icalvalue_kind vkind = icalvalue_isa(svalue);
-
-                        switch (vkind) {
-                        case ICAL_DATETIMEPERIOD_VALUE: {
-
-                            struct icaldatetimeperiodtype dtp =
-                                    icalvalue_get_datetimeperiod(svalue);
-                            if (!icaltime_is_null_time(dtp.time)) {
-                                icaltime_set_timezone(&dtp.time, overridetz);
-                                icalvalue_set_datetime(svalue,
-                                        icaltime_convert_to_zone(dtp.time,
-                                                ctx->tz));
-                            }
-
-                            break;
-                        }
-                        case ICAL_DATETIME_VALUE: {
-
-                            struct icaltimetype datetime = icalvalue_get_datetime(
-                                    svalue);
-                            icaltime_set_timezone(&datetime, overridetz);
-                            icalvalue_set_datetime(svalue,
-                                    icaltime_convert_to_zone(datetime, ctx->tz));
-
-                            break;
-                        }
-                        default: {
-                            break;
-                        }
-                        }
-                    }
-
-                }
-
-                sprop = icalcomponent_get_next_property(comp,
-                        ICAL_ANY_PROPERTY);
-            }
-
-        }
-
-        /* handle components */
-        scomp = icalcomponent_get_first_component(comp, ICAL_ANY_COMPONENT);
-        if (scomp) {
-
-            while (scomp) {
-
-                icalcomponent_kind ckind = icalcomponent_isa(scomp);
-
-                if (ckind == ICAL_VTIMEZONE_COMPONENT) {
-                    /* identify existing timezone */
-                    oldtcomp = scomp;
-                    if (!oldtz) {
-                        oldtz = icaltimezone_new();
-                        icaltimezone_set_component(oldtz, scomp);
-                    }
-                }
-                else {
-                    /* handle nested components */
-                    timezone_component(f, scomp, oldtz);
-                }
-                scomp = icalcomponent_get_next_component(comp,
-                        ICAL_ANY_COMPONENT);
-
-            }
-        }
-
-        /* remove old timezone, replace with new timezone */
-        if (oldtcomp) {
-
-            icalcomponent_remove_component(comp, oldtcomp);
-            icalcomponent_free(oldtcomp);
-
-            newtcomp = icaltimezone_get_component(icaltimezone_copy(ctx->tz));
-            icalcomponent_add_component(comp, newtcomp);
-
-        }
+    int i;
 
+    for (i = 0; i < comps->nelts; i++) {
+        apr_pool_cleanup_kill(f->r->pool,
+                APR_ARRAY_IDX(comps, i, icalcomponent *),
+                icalcomponent_cleanup);
     }
-
-    return comp;
-
 }
 
-static icalcomponent *filter_component(ap_filter_t *f, icalcomponent *comp)
+/*
+ * Find the calendar already parsed and converted to the timezone of the
+ * request. Failing that, convert the calendar as parsed to the timezone.
+ * Failing that, the calendar is parsed, and kept for next time.
+ */
+static apr_status_t variant_open(ap_filter_t *f)
 {
+    request_rec *r = f->r;
     ical_ctx *ctx = f->ctx;
+    ical_variant *variant, *base = NULL;
 
-    if (comp) {
-        icalcomponent *scomp, *candidate = NULL;
+    /* only calendars served from a file can be cached */
+    if (!cache || !ical_from_file(f)) {
+        return APR_ENOENT;
+    }
 
-        icalcompiter iter = icalcomponent_begin_component(comp,
-                ICAL_ANY_COMPONENT);
+    cache_lock();
+    variant = variant_find(f, ctx->conv.tz);
+    if (!variant && ctx->conv.tz) {
+        base = variant_find(f, NULL);
+    }
+    cache_unlock();
 
-        struct icaltimetype now = icaltime_current_time_with_zone(
-                icaltimezone_get_utc_timezone());
+    if (base) {
+        apr_array_header_t *comps = apr_array_make(r->pool, base->comps->nelts,
+                sizeof(icalcomponent *));
+        int i;
 
-        while ((scomp = icalcompiter_deref(&iter))) {
+        /* cached calendars are only read, and can be cloned unlocked */
+        for (i = 0; i < base->comps->nelts; i++) {
+            icalcomponent *comp = variant_clone(f,
+                    APR_ARRAY_IDX(base->comps, i, icalcomponent *));
 
-            icalcompiter_next(&iter);
+            APR_ARRAY_PUSH(comps, icalcomponent *) =
+                    ical_timezone_component(&ctx->conv, comp, NULL);
+        }
+        variant_keep(f, comps);
 
-            /* uid match? short circuit everything */
-            if (ctx->uid && ctx->uid[0]) {
+        cache_lock();
+        variant = variant_store(f, ctx->conv.tz, comps, base);
+        cache_unlock();
 
-                const char *uid = icalcomponent_get_uid(scomp);
+        variant_release(base);
+    }
 
-                if (!uid || strcasecmp(uid, ctx->uid)) {
-                    icalcomponent_remove_component(comp, scomp);
-                }
+    if (variant) {
+        apr_pool_cleanup_register(r->pool, variant, variant_release,
+                apr_pool_cleanup_null);
+        ctx->variant = variant;
+        return APR_SUCCESS;
+    }
 
-                continue;
-            }
+    ctx->parsed = apr_array_make(r->pool, 1, sizeof(icalcomponent *));
+    if (ctx->conv.tz) {
+        ctx->converted = apr_array_make(r->pool, 1, sizeof(icalcomponent *));
+    }
 
-            switch (ctx->filter) {
-            case AP_ICAL_FILTER_NEXT: {
-                struct icaltimetype end = icalcomponent_get_dtend(scomp);
+    return APR_ENOENT;
+}
 
-                /* in the past? */
-                if (icaltime_compare(now, end) > 0) {
-                    icalcomponent_remove_component(comp, scomp);
-                    break;
-                }
+/* keep the calendars parsed by this request for the next */
+static void variant_close(ap_filter_t *f)
+{
+    ical_ctx *ctx = f->ctx;
+    ical_variant *variant, *base;
 
-                /* better than candidate? */
-                if (candidate) {
-                    if (icaltime_compare(end,
-                            icalcomponent_get_dtend(candidate)) < 0) {
-                        /* yes - blow away the old candidate */
-                        icalcomponent_remove_component(comp, candidate);
-                        candidate = scomp;
-                    }
-                    else {
-                        /* no - blow away the contender */
-                        icalcomponent_remove_component(comp, scomp);
-                    }
-                }
-                else {
-                    /* we are now the best candidate */
-                    candidate = scomp;
-                }
+    if (!ctx->parsed || !ctx->parsed->nelts) {
+        return;
+    }
 
-                break;
-            }
-            case AP_ICAL_FILTER_LAST: {
-                struct icaltimetype end = icalcomponent_get_dtend(scomp);
+    variant_keep(f, ctx->parsed);
+    if (ctx->converted) {
+        variant_keep(f, ctx->converted);
+    }
 
-                /* in the future? */
-                if (icaltime_compare(now, end) < 0) {
-                    icalcomponent_remove_component(comp, scomp);
-                    break;
-                }
+    cache_lock();
+    base = variant_store(f, NULL, ctx->parsed, NULL);
+    if (ctx->converted) {
+        variant = variant_store(f, ctx->conv.tz, ctx->converted, base);
+        if (variant) {
+            variant->refcount--;
+        }
+    }
+    if (base && !--base->refcount && base->stale) {
+        apr_pool_destroy(base->pool);
+    }
+    cache_unlock();
 
-                /* better than candidate? */
-                if (candidate) {
-                    if (icaltime_compare(end,
-                            icalcomponent_get_dtend(candidate)) > 0) {
-                        /* yes - blow away the old candidate */
-                        icalcomponent_remove_component(comp, candidate);
-                        candidate = scomp;
-                    }
-                    else {
-                        /* no - blow away the contender */
-                        icalcomponent_remove_component(comp, scomp);
-                    }
-                }
-                else {
-                    /* we are now the best candidate */
-                    candidate = scomp;
-                }
+    ctx->parsed = ctx->converted = NULL;
+}
 
-                break;
-            }
-            case AP_ICAL_FILTER_FUTURE: {
-                struct icaltimetype end = icalcomponent_get_dtend(scomp);
+/* the filter judges the times of the calendars, which must then be judged
+ * as parsed rather than as converted to a timezone.
+ */
+static int ical_judges_times(ical_ctx *ctx)
+{
+    return ctx->conv.tz && ctx->conv.filter != AP_ICAL_FILTER_NONE
+            && !(ctx->conv.uid && ctx->conv.uid[0]);
+}
 
-                /* in the past? */
-                if (icaltime_compare(now, end) > 0) {
-                    icalcomponent_remove_component(comp, scomp);
-                    break;
-                }
+/*
+ * Convert the calendar to the timezone of the request, unless cached
+ * already converted, and filter it. The filter judges times from original,
+ * the calendar as parsed, where given.
+ */
+static apr_status_t ical_convert(ap_filter_t *f, icalcomponent *comp,
+        icalcomponent *original)
+{
+    ical_ctx *ctx = f->ctx;
+    apr_hash_t *numbers = NULL;
+    apr_uint32_t calendar = ctx->calendars++;
+    apr_status_t rv;
 
-                break;
-            }
-            case AP_ICAL_FILTER_PAST: {
-                struct icaltimetype end = icalcomponent_get_dtend(scomp);
+    /* cached calendars are already converted, and already freed with the
+     * request, parsed calendars are freed with the request too.
+     */
+    if (!ctx->variant) {
+        apr_pool_cleanup_register(f->r->pool, comp, icalcomponent_cleanup,
+                apr_pool_cleanup_null);
+        if (ctx->parsed) {
+            original = variant_clone(f, comp);
+            APR_ARRAY_PUSH(ctx->parsed, icalcomponent *) = original;
+        }
+        else if (ical_judges_times(ctx)) {
+            original = variant_clone(f, comp);
+        }
+        comp = ical_timezone_component(&ctx->conv, comp, NULL);
+        if (ctx->converted) {
+            APR_ARRAY_PUSH(ctx->converted, icalcomponent *) =
+                    variant_clone(f, comp);
+        }
+    }
 
-                /* in the future? */
-                if (icaltime_compare(now, end) < 0) {
-                    icalcomponent_remove_component(comp, scomp);
-                    break;
-                }
+    if (ctx->cache) {
+        numbers = cache_number(f, comp);
+    }
 
-                break;
-            }
-            default: {
-                /* none, passthrough */
-                break;
-            }
-            }
+    comp = ical_timezone_used(&ctx->conv,
+            ical_filter_component(&ctx->conv, comp, original));
 
+    /* assemble from cached fragments where the output allows */
+    if (numbers) {
+        rv = cache_write(f, comp, calendar, numbers);
+        if (rv != APR_ENOTIMPL) {
+            return rv;
         }
+    }
+
+    return ical_write(&ctx->conv, comp);
+}
+
+/* convert a copy of each cached calendar, along with a copy of the
+ * calendar as parsed where the filter judges times.
+ */
+static apr_status_t variant_convert(ap_filter_t *f)
+{
+    ical_ctx *ctx = f->ctx;
+    apr_array_header_t *comps = ctx->variant->comps;
+    apr_array_header_t *originals = NULL;
+    apr_status_t rv = APR_SUCCESS;
+    int i;
+
+    if (ctx->variant->base && ical_judges_times(ctx)) {
+        originals = ctx->variant->base->comps;
+    }
 
+    for (i = 0; rv == APR_SUCCESS && i < comps->nelts; i++) {
+        rv = ical_convert(f,
+                variant_clone(f, APR_ARRAY_IDX(comps, i, icalcomponent *)),
+                originals ? variant_clone(f,
+                        APR_ARRAY_IDX(originals, i, icalcomponent *)) : NULL);
     }
 
-    return comp;
+    return rv;
 }
 
-static icalcomponent *add_line(ap_filter_t *f, ical_ctx *ctx)
+static apr_status_t add_line(ap_filter_t *f, ical_ctx *ctx,
+        icalcomponent **comp)
 {
     char *buffer;
     apr_off_t actual;
-    apr_size_t total;
+    apr_size_t total, valid;
+
+    *comp = NULL;
+
+    /* the parser does not keep the previous line */
+    apr_pool_clear(ctx->scratch);
 
     /* flatten the brigade, terminate with NUL */
     apr_brigade_length(ctx->tmp, 1, &actual);
 
     total = (apr_size_t) actual;
+    if (total + 1 > ctx->conv.stats.scratch_peak) {
+        ctx->conv.stats.scratch_peak = total + 1;
+    }
 
-    buffer = apr_palloc(f->r->pool, total + 1);
+    buffer = apr_palloc(ctx->scratch, total + 1);
     buffer[total] = 0;
     apr_brigade_flatten(ctx->tmp, buffer, &total);
     apr_brigade_cleanup(ctx->tmp);
 
+    /* unfolded lines are whole, so no character is split across lines */
+    if (ctx->utf8 != AP_ICAL_UTF8_PASS
+            && (valid = ical_utf8_valid(buffer, total)) != total) {
+
+        if (ctx->utf8 == AP_ICAL_UTF8_REJECT) {
+            ap_log_rerror(APLOG_MARK, APLOG_ERR, APR_EINVAL, f->r,
+                    "calendar '%s' contains invalid UTF-8 at offset %"
+                    APR_SIZE_T_FMT " of a line, rejected", f->r->uri, valid);
+            return APR_EINVAL;
+        }
+
+        buffer = ical_utf8_replace(ctx->scratch, buffer, &total);
+    }
+
     /* handle line in ctx->tmp */
-    return icalparser_add_line(ctx->parser, buffer);
+    *comp = icalparser_add_line(ctx->parser, buffer);
+
+    return APR_SUCCESS;
+}
+
+/* give up on a calendar that cannot be converted, discarding the rest */
+static apr_status_t ical_reject(ap_filter_t *f, apr_bucket_brigade *bb)
+{
+    ical_ctx *ctx = f->ctx;
+    apr_bucket *e;
+
+    ctx->rejected = 1;
+
+    apr_brigade_cleanup(bb);
+    apr_brigade_cleanup(ctx->conv.bb);
+
+    e = ap_bucket_error_create(HTTP_BAD_GATEWAY, NULL, f->r->pool,
+            f->c->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(ctx->conv.bb, e);
+    e = apr_bucket_eos_create(f->c->bucket_alloc);
+    APR_BRIGADE_INSERT_TAIL(ctx->conv.bb, e);
+
+    return ap_pass_brigade(f->next, ctx->conv.bb);
 }
 
 static apr_status_t ical_header(ap_filter_t *f)
 {
     ical_ctx *ctx = f->ctx;
 
-    switch (ctx->output) {
+    switch (ctx->conv.output) {
     case AP_ICAL_OUTPUT_ICAL: {
         break;
     }
@@ -2142,7 +1345,7 @@ static apr_status_t ical_param(ap_filter_t *f)
             &ical_module);
 
     if (conf->uid) {
-        ctx->uid = ap_expr_str_exec(f->r, conf->uid, &err);
+        ctx->conv.uid = ap_expr_str_exec(f->r, conf->uid, &err);
 
         if (err) {
             ap_log_rerror(APLOG_MARK, APLOG_WARNING, 0, f->r,
@@ -2163,9 +1366,9 @@ static apr_status_t ical_query(ap_filter_t *f)
     ical_conf *conf = ap_get_module_config(f->r->per_dir_config,
             &ical_module);
 
-    ctx->tz = conf->timezone;
-    ctx->filter = conf->filter;
-    ctx->format = conf->format;
+    ctx->conv.tz = conf->timezone;
+    ctx->conv.filter = conf->filter;
+    ctx->conv.format = conf->format;
 
     while (slider && *slider) {
         const char *key = slider;
@@ -2190,32 +1393,32 @@ static apr_status_t ical_query(ap_filter_t *f)
             /* what have we found? */
             if (!strncmp(key, "filter", klen)) {
 
-                ap_ical_filter_e filter = parse_filter(val, vlen);
+                ap_ical_filter_e filter = ical_parse_filter(val, vlen);
                 if (filter != AP_ICAL_FILTER_UNKNOWN) {
-                    ctx->filter = filter;
+                    ctx->conv.filter = filter;
                 }
 
             }
 
             if (!strncmp(key, "format", klen)) {
 
-                ap_ical_format_e format = parse_format(val, vlen);
+                ap_ical_format_e format = ical_parse_format(val, vlen);
                 if (format != AP_ICAL_FORMAT_UNKNOWN) {
-                    ctx->format = format;
+                    ctx->conv.format = format;
                 }
 
             }
 
             if (!strncmp(key, "tz", klen)) {
 
-                ctx->tz = icaltimezone_get_builtin_timezone(
+                ctx->conv.tz = ical_tz_location(
                         apr_pstrndup(f->r->pool, val, vlen));
 
             }
 
             if (!strncmp(key, "uid", klen)) {
 
-                ctx->uid = apr_pstrndup(f->r->pool, val, vlen);
+                ctx->conv.uid = apr_pstrndup(f->r->pool, val, vlen);
 
             }
 
@@ -2226,39 +1429,12 @@ static apr_status_t ical_query(ap_filter_t *f)
     return APR_SUCCESS;
 }
 
-static apr_status_t ical_write(ap_filter_t *f, icalcomponent *comp)
-{
-    ical_ctx *ctx = f->ctx;
-    apr_status_t rv;
-
-    switch (ctx->output) {
-    case AP_ICAL_OUTPUT_ICAL: {
-        rv = ical_to_ical(f, comp);
-        break;
-    }
-    case AP_ICAL_OUTPUT_XCAL: {
-        rv = ical_to_xcal(f, comp);
-        break;
-    }
-    case AP_ICAL_OUTPUT_JCAL: {
-        rv = ical_to_jcal(f, comp);
-        break;
-    }
-    default: {
-        rv = APR_ENOTIMPL;
-        break;
-    }
-    }
-
-    return rv;
-}
-
 static int ical_out_setup(ap_filter_t *f)
 {
     ical_ctx *ctx;
 
     ctx = f->ctx = apr_pcalloc(f->r->pool, sizeof(ical_ctx));
-    ctx->output = AP_ICAL_OUTPUT_NEGOTIATED;
+    ctx->conv.output = AP_ICAL_OUTPUT_NEGOTIATED;
 
     return APR_SUCCESS;
 }
@@ -2268,7 +1444,7 @@ static int ical_out_ical_setup(ap_filter_t *f)
     ical_ctx *ctx;
 
     ctx = f->ctx = apr_pcalloc(f->r->pool, sizeof(ical_ctx));
-    ctx->output = AP_ICAL_OUTPUT_ICAL;
+    ctx->conv.output = AP_ICAL_OUTPUT_ICAL;
 
     return APR_SUCCESS;
 }
@@ -2278,7 +1454,7 @@ static int ical_out_xcal_setup(ap_filter_t *f)
     ical_ctx *ctx;
 
     ctx = f->ctx = apr_pcalloc(f->r->pool, sizeof(ical_ctx));
-    ctx->output = AP_ICAL_OUTPUT_XCAL;
+    ctx->conv.output = AP_ICAL_OUTPUT_XCAL;
 
     return APR_SUCCESS;
 }
@@ -2288,7 +1464,7 @@ static int ical_out_jcal_setup(ap_filter_t *f)
     ical_ctx *ctx;
 
     ctx = f->ctx = apr_pcalloc(f->r->pool, sizeof(ical_ctx));
-    ctx->output = AP_ICAL_OUTPUT_JCAL;
+    ctx->conv.output = AP_ICAL_OUTPUT_JCAL;
 
     return APR_SUCCESS;
 }
@@ -2301,11 +1477,19 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
     ical_ctx *ctx = f->ctx;
     icalcomponent *comp;
 
+    /* rejected calendar? swallow the remainder */
+    if (ctx->rejected) {
+        apr_brigade_cleanup(bb);
+        return APR_SUCCESS;
+    }
+
     /* first time in? create a parser */
     if (!ctx->parser) {
+        ical_conf *conf = ap_get_module_config(r->per_dir_config,
+                &ical_module);
 
         /* sanity check - input must be text/calendar or fail */
-        if (ctx->output == AP_ICAL_OUTPUT_NEGOTIATED) {
+        if (ctx->conv.output == AP_ICAL_OUTPUT_NEGOTIATED) {
             const char *ct;
             ct = ap_field_noparam(r->pool,
                     r->content_type ? r->content_type : apr_table_get(r->headers_out, "Content-Type"));
@@ -2318,33 +1502,53 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
             }
         }
 
-        ctx->bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+        ctx->conv.pool = r->pool;
+        ctx->conv.bb = apr_brigade_create(r->pool, f->c->bucket_alloc);
+        if (conf->flush_size) {
+            ctx->conv.flush = ap_filter_flush;
+            ctx->conv.flush_ctx = f->next;
+            ctx->conv.flush_size = conf->flush_size;
+        }
+        ctx->conv.budget = conf->recur_budget;
         ctx->tmp = apr_brigade_create(r->pool, f->c->bucket_alloc);
+        ctx->utf8 = conf->utf8;
+
+        /* scratch memory is kept by the thread between requests */
+        ctx->thread = thread_get();
+        if (ctx->thread) {
+            apr_pool_create(&ctx->scratch, ctx->thread->pool);
+            apr_pool_cleanup_register(r->pool, ctx->scratch, scratch_cleanup,
+                    apr_pool_cleanup_null);
+            ctx->conv.scratch = ctx->thread->pool;
+        }
+        else {
+            apr_pool_create(&ctx->scratch, r->pool);
+        }
 
-        ctx->parser = icalparser_new();
+        ctx->parser = thread_parser(ctx->thread);
         apr_pool_cleanup_register(r->pool, ctx->parser, icalparser_cleanup,
                 apr_pool_cleanup_null);
 
         /* must we negotiate the output format? */
-        if (ctx->output == AP_ICAL_OUTPUT_NEGOTIATED) {
+        if (ctx->conv.output == AP_ICAL_OUTPUT_NEGOTIATED) {
             const char *accept = apr_table_get(r->headers_in, "Accept");
 
             if (!accept) {
                 /* fall back to text/calendar by default */
-                ctx->output = AP_ICAL_OUTPUT_ICAL;
+                ctx->conv.output = AP_ICAL_OUTPUT_ICAL;
             }
             else if (!strcmp(accept, "text/calendar")) {
-                ctx->output = AP_ICAL_OUTPUT_ICAL;
+                ctx->conv.output = AP_ICAL_OUTPUT_ICAL;
             }
             else if (!strcmp(accept, "application/calendar+xml")) {
-                ctx->output = AP_ICAL_OUTPUT_XCAL;
+                ctx->conv.output = AP_ICAL_OUTPUT_XCAL;
             }
             else if (!strcmp(accept, "application/calendar+json")) {
-                ctx->output = AP_ICAL_OUTPUT_JCAL;
+                ctx->conv.output = AP_ICAL_OUTPUT_JCAL;
             }
             else {
                 /* fall back to text/calendar by default */
-                ctx->output = AP_ICAL_OUTPUT_ICAL;
+                ctx->conv.output = AP_ICAL_OUTPUT_ICAL;
             }
             apr_table_merge(r->headers_out, "Vary", "Accept");
         }
@@ -2355,6 +1559,21 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         /* type of filtering/formatting to do */
         ical_query(f);
 
+        /* precompiled index alongside the calendar? */
+        if (conf->index) {
+            index_open(f);
+        }
+
+        /* rendered fragments of the calendar? */
+        if (conf->cache) {
+            cache_open(f);
+        }
+
+        /* calendar already parsed? indexed calendars are parsed in part */
+        if (conf->cache && !ctx->index) {
+            variant_open(f);
+        }
+
         rv = ical_header(f);
         if (rv != APR_SUCCESS) {
             return rv;
@@ -2371,31 +1590,65 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
         /* EOS means we are done. */
         if (APR_BUCKET_IS_EOS(e)) {
 
-            /* handle last line */
-            comp = filter_component(f,
-                    timezone_component(f, add_line(f, ctx), NULL));
-            if (comp) {
-
-                rv = ical_write(f, comp);
+            /* handle last line, the components from the index, or the
+             * cached calendars.
+             */
+            if (ctx->variant) {
+                comp = NULL;
+                rv = variant_convert(f);
                 if (rv != APR_SUCCESS) {
                     return rv;
                 }
+            }
+            else if (ctx->index) {
+                comp = index_component(f);
+            }
+            else if (add_line(f, ctx, &comp) != APR_SUCCESS) {
+                return ical_reject(f, bb);
+            }
+            if (comp || ctx->variant) {
+
+                if (comp) {
+                    rv = ical_convert(f, comp, NULL);
+                    if (rv != APR_SUCCESS) {
+                        return rv;
+                    }
+                }
 
                 rv = ical_footer(f);
                 if (rv != APR_SUCCESS) {
                     return rv;
                 }
 
-                apr_pool_cleanup_run(f->r->pool, ctx->parser, icalparser_cleanup);
+                ap_log_rerror(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, r,
+                        "converted '%s': %" APR_SIZE_T_FMT " output buffers "
+                        "allocated (%" APR_SIZE_T_FMT " bytes), %"
+                        APR_SIZE_T_FMT " copies made (%" APR_SIZE_T_FMT
+                        " bytes), %" APR_SIZE_T_FMT " bytes of scratch "
+                        "memory at peak", r->uri, ctx->conv.stats.allocs,
+                        ctx->conv.stats.alloc_bytes, ctx->conv.stats.copies,
+                        ctx->conv.stats.copy_bytes,
+                        ctx->conv.stats.scratch_peak);
+
+                apr_pool_cleanup_kill(f->r->pool, ctx->parser,
+                        icalparser_cleanup);
+                thread_parser_release(ctx->thread, ctx->parser);
                 ctx->parser = NULL;
             }
 
+            /* keep what was parsed for the next request */
+            variant_close(f);
+
+            /* give the scratch memory back while still on this thread */
+            apr_pool_cleanup_run(f->r->pool, ctx->scratch, scratch_cleanup);
+            ctx->scratch = NULL;
+
             /* pass the EOS across */
-            APR_BRIGADE_CONCAT(ctx->bb, bb);
+            APR_BRIGADE_CONCAT(ctx->conv.bb, bb);
 
             /* pass what we have down the chain */
             ap_remove_output_filter(f);
-            return ap_pass_brigade(f->next, ctx->bb);
+            return ap_pass_brigade(f->next, ctx->conv.bb);
         }
 
         /* metadata buckets are preserved as is */
@@ -2405,7 +1658,15 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
              * new.
              */
             APR_BUCKET_REMOVE(e);
-            APR_BRIGADE_INSERT_TAIL(ctx->bb, e);
+            APR_BRIGADE_INSERT_TAIL(ctx->conv.bb, e);
+            continue;
+        }
+
+        /* with an index or cached calendars, the calendar itself is not
+         * needed.
+         */
+        if (ctx->index || ctx->variant) {
+            apr_bucket_delete(e);
             continue;
         }
 
@@ -2448,16 +1709,17 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
 
                 /* process the line */
                 else if (!APR_BRIGADE_EMPTY(ctx->tmp)) {
-                    comp = filter_component(f,
-                            timezone_component(f, add_line(f, ctx), NULL));
+                    if (add_line(f, ctx, &comp) != APR_SUCCESS) {
+                        return ical_reject(f, bb);
+                    }
                     if (comp) {
 
-                        rv = ical_write(f, comp);
+                        rv = ical_convert(f, comp, NULL);
                         if (rv != APR_SUCCESS) {
                             return rv;
                         }
 
-                        rv = ap_pass_brigade(f->next, ctx->bb);
+                        rv = ap_pass_brigade(f->next, ctx->conv.bb);
                     }
                     continue;
                 }
@@ -2494,12 +1756,24 @@ static apr_status_t ical_out_filter(ap_filter_t *f, apr_bucket_brigade *bb)
     return rv;
 }
 
+static void *create_ical_server_config(apr_pool_t *p, server_rec *s)
+{
+    ical_server_conf *new = apr_pcalloc(p, sizeof(ical_server_conf));
+
+    new->preload = apr_array_make(p, 4, sizeof(const char *));
+
+    return (void *) new;
+}
+
 static void *create_ical_config(apr_pool_t *p, char *dummy)
 {
     ical_conf *new = (ical_conf *) apr_pcalloc(p, sizeof(ical_conf));
 
     new->filter = DEFAULT_ICAL_FILTER; /* default filter */
     new->format = DEFAULT_ICAL_FORMAT; /* default format */
+    new->index = 1; /* use indexes when present */
+    new->flush_size = DEFAULT_ICAL_FLUSH_SIZE; /* default flush size */
+    new->recur_budget = ICAL_RECUR_BUDGET; /* default recurrence budget */
 
     return (void *) new;
 }
@@ -2518,6 +1792,18 @@ static void *merge_ical_config(apr_pool_t *p, void *basev, void *addv)
     new->format_set = add->format_set || base->format_set;
     new->uid = (add->uid_set == 0) ? base->uid : add->uid;
     new->uid_set = add->uid_set || base->uid_set;
+    new->index = (add->index_set == 0) ? base->index : add->index;
+    new->index_set = add->index_set || base->index_set;
+    new->cache = (add->cache_set == 0) ? base->cache : add->cache;
+    new->cache_set = add->cache_set || base->cache_set;
+    new->flush_size =
+            (add->flush_size_set == 0) ? base->flush_size : add->flush_size;
+    new->flush_size_set = add->flush_size_set || base->flush_size_set;
+    new->utf8 = (add->utf8_set == 0) ? base->utf8 : add->utf8;
+    new->utf8_set = add->utf8_set || base->utf8_set;
+    new->recur_budget = (add->recur_budget_set == 0) ?
+            base->recur_budget : add->recur_budget;
+    new->recur_budget_set = add->recur_budget_set || base->recur_budget_set;
 
     return new;
 }
@@ -2527,7 +1813,10 @@ static const char *set_ical_timezone(cmd_parms *cmd, void *dconf,
 {
     ical_conf *conf = dconf;
 
-    conf->timezone = icaltimezone_get_builtin_timezone(arg);
+    /* create the cache now, so that configured timezones are known */
+    ical_tz_init(cmd->pool);
+
+    conf->timezone = ical_tz_location(arg);
 
     if (!conf->timezone) {
         return "IcalTimezone was not recognised as a valid location";
@@ -2542,7 +1831,7 @@ static const char *set_ical_filter(cmd_parms *cmd, void *dconf, const char *arg)
 {
     ical_conf *conf = dconf;
 
-    conf->filter = parse_filter(arg, strlen(arg));
+    conf->filter = ical_parse_filter(arg, strlen(arg));
 
     if (conf->filter == AP_ICAL_FILTER_UNKNOWN) {
         return "ICalFilter must be one of 'none', 'next', 'last', future' or 'past'";
@@ -2557,7 +1846,7 @@ static const char *set_ical_format(cmd_parms *cmd, void *dconf, const char *arg)
 {
     ical_conf *conf = dconf;
 
-    conf->format = parse_format(arg, strlen(arg));
+    conf->format = ical_parse_format(arg, strlen(arg));
 
     if (conf->format == AP_ICAL_FORMAT_UNKNOWN) {
         return "ICalFormat must be one of 'none', 'spaced' or 'pretty'";
@@ -2587,6 +1876,117 @@ static const char *set_ical_uid(cmd_parms *cmd, void *dconf, const char *arg)
     return NULL;
 }
 
+static const char *set_ical_index(cmd_parms *cmd, void *dconf, int flag)
+{
+    ical_conf *conf = dconf;
+
+    conf->index = flag;
+    conf->index_set = 1;
+
+    return NULL;
+}
+
+static const char *set_ical_cache(cmd_parms *cmd, void *dconf, int flag)
+{
+    ical_conf *conf = dconf;
+
+    conf->cache = flag;
+    conf->cache_set = 1;
+
+    return NULL;
+}
+
+static const char *set_ical_flush_size(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    ical_conf *conf = dconf;
+    apr_off_t size;
+
+    if (apr_strtoff(&size, arg, NULL, 10) != APR_SUCCESS || size < 0) {
+        return "ICalFlushSize must be a size in bytes, or zero";
+    }
+
+    conf->flush_size = (apr_size_t) size;
+    conf->flush_size_set = 1;
+
+    return NULL;
+}
+
+static const char *set_ical_recur_budget(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    ical_conf *conf = dconf;
+    apr_off_t budget;
+
+    if (apr_strtoff(&budget, arg, NULL, 10) != APR_SUCCESS || budget < 0) {
+        return "ICalRecurBudget must be a number of occurrences, or zero";
+    }
+
+    conf->recur_budget = (apr_size_t) budget;
+    conf->recur_budget_set = 1;
+
+    return NULL;
+}
+
+static const char *set_ical_utf8(cmd_parms *cmd, void *dconf, const char *arg)
+{
+    ical_conf *conf = dconf;
+
+    conf->utf8 = ical_parse_utf8(arg, strlen(arg));
+
+    if (conf->utf8 == AP_ICAL_UTF8_UNKNOWN) {
+        return "ICalUTF8 must be one of 'pass', 'replace' or 'reject'";
+    }
+
+    conf->utf8_set = 1;
+
+    return NULL;
+}
+
+static const char *set_ical_preload_timezones(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    ical_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &ical_module);
+
+    if (!strcasecmp(arg, "all")) {
+        sconf->preload_all = 1;
+    }
+    else {
+        APR_ARRAY_PUSH(sconf->preload, const char *) = arg;
+    }
+
+    return NULL;
+}
+
+static const char *set_ical_zoneinfo(cmd_parms *cmd, void *dconf,
+        const char *arg)
+{
+    ical_server_conf *sconf = ap_get_module_config(cmd->server->module_config,
+            &ical_module);
+    const char *err = ap_check_cmd_context(cmd, GLOBAL_ONLY);
+
+    if (err) {
+        return err;
+    }
+
+    if (!strcasecmp(arg, "off")) {
+        sconf->zoneinfo = NULL;
+    }
+    else if (!strcasecmp(arg, "on")) {
+        sconf->zoneinfo = ICAL_ZONEINFO_DIR;
+    }
+    else {
+        sconf->zoneinfo = ap_server_root_relative(cmd->pool, arg);
+        if (!sconf->zoneinfo) {
+            return apr_pstrcat(cmd->pool, "ICalZoneinfo: invalid path '",
+                    arg, "'", NULL);
+        }
+    }
+
+    return NULL;
+}
+
 static const command_rec ical_cmds[] = {
     AP_INIT_TAKE1("ICalTimezone", set_ical_timezone, NULL, ACCESS_CONF,
         "Override the timezone on the calendar to the given location, for example Europe/London"),
@@ -2596,11 +1996,142 @@ static const command_rec ical_cmds[] = {
         "Set the formatting to 'none', 'spaced' or 'pretty'. Defaults to 'none'"),
     AP_INIT_TAKE1("ICalUid", set_ical_uid, NULL, ACCESS_CONF,
 	        "Specify an expression that resolves to the UID of the desired entry. If the result is empty, we fall back to the filter."),
+    AP_INIT_FLAG("ICalIndex", set_ical_index, NULL, ACCESS_CONF,
+        "Use a precompiled index found alongside the calendar when up to date. Defaults to 'on'"),
+    AP_INIT_FLAG("ICalCache", set_ical_cache, NULL, ACCESS_CONF,
+        "Cache the rendered components of calendars served from files. Defaults to 'off'"),
+    AP_INIT_TAKE1("ICalFlushSize", set_ical_flush_size, NULL, ACCESS_CONF,
+        "Pass the converted calendar on to the client every given number of bytes, or zero to pass it on when complete. Defaults to 65536"),
+    AP_INIT_TAKE1("ICalUTF8", set_ical_utf8, NULL, ACCESS_CONF,
+        "Set the handling of calendars containing invalid UTF-8 to 'pass', 'replace' or 'reject'. Defaults to 'pass'"),
+    AP_INIT_TAKE1("ICalRecurBudget", set_ical_recur_budget, NULL, ACCESS_CONF,
+        "Set the most occurrences of recurring entries expanded for each request, or zero to not expand them. Defaults to 100000"),
+    AP_INIT_ITERATE("ICalPreloadTimezones", set_ical_preload_timezones, NULL, RSRC_CONF,
+        "Load the given timezones, or 'all' builtin timezones, before the server starts handling requests"),
+    AP_INIT_TAKE1("ICalZoneinfo", set_ical_zoneinfo, NULL, RSRC_CONF,
+        "Read timezone offsets from the TZif files beneath the given directory, 'on' for " ICAL_ZONEINFO_DIR ", or 'off' for libical. Defaults to 'off'"),
     { NULL }
 };
 
+static int ical_post_config(apr_pool_t *pconf, apr_pool_t *plog,
+        apr_pool_t *ptemp, server_rec *s)
+{
+    ical_server_conf *sconf;
+    server_rec *sv;
+    apr_status_t rv;
+    int count = 0;
+
+    /* timezones loaded now are shared by the children */
+    rv = ical_tz_init(pconf);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "could not create the ical timezone cache, timezones not "
+                "preloaded");
+        return OK;
+    }
+
+    /* the source of the offsets is chosen before any table is built */
+    sconf = ap_get_module_config(s->module_config, &ical_module);
+    ical_tz_zoneinfo(sconf->zoneinfo);
+
+    for (sv = s; sv; sv = sv->next) {
+        ical_server_conf *sconf = ap_get_module_config(sv->module_config,
+                &ical_module);
+        int i;
+
+        if (sconf->preload_all) {
+            count += ical_tz_preload_all();
+        }
+
+        for (i = 0; i < sconf->preload->nelts; i++) {
+            const char *location = APR_ARRAY_IDX(sconf->preload, i,
+                    const char *);
+
+            if (ical_tz_preload(location)) {
+                count++;
+            }
+            else {
+                ap_log_error(APLOG_MARK, APLOG_WARNING, APR_SUCCESS, sv,
+                        "ICalPreloadTimezones: timezone '%s' was not "
+                        "recognised", location);
+            }
+        }
+    }
+
+    if (count) {
+        ap_log_error(APLOG_MARK, APLOG_DEBUG, APR_SUCCESS, s,
+                "preloaded %d timezones", count);
+    }
+
+    /* build the tables of the timezones configured, such as those of
+     * ICalTimezone and ICalPreloadTimezones, once here rather than once
+     * in each child.
+     */
+    ical_tz_build();
+
+    return OK;
+}
+
+static void ical_child_init(apr_pool_t *pchild, server_rec *s)
+{
+    apr_status_t rv;
+
+    /* names and timezones are shared by all threads of the child */
+    ical_names_init(pchild);
+
+    rv = ical_tz_init(pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "could not create the ical timezone cache, cache disabled");
+    }
+
+    /* the threads are yet to start, timezones found so far are read
+     * without locks from now on. Their tables were built before the
+     * children were forked.
+     */
+    ical_tz_freeze();
+
+    rv = ical_recur_init(pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "could not create the ical recurrence cache, cache disabled");
+    }
+
+#if APR_HAS_THREADS
+    rv = apr_threadkey_private_create(&thread_key, thread_destroy, pchild);
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "could not create the ical thread key, thread state disabled");
+        thread_key = NULL;
+    }
+#else
+    thread_single = thread_create();
+#endif
+
+    cache = apr_pcalloc(pchild, sizeof(ical_cache));
+
+    rv = apr_pool_create(&cache->pool, pchild);
+#if APR_HAS_THREADS
+    if (rv == APR_SUCCESS) {
+        rv = apr_thread_mutex_create(&cache->mutex,
+                APR_THREAD_MUTEX_DEFAULT, pchild);
+    }
+#endif
+    if (rv != APR_SUCCESS) {
+        ap_log_error(APLOG_MARK, APLOG_ERR, rv, s,
+                "could not create the ical cache, cache disabled");
+        cache = NULL;
+        return;
+    }
+
+    cache->entries = apr_hash_make(cache->pool);
+    cache->variants = apr_hash_make(cache->pool);
+}
+
 static void ical_hooks(apr_pool_t* pool)
 {
+    ap_hook_post_config(ical_post_config, NULL, NULL, APR_HOOK_MIDDLE);
+    ap_hook_child_init(ical_child_init, NULL, NULL, APR_HOOK_MIDDLE);
     ap_register_output_filter("ICAL", ical_out_filter, ical_out_setup,
             AP_FTYPE_RESOURCE);
     ap_register_output_filter("ICALICAL", ical_out_filter, ical_out_ical_setup,
@@ -2615,7 +2146,7 @@ module AP_MODULE_DECLARE_DATA ical_module = {
   STANDARD20_MODULE_STUFF,
   create_ical_config,
   merge_ical_config,
-  NULL,
+  create_ical_server_config,
   NULL,
   ical_cmds,
   ical_hooks
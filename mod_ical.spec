@@ -42,6 +42,8 @@ RFC6321 xCal / RFC7265 jCal.
 %else
 %{_libdir}/httpd/modules/mod_ical.so
 %endif
+%{_bindir}/icalindex
+%{_bindir}/icalconv
 
 %doc AUTHORS ChangeLog README.md
 %license COPYING